@@ -1,11 +1,20 @@
 #include "FormulaAST.h"
+#include "byte_io.h"
 
+#ifdef SPREADSHEET_WITH_ANTLR
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#endif
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
@@ -72,20 +81,365 @@ namespace ASTImpl {
                          {PR_NONE,  PR_NONE,  PR_NONE,  PR_NONE,  PR_NONE, PR_NONE},
     };
 
-    class Expr {
+    // Binary operators with the overflow checks shared by the tree
+    // evaluation and the compiled program. An error only sets the flag, the
+    // program carries on with whatever the operation produced and reports
+    // the error once it is done.
+    inline double Add(double lhs, double rhs, bool &failed) {
+        const auto res = lhs + rhs;
+        failed |= res == std::numeric_limits<double>::infinity();
+        return res;
+    }
+
+    inline double Subtract(double lhs, double rhs, bool &failed) {
+        const auto res = lhs - rhs;
+        failed |= res == -std::numeric_limits<double>::infinity();
+        return res;
+    }
+
+    inline double Multiply(double lhs, double rhs, bool &failed) {
+        const auto res = lhs * rhs;
+        failed |= res == std::numeric_limits<double>::infinity();
+        return res;
+    }
+
+    inline double Divide(double lhs, double rhs, bool &failed) {
+        const auto res = lhs / rhs;
+        failed |= (rhs == 0) | (res == std::numeric_limits<double>::infinity());
+        return res;
+    }
+
+    // the tree evaluation throws instead
+    template <double (*Op)(double, double, bool &)>
+    double Checked(double lhs, double rhs) {
+        bool failed = false;
+        const auto res = Op(lhs, rhs, failed);
+        if (failed) { throw FormulaError(FormulaError::Category::Div0); }
+        return res;
+    }
+
+    // Running state of one aggregate function. Sums are compensated, so
+    // long columns of numbers add up without losing the small ones.
+    class Aggregate {
     public:
-        virtual ~Expr() = default;
+        using Function = FormulaProgram::Function;
+
+        void Start(Function function) {
+            *this = Aggregate();
+            function_ = function;
+        }
+
+        void Add(double value) {
+            ++count_;
+            AddCompensated(value);
+            min_ = std::min(min_, value);
+            max_ = std::max(max_, value);
+        }
+
+        void AddAll(const double *values, std::size_t count) {
+            count_ += count;
+            switch (function_) {
+                case Function::Sum:
+                case Function::Average:
+                    AddSum(values, count);
+                    break;
+                case Function::Min:
+                    min_ = std::min(min_, Reduce(values, count, min_, [](double a, double b) { return std::min(a, b); }));
+                    break;
+                case Function::Max:
+                    max_ = std::max(max_, Reduce(values, count, max_, [](double a, double b) { return std::max(a, b); }));
+                    break;
+                case Function::Count:
+                    break;
+            }
+        }
+
+        // sets failed for a sum that overflows and the average of nothing
+        double Finish(bool &failed) const {
+            const auto sum = sum_ + compensation_;
+            switch (function_) {
+                case Function::Sum:
+                    failed |= !std::isfinite(sum);
+                    return sum;
+                case Function::Average:
+                    failed |= count_ == 0 || !std::isfinite(sum);
+                    return sum / static_cast<double>(count_);
+                case Function::Min:
+                    return count_ == 0 ? 0.0 : min_;
+                case Function::Max:
+                    return count_ == 0 ? 0.0 : max_;
+                case Function::Count:
+                    return static_cast<double>(count_);
+            }
+            return 0.0;
+        }
+
+    private:
+        // independent lanes keep the loops below free of a serial
+        // dependency, so that they can be vectorized
+        static constexpr std::size_t LANES = 4;
+
+        // Neumaier's variant of Kahan summation
+        void AddCompensated(double value) {
+            const auto sum = sum_ + value;
+            compensation_ += std::abs(sum_) >= std::abs(value) ? (sum_ - sum) + value : (value - sum) + sum_;
+            sum_ = sum;
+        }
+
+        // Kahan summation in every lane, the lanes are added up at the end
+        void AddSum(const double *values, std::size_t count) {
+            double sums[LANES] = {};
+            double errors[LANES] = {};
+            std::size_t i = 0;
+            for (; i + LANES <= count; i += LANES) {
+                for (std::size_t lane = 0; lane < LANES; ++lane) {
+                    const auto value = values[i + lane] - errors[lane];
+                    const auto sum = sums[lane] + value;
+                    errors[lane] = (sum - sums[lane]) - value;
+                    sums[lane] = sum;
+                }
+            }
+            for (std::size_t lane = 0; lane < LANES; ++lane) {
+                AddCompensated(sums[lane]);
+                AddCompensated(-errors[lane]);
+            }
+            for (; i < count; ++i) {
+                AddCompensated(values[i]);
+            }
+        }
+
+        template <class Op>
+        static double Reduce(const double *values, std::size_t count, double init, Op op) {
+            double lanes[LANES] = {init, init, init, init};
+            std::size_t i = 0;
+            for (; i + LANES <= count; i += LANES) {
+                for (std::size_t lane = 0; lane < LANES; ++lane) {
+                    lanes[lane] = op(lanes[lane], values[i + lane]);
+                }
+            }
+            for (; i < count; ++i) {
+                lanes[0] = op(lanes[0], values[i]);
+            }
+            return op(op(lanes[0], lanes[1]), op(lanes[2], lanes[3]));
+        }
+
+        Function function_ = Function::Sum;
+        std::size_t count_ = 0;
+        double sum_ = 0.0;
+        double compensation_ = 0.0;
+        double min_ = std::numeric_limits<double>::infinity();
+        double max_ = -std::numeric_limits<double>::infinity();
+    };
+
+    struct FunctionName {
+        std::string_view name;
+        FormulaProgram::Function function;
+    };
+
+    inline constexpr FunctionName FUNCTION_NAMES[] = {
+            {"SUM",     FormulaProgram::Function::Sum},
+            {"AVERAGE", FormulaProgram::Function::Average},
+            {"MIN",     FormulaProgram::Function::Min},
+            {"MAX",     FormulaProgram::Function::Max},
+            {"COUNT",   FormulaProgram::Function::Count},
+    };
+
+    inline std::optional<FormulaProgram::Function> FindFunction(std::string_view name) {
+        for (const auto &entry: FUNCTION_NAMES) {
+            if (entry.name == name) { return entry.function; }
+        }
+        return std::nullopt;
+    }
+
+    inline std::string_view GetFunctionName(FormulaProgram::Function function) {
+        for (const auto &entry: FUNCTION_NAMES) {
+            if (entry.function == function) { return entry.name; }
+        }
+        return {};
+    }
 
+    inline void PrintCell(std::ostream &out, Position cell) {
+        if (!cell.IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            char buf[Position::MAX_STRING_LENGTH];
+            out.write(buf, static_cast<std::streamsize>(cell.ToChars(buf)));
+        }
+    }
+
+    inline Position Moved(Position cell, Position offset) {
+        return Position{cell.row + offset.row, cell.col + offset.col};
+    }
+
+    // Emits postfix instructions and tracks the stack depth they need.
+    class ProgramCompiler {
+    public:
+        ProgramCompiler(const std::vector<Position> &slots, const std::vector<CellRange> &ranges)
+                : slots_(slots), ranges_(ranges) {
+        }
+
+        void EmitNumber(double value) {
+            FormulaProgram::Instruction instr{};
+            instr.op = FormulaProgram::OpCode::PushNumber;
+            instr.number = value;
+            Emit(instr, 1);
+        }
+
+        void EmitCell(Position cell) {
+            const auto it = std::lower_bound(slots_.begin(), slots_.end(), cell);
+            assert(it != slots_.end() && *it == cell);
+
+            FormulaProgram::Instruction instr{};
+            instr.op = FormulaProgram::OpCode::PushCell;
+            instr.slot = static_cast<std::uint32_t>(it - slots_.begin());
+            Emit(instr, 1);
+        }
+
+        void EmitRange(const CellRange &range) {
+            const auto it = std::lower_bound(ranges_.begin(), ranges_.end(), range);
+            assert(it != ranges_.end() && *it == range);
+
+            FormulaProgram::Instruction instr{};
+            instr.op = FormulaProgram::OpCode::AggRange;
+            instr.range = static_cast<std::uint32_t>(it - ranges_.begin());
+            Emit(instr, 0);
+        }
+
+        void EmitAggBegin(FormulaProgram::Function function) {
+            FormulaProgram::Instruction instr{};
+            instr.op = FormulaProgram::OpCode::AggBegin;
+            instr.function = function;
+            Emit(instr, 0);
+            max_aggregate_depth_ = std::max(max_aggregate_depth_, ++aggregate_depth_);
+        }
+
+        // Arithmetic on constants is folded here, as is a double negation.
+        // The last instruction of an operand is its root, so a constant
+        // operand is a single PushNumber at the end of the code. Operations
+        // that fail are left to the program, which reports the error.
+        void EmitOp(FormulaProgram::OpCode op) {
+            using OpCode = FormulaProgram::OpCode;
+
+            FormulaProgram::Instruction instr{};
+            instr.op = op;
+            if (op == OpCode::AggEnd) {
+                --aggregate_depth_;
+                Emit(instr, 1);
+            } else if (op == OpCode::Negate) {
+                if (EndsWith(OpCode::PushNumber)) {
+                    code_.back().number = -code_.back().number;
+                } else if (EndsWith(OpCode::Negate)) {
+                    code_.pop_back();
+                } else {
+                    Emit(instr, 0);
+                }
+            } else if (!FoldConstants(op)) {
+                Emit(instr, -1);
+            }
+        }
+
+        FormulaProgram Finish() {
+            return FormulaProgram(std::move(code_), max_depth_, max_aggregate_depth_);
+        }
+
+    private:
+        bool EndsWith(FormulaProgram::OpCode op, std::size_t from_end = 0) const {
+            return code_.size() > from_end && code_[code_.size() - 1 - from_end].op == op;
+        }
+
+        // replaces the two constant operands of a binary operator by its result
+        bool FoldConstants(FormulaProgram::OpCode op) {
+            using OpCode = FormulaProgram::OpCode;
+            if (!EndsWith(OpCode::PushNumber) || !EndsWith(OpCode::PushNumber, 1)) { return false; }
+
+            const double lhs = code_[code_.size() - 2].number;
+            const double rhs = code_.back().number;
+            bool failed = false;
+            double result = 0;
+            switch (op) {
+                case OpCode::Add:
+                    result = ASTImpl::Add(lhs, rhs, failed);
+                    break;
+                case OpCode::Subtract:
+                    result = ASTImpl::Subtract(lhs, rhs, failed);
+                    break;
+                case OpCode::Multiply:
+                    result = ASTImpl::Multiply(lhs, rhs, failed);
+                    break;
+                case OpCode::Divide:
+                    result = ASTImpl::Divide(lhs, rhs, failed);
+                    break;
+                default:
+                    return false;
+            }
+            if (failed) { return false; }
+
+            code_.pop_back();
+            code_.back().number = result;
+            --depth_;
+            return true;
+        }
+
+        void Emit(FormulaProgram::Instruction instr, int stack_effect) {
+            code_.push_back(instr);
+            depth_ += stack_effect;
+            max_depth_ = std::max(max_depth_, static_cast<std::size_t>(depth_));
+        }
+
+        const std::vector<Position> &slots_;
+        const std::vector<CellRange> &ranges_;
+        std::vector<FormulaProgram::Instruction> code_;
+        int depth_ = 0;
+        std::size_t max_depth_ = 0;
+        std::size_t aggregate_depth_ = 0;
+        std::size_t max_aggregate_depth_ = 0;
+    };
+
+    // Tags of the serialized nodes. The tree is written in postfix order:
+    // a node follows its operands, so it is read back with a stack.
+    enum class NodeTag : std::uint8_t {
+        Number,       // f64
+        Cell,         // i32 row, i32 col
+        Range,        // the first and the last cell
+        UnaryPlus,
+        UnaryMinus,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Function,     // u8 function, u32 number of arguments
+    };
+
+    // Nodes live in the formula's ExprArena and are never destroyed one by
+    // one, so they must not own anything.
+    class Expr {
+    public:
         virtual void Print(std::ostream &out) const = 0;
 
-        virtual void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const = 0;
+        // cells are printed moved by offset
+        virtual void DoPrintFormula(std::ostream &out, Position offset, ExprPrecedence precedence) const = 0;
 
         virtual double Evaluate(const std::function<double(Position)> &args) const = 0;
 
+        virtual void Compile(ProgramCompiler &compiler) const = 0;
+
+        // appends the subtree in postfix order
+        virtual void Serialize(std::string &out) const = 0;
+
+        // the same for an argument of an aggregate function
+        virtual void Accumulate(const std::function<double(Position)> &args, Aggregate &aggregate) const {
+            aggregate.Add(Evaluate(args));
+        }
+
+        virtual void CompileArgument(ProgramCompiler &compiler) const {
+            Compile(compiler);
+            compiler.EmitOp(FormulaProgram::OpCode::AggValue);
+        }
+
         // higher is tighter
         virtual ExprPrecedence GetPrecedence() const = 0;
 
-        void PrintFormula(std::ostream &out, ExprPrecedence parent_precedence,
+        void PrintFormula(std::ostream &out, Position offset, ExprPrecedence parent_precedence,
                           bool right_child = false) const {
             auto precedence = GetPrecedence();
             auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -94,12 +448,15 @@ namespace ASTImpl {
                 out << '(';
             }
 
-            DoPrintFormula(out, precedence);
+            DoPrintFormula(out, offset, precedence);
 
             if (parens_needed) {
                 out << ')';
             }
         }
+
+    protected:
+        ~Expr() = default;
     };
 
     namespace {
@@ -113,8 +470,8 @@ namespace ASTImpl {
             };
 
         public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-                    : type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {
+            explicit BinaryOpExpr(Type type, const Expr *lhs, const Expr *rhs)
+                    : type_(type), lhs_(lhs), rhs_(rhs) {
             }
 
             void Print(std::ostream &out) const override {
@@ -125,10 +482,10 @@ namespace ASTImpl {
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
+            void DoPrintFormula(std::ostream &out, Position offset, ExprPrecedence precedence) const override {
+                lhs_->PrintFormula(out, offset, precedence);
                 out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+                rhs_->PrintFormula(out, offset, precedence, /* right_child = */ true);
             }
 
             ExprPrecedence GetPrecedence() const override {
@@ -149,43 +506,63 @@ namespace ASTImpl {
             }
 
             double Evaluate(const std::function<double(Position)> &args) const override {
+                const auto lhs = lhs_->Evaluate(args);
+                const auto rhs = rhs_->Evaluate(args);
                 switch (type_) {
                     case Add:
-                        if (auto res = lhs_->Evaluate(args) + rhs_->Evaluate(args);
-                                res == std::numeric_limits<double>::infinity()) {
-                            throw FormulaError(FormulaError::Category::Div0);
-                        } else { return res; }
+                        return Checked<ASTImpl::Add>(lhs, rhs);
                     case Subtract:
-                        if (auto res = lhs_->Evaluate(args) - rhs_->Evaluate(args);
-                                res == -std::numeric_limits<double>::infinity()) {
-                            throw FormulaError(FormulaError::Category::Div0);
-                        } else { return res; }
+                        return Checked<ASTImpl::Subtract>(lhs, rhs);
                     case Multiply:
-                        if (auto res = lhs_->Evaluate(args) * rhs_->Evaluate(args);
-                                res == std::numeric_limits<double>::infinity()) {
-                            throw FormulaError(FormulaError::Category::Div0);
-                        } else { return res; }
-                    case Divide: {
-                        const auto rhs = rhs_->Evaluate(args);
-                        if (rhs == 0) {
-                            throw FormulaError(FormulaError::Category::Div0);
-                        } else {
-                            if (auto res = lhs_->Evaluate(args) / rhs;
-                                    res == std::numeric_limits<double>::infinity()) {
-                                throw FormulaError(FormulaError::Category::Div0);
-                            } else {
-                                return lhs_->Evaluate(args) / rhs;
-                            }
-                        }
-                    }
+                        return Checked<ASTImpl::Multiply>(lhs, rhs);
+                    case Divide:
+                        return Checked<ASTImpl::Divide>(lhs, rhs);
                 }
                 return 0;
             }
 
+            void Compile(ProgramCompiler &compiler) const override {
+                lhs_->Compile(compiler);
+                rhs_->Compile(compiler);
+                switch (type_) {
+                    case Add:
+                        compiler.EmitOp(FormulaProgram::OpCode::Add);
+                        break;
+                    case Subtract:
+                        compiler.EmitOp(FormulaProgram::OpCode::Subtract);
+                        break;
+                    case Multiply:
+                        compiler.EmitOp(FormulaProgram::OpCode::Multiply);
+                        break;
+                    case Divide:
+                        compiler.EmitOp(FormulaProgram::OpCode::Divide);
+                        break;
+                }
+            }
+
+            void Serialize(std::string &out) const override {
+                lhs_->Serialize(out);
+                rhs_->Serialize(out);
+                switch (type_) {
+                    case Add:
+                        AppendBytes(out, NodeTag::Add);
+                        break;
+                    case Subtract:
+                        AppendBytes(out, NodeTag::Subtract);
+                        break;
+                    case Multiply:
+                        AppendBytes(out, NodeTag::Multiply);
+                        break;
+                    case Divide:
+                        AppendBytes(out, NodeTag::Divide);
+                        break;
+                }
+            }
+
         private:
             Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
+            const Expr *lhs_;
+            const Expr *rhs_;
         };
 
         class UnaryOpExpr final : public Expr {
@@ -196,8 +573,8 @@ namespace ASTImpl {
             };
 
         public:
-            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-                    : type_(type), operand_(std::move(operand)) {
+            explicit UnaryOpExpr(Type type, const Expr *operand)
+                    : type_(type), operand_(operand) {
             }
 
             void Print(std::ostream &out) const override {
@@ -206,9 +583,9 @@ namespace ASTImpl {
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override {
+            void DoPrintFormula(std::ostream &out, Position offset, ExprPrecedence precedence) const override {
                 out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
+                operand_->PrintFormula(out, offset, precedence);
             }
 
             ExprPrecedence GetPrecedence() const override {
@@ -225,27 +602,140 @@ namespace ASTImpl {
                 return 0;
             }
 
+            void Compile(ProgramCompiler &compiler) const override {
+                operand_->Compile(compiler);
+                if (type_ == UnaryMinus) {
+                    compiler.EmitOp(FormulaProgram::OpCode::Negate);
+                }
+            }
+
+            void Serialize(std::string &out) const override {
+                operand_->Serialize(out);
+                AppendBytes(out, type_ == UnaryMinus ? NodeTag::UnaryMinus : NodeTag::UnaryPlus);
+            }
+
         private:
             Type type_;
-            std::unique_ptr<Expr> operand_;
+            const Expr *operand_;
         };
 
         class CellExpr final : public Expr {
         public:
-            explicit CellExpr(const Position *cell)
+            explicit CellExpr(Position cell)
                     : cell_(cell) {
             }
 
             void Print(std::ostream &out) const override {
-                if (!cell_->IsValid()) {
-                    out << FormulaError::Category::Ref;
-                } else {
-                    out << cell_->ToString();
+                PrintCell(out, cell_);
+            }
+
+            void DoPrintFormula(std::ostream &out, Position offset, ExprPrecedence /* precedence */) const override {
+                PrintCell(out, Moved(cell_, offset));
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const std::function<double(Position)> &args) const override {
+                return args(cell_);
+            }
+
+            void Compile(ProgramCompiler &compiler) const override {
+                compiler.EmitCell(cell_);
+            }
+
+            void Serialize(std::string &out) const override {
+                AppendBytes(out, NodeTag::Cell);
+                AppendBytes(out, static_cast<std::int32_t>(cell_.row));
+                AppendBytes(out, static_cast<std::int32_t>(cell_.col));
+            }
+
+        private:
+            Position cell_;
+        };
+
+        // A1:B10, only allowed as an argument of an aggregate function
+        class RangeExpr final : public Expr {
+        public:
+            explicit RangeExpr(CellRange range)
+                    : range_(range) {
+            }
+
+            void Print(std::ostream &out) const override {
+                DoPrintFormula(out, Position{0, 0}, EP_ATOM);
+            }
+
+            void DoPrintFormula(std::ostream &out, Position offset, ExprPrecedence /* precedence */) const override {
+                PrintCell(out, Moved(range_.first, offset));
+                // a lone cell argument is a range of one cell
+                if (!(range_.last == range_.first)) {
+                    out << ':';
+                    PrintCell(out, Moved(range_.last, offset));
+                }
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const std::function<double(Position)> & /* args */) const override {
+                // the parser puts ranges only into function calls
+                assert(false);
+                throw FormulaError(FormulaError::Category::Value);
+            }
+
+            void Compile(ProgramCompiler &compiler) const override {
+                compiler.EmitRange(range_);
+            }
+
+            void Serialize(std::string &out) const override {
+                AppendBytes(out, NodeTag::Range);
+                for (const auto cell: {range_.first, range_.last}) {
+                    AppendBytes(out, static_cast<std::int32_t>(cell.row));
+                    AppendBytes(out, static_cast<std::int32_t>(cell.col));
+                }
+            }
+
+            void Accumulate(const std::function<double(Position)> &args, Aggregate &aggregate) const override {
+                for (int col = range_.first.col; col <= range_.last.col; ++col) {
+                    for (int row = range_.first.row; row <= range_.last.row; ++row) {
+                        aggregate.Add(args(Position{row, col}));
+                    }
+                }
+            }
+
+            void CompileArgument(ProgramCompiler &compiler) const override {
+                Compile(compiler);
+            }
+
+        private:
+            CellRange range_;
+        };
+
+        class FunctionExpr final : public Expr {
+        public:
+            // args is an array of count nodes allocated in the same arena
+            FunctionExpr(FormulaProgram::Function function, const Expr *const *args, std::uint32_t count)
+                    : function_(function), args_(args), count_(count) {
+            }
+
+            void Print(std::ostream &out) const override {
+                out << '(' << GetFunctionName(function_);
+                for (std::uint32_t i = 0; i < count_; ++i) {
+                    out << ' ';
+                    args_[i]->Print(out);
                 }
+                out << ')';
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            void DoPrintFormula(std::ostream &out, Position offset, ExprPrecedence /* precedence */) const override {
+                out << GetFunctionName(function_) << '(';
+                for (std::uint32_t i = 0; i < count_; ++i) {
+                    if (i > 0) { out << ','; }
+                    args_[i]->PrintFormula(out, offset, EP_ATOM);
+                }
+                out << ')';
             }
 
             ExprPrecedence GetPrecedence() const override {
@@ -253,11 +743,39 @@ namespace ASTImpl {
             }
 
             double Evaluate(const std::function<double(Position)> &args) const override {
-                return args(*cell_);
+                Aggregate aggregate;
+                aggregate.Start(function_);
+                for (std::uint32_t i = 0; i < count_; ++i) {
+                    args_[i]->Accumulate(args, aggregate);
+                }
+
+                bool failed = false;
+                const auto res = aggregate.Finish(failed);
+                if (failed) { throw FormulaError(FormulaError::Category::Div0); }
+                return res;
+            }
+
+            void Compile(ProgramCompiler &compiler) const override {
+                compiler.EmitAggBegin(function_);
+                for (std::uint32_t i = 0; i < count_; ++i) {
+                    args_[i]->CompileArgument(compiler);
+                }
+                compiler.EmitOp(FormulaProgram::OpCode::AggEnd);
+            }
+
+            void Serialize(std::string &out) const override {
+                for (std::uint32_t i = 0; i < count_; ++i) {
+                    args_[i]->Serialize(out);
+                }
+                AppendBytes(out, NodeTag::Function);
+                AppendBytes(out, function_);
+                AppendBytes(out, count_);
             }
 
         private:
-            const Position *cell_;
+            FormulaProgram::Function function_;
+            const Expr *const *args_;
+            std::uint32_t count_;
         };
 
         class NumberExpr final : public Expr {
@@ -270,7 +788,7 @@ namespace ASTImpl {
                 out << value_;
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override {
+            void DoPrintFormula(std::ostream &out, Position /* offset */, ExprPrecedence /* precedence */) const override {
                 out << value_;
             }
 
@@ -282,29 +800,397 @@ namespace ASTImpl {
                 return value_;
             }
 
+            void Compile(ProgramCompiler &compiler) const override {
+                compiler.EmitNumber(value_);
+            }
+
+            void Serialize(std::string &out) const override {
+                AppendBytes(out, NodeTag::Number);
+                AppendBytes(out, value_);
+            }
+
         private:
             double value_;
         };
 
+        // Recursive descent parser for the Formula.g4 grammar. Tokens are lexed
+        // on the fly straight from the input, so the only allocations made are
+        // the AST nodes and the list of cells.
+        class FormulaReader {
+        public:
+            FormulaReader(std::string_view input, ExprArena &arena) : input_(input), arena_(arena) {
+            }
+
+            const Expr *ParseMain() {
+                auto root = ParseExpr(BINARY_ADD_PRECEDENCE);
+                if (Peek() != Token::End) {
+                    throw ParsingError("Unexpected symbol at " + std::to_string(token_begin_));
+                }
+                return root;
+            }
+
+            std::vector<Position> MoveCells() {
+                return std::move(cells_);
+            }
+
+            std::vector<CellRange> MoveRanges() {
+                return std::move(ranges_);
+            }
+
+            // Appends the tokens of the input to key with the cells written
+            // relative to the anchor. Throws on what the lexer rejects.
+            void AppendShapeKey(Position anchor, std::string &key) {
+                for (; Peek() != Token::End; Consume()) {
+                    if (token_ != Token::Cell) {
+                        key += TokenText();
+                        key += ' ';
+                        continue;
+                    }
+
+                    const auto cell = Position::FromString(TokenText());
+                    if (!cell.IsValid()) {
+                        throw FormulaException("Invalid position: " + std::string(TokenText()));
+                    }
+                    key += 'R';
+                    key += std::to_string(cell.row - anchor.row);
+                    key += 'C';
+                    key += std::to_string(cell.col - anchor.col);
+                    key += ' ';
+                }
+            }
+
+        private:
+            enum class Token {
+                End,
+                Number,
+                Cell,
+                Add,
+                Sub,
+                Mul,
+                Div,
+                LeftParen,
+                RightParen,
+                Colon,
+                Comma,
+                Function,
+            };
+
+            // binding power of the binary operators, unary ones bind tighter than any
+            static constexpr int BINARY_ADD_PRECEDENCE = 1;
+            static constexpr int BINARY_MUL_PRECEDENCE = 2;
+
+            static bool IsDigit(char c) {
+                return c >= '0' && c <= '9';
+            }
+
+            static bool IsUpper(char c) {
+                return c >= 'A' && c <= 'Z';
+            }
+
+            const Expr *ParseExpr(int min_precedence) {
+                return ParseBinaryRest(ParseUnary(), min_precedence);
+            }
+
+            // continues an expression whose leftmost operand is already parsed
+            const Expr *ParseBinaryRest(const Expr *lhs, int min_precedence) {
+                while (true) {
+                    BinaryOpExpr::Type type;
+                    int precedence;
+                    switch (Peek()) {
+                        case Token::Add:
+                            type = BinaryOpExpr::Add;
+                            precedence = BINARY_ADD_PRECEDENCE;
+                            break;
+                        case Token::Sub:
+                            type = BinaryOpExpr::Subtract;
+                            precedence = BINARY_ADD_PRECEDENCE;
+                            break;
+                        case Token::Mul:
+                            type = BinaryOpExpr::Multiply;
+                            precedence = BINARY_MUL_PRECEDENCE;
+                            break;
+                        case Token::Div:
+                            type = BinaryOpExpr::Divide;
+                            precedence = BINARY_MUL_PRECEDENCE;
+                            break;
+                        default:
+                            return lhs;
+                    }
+                    if (precedence < min_precedence) {
+                        return lhs;
+                    }
+
+                    Consume();
+                    // left associative: the right operand only takes tighter operators
+                    auto rhs = ParseExpr(precedence + 1);
+                    lhs = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+                }
+            }
+
+            const Expr *ParseUnary() {
+                switch (Peek()) {
+                    case Token::Add:
+                        Consume();
+                        return arena_.Make<UnaryOpExpr>(UnaryOpExpr::UnaryPlus, ParseUnary());
+                    case Token::Sub:
+                        Consume();
+                        return arena_.Make<UnaryOpExpr>(UnaryOpExpr::UnaryMinus, ParseUnary());
+                    default:
+                        return ParsePrimary();
+                }
+            }
+
+            const Expr *ParsePrimary() {
+                switch (Peek()) {
+                    case Token::LeftParen: {
+                        Consume();
+                        auto expr = ParseExpr(BINARY_ADD_PRECEDENCE);
+                        if (Peek() != Token::RightParen) {
+                            throw ParsingError("Expected ')' at " + std::to_string(token_begin_));
+                        }
+                        Consume();
+                        return expr;
+                    }
+                    case Token::Number: {
+                        auto node = arena_.Make<NumberExpr>(ParseNumber(TokenText()));
+                        Consume();
+                        return node;
+                    }
+                    case Token::Cell: {
+                        const auto value = ParseCell();
+                        cells_.push_back(value);
+                        return arena_.Make<CellExpr>(value);
+                    }
+                    case Token::Function:
+                        return ParseFunction();
+                    default:
+                        throw ParsingError("Unexpected token at " + std::to_string(token_begin_));
+                }
+            }
+
+            Position ParseCell() {
+                const auto value_str = TokenText();
+                const auto value = Position::FromString(value_str);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + std::string(value_str));
+                }
+                Consume();
+                return value;
+            }
+
+            void Expect(Token token, char symbol) {
+                if (Peek() != token) {
+                    throw ParsingError(std::string("Expected '") + symbol + "' at " + std::to_string(token_begin_));
+                }
+                Consume();
+            }
+
+            // FUNCTION '(' arg (',' arg)* ')'
+            const Expr *ParseFunction() {
+                const auto function = *FindFunction(TokenText());
+                Consume();
+                Expect(Token::LeftParen, '(');
+
+                std::vector<const Expr *> args;
+                while (true) {
+                    args.push_back(ParseArgument());
+                    if (Peek() != Token::Comma) {
+                        break;
+                    }
+                    Consume();
+                }
+                Expect(Token::RightParen, ')');
+
+                auto arg_array = arena_.MakeArray<const Expr *>(args.size());
+                std::copy(args.begin(), args.end(), arg_array);
+                return arena_.Make<FunctionExpr>(function, arg_array, static_cast<std::uint32_t>(args.size()));
+            }
+
+            // A range or a lone cell, which is read as a range of one cell so
+            // that it is skipped when empty, or else any expression.
+            const Expr *ParseArgument() {
+                if (Peek() != Token::Cell) {
+                    return ParseExpr(BINARY_ADD_PRECEDENCE);
+                }
+
+                const auto first = ParseCell();
+                switch (Peek()) {
+                    case Token::Colon: {
+                        Consume();
+                        if (Peek() != Token::Cell) {
+                            throw ParsingError("Expected a cell at " + std::to_string(token_begin_));
+                        }
+                        const auto range = CellRange::Normalized(first, ParseCell());
+                        ranges_.push_back(range);
+                        return arena_.Make<RangeExpr>(range);
+                    }
+                    case Token::Comma:
+                    case Token::RightParen:
+                        ranges_.push_back(CellRange{first, first});
+                        return arena_.Make<RangeExpr>(CellRange{first, first});
+                    default:
+                        cells_.push_back(first);
+                        return ParseBinaryRest(arena_.Make<CellExpr>(first), BINARY_ADD_PRECEDENCE);
+                }
+            }
+
+            static double ParseNumber(std::string_view text) {
+                double value = 0;
+                const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+                if (ec == std::errc::result_out_of_range) {
+                    // the stream extraction this replaces accepted underflow and rejected overflow
+                    value = std::strtod(std::string(text).c_str(), nullptr);
+                    if (std::isinf(value)) {
+                        throw ParsingError("Invalid number: " + std::string(text));
+                    }
+                } else if (ec != std::errc{} || ptr != text.data() + text.size()) {
+                    throw ParsingError("Invalid number: " + std::string(text));
+                }
+                return value;
+            }
+
+            std::string_view TokenText() const {
+                return input_.substr(token_begin_, token_end_ - token_begin_);
+            }
+
+            Token Peek() {
+                if (!has_token_) {
+                    token_ = Lex();
+                    has_token_ = true;
+                }
+                return token_;
+            }
+
+            void Consume() {
+                Peek();
+                has_token_ = false;
+                pos_ = token_end_;
+            }
+
+            std::size_t SkipDigits(std::size_t i) const {
+                while (i < input_.size() && IsDigit(input_[i])) {
+                    ++i;
+                }
+                return i;
+            }
+
+            // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            std::size_t LexNumber(std::size_t i) const {
+                i = SkipDigits(i);
+                if (i + 1 < input_.size() && input_[i] == '.' && IsDigit(input_[i + 1])) {
+                    i = SkipDigits(i + 1);
+                }
+                if (i < input_.size() && (input_[i] == 'e' || input_[i] == 'E')) {
+                    auto exponent = i + 1;
+                    if (exponent < input_.size() && (input_[exponent] == '+' || input_[exponent] == '-')) {
+                        ++exponent;
+                    }
+                    if (exponent < input_.size() && IsDigit(input_[exponent])) {
+                        i = SkipDigits(exponent);
+                    }
+                }
+                return i;
+            }
+
+            Token Lex() {
+                while (pos_ < input_.size()
+                       && (input_[pos_] == ' ' || input_[pos_] == '\t' || input_[pos_] == '\n' || input_[pos_] == '\r')) {
+                    ++pos_;
+                }
+
+                token_begin_ = pos_;
+                token_end_ = pos_ + 1;
+                if (pos_ == input_.size()) {
+                    token_end_ = pos_;
+                    return Token::End;
+                }
+
+                const char c = input_[pos_];
+                switch (c) {
+                    case '+':
+                        return Token::Add;
+                    case '-':
+                        return Token::Sub;
+                    case '*':
+                        return Token::Mul;
+                    case '/':
+                        return Token::Div;
+                    case '(':
+                        return Token::LeftParen;
+                    case ')':
+                        return Token::RightParen;
+                    case ':':
+                        return Token::Colon;
+                    case ',':
+                        return Token::Comma;
+                    default:
+                        break;
+                }
+
+                if (IsDigit(c) || (c == '.' && pos_ + 1 < input_.size() && IsDigit(input_[pos_ + 1]))) {
+                    token_end_ = LexNumber(pos_);
+                    return Token::Number;
+                }
+
+                // CELL: [A-Z]+[0-9]+, otherwise the letters must name a function
+                if (IsUpper(c)) {
+                    auto i = pos_;
+                    while (i < input_.size() && IsUpper(input_[i])) {
+                        ++i;
+                    }
+                    if (i < input_.size() && IsDigit(input_[i])) {
+                        token_end_ = SkipDigits(i);
+                        return Token::Cell;
+                    }
+                    if (FindFunction(input_.substr(pos_, i - pos_))) {
+                        token_end_ = i;
+                        return Token::Function;
+                    }
+                }
+
+                throw ParsingError("Error when lexing at " + std::to_string(pos_));
+            }
+
+            std::string_view input_;
+            ExprArena &arena_;
+            std::size_t pos_ = 0;
+
+            Token token_ = Token::End;
+            bool has_token_ = false;
+            std::size_t token_begin_ = 0;
+            std::size_t token_end_ = 0;
+
+            std::vector<Position> cells_;
+            std::vector<CellRange> ranges_;
+        };
+
+#ifdef SPREADSHEET_WITH_ANTLR
         class ParseASTListener final : public FormulaBaseListener {
         public:
-            std::unique_ptr<Expr> MoveRoot() {
+            explicit ParseASTListener(ExprArena &arena) : arena_(arena) {
+            }
+
+            const Expr *MoveRoot() {
                 assert(args_.size() == 1);
-                auto root = std::move(args_.front());
+                auto root = args_.front();
                 args_.clear();
 
                 return root;
             }
 
-            std::forward_list<Position> MoveCells() {
+            std::vector<Position> MoveCells() {
                 return std::move(cells_);
             }
 
+            std::vector<CellRange> MoveRanges() {
+                return std::move(ranges_);
+            }
+
         public:
             void exitUnaryOp(FormulaParser::UnaryOpContext *ctx) override {
                 assert(args_.size() >= 1);
 
-                auto operand = std::move(args_.back());
+                auto operand = args_.back();
 
                 UnaryOpExpr::Type type;
                 if (ctx->SUB()) {
@@ -314,8 +1200,8 @@ namespace ASTImpl {
                     type = UnaryOpExpr::UnaryPlus;
                 }
 
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                args_.back() = std::move(node);
+                auto node = arena_.Make<UnaryOpExpr>(type, operand);
+                args_.back() = node;
             }
 
             void exitLiteral(FormulaParser::LiteralContext *ctx) override {
@@ -327,8 +1213,8 @@ namespace ASTImpl {
                     throw ParsingError("Invalid number: " + valueStr);
                 }
 
-                auto node = std::make_unique<NumberExpr>(value);
-                args_.push_back(std::move(node));
+                auto node = arena_.Make<NumberExpr>(value);
+                args_.push_back(node);
             }
 
             void exitCell(FormulaParser::CellContext *ctx) override {
@@ -338,18 +1224,39 @@ namespace ASTImpl {
                     throw FormulaException("Invalid position: " + value_str);
                 }
 
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
-                args_.push_back(std::move(node));
+                cells_.push_back(value);
+                auto node = arena_.Make<CellExpr>(value);
+                args_.push_back(node);
+            }
+
+            void exitRange(FormulaParser::RangeContext *ctx) override {
+                const auto first = ToPosition(ctx->CELL(0));
+                const auto last = ctx->CELL().size() > 1 ? ToPosition(ctx->CELL(1)) : first;
+
+                const auto range = CellRange::Normalized(first, last);
+                ranges_.push_back(range);
+                args_.push_back(arena_.Make<RangeExpr>(range));
+            }
+
+            void exitFunction(FormulaParser::FunctionContext *ctx) override {
+                const auto count = ctx->arg().size();
+                assert(args_.size() >= count);
+
+                auto arg_array = arena_.MakeArray<const Expr *>(count);
+                std::copy(args_.end() - static_cast<std::ptrdiff_t>(count), args_.end(), arg_array);
+                args_.resize(args_.size() - count);
+
+                const auto function = *FindFunction(ctx->FUNCTION()->getSymbol()->getText());
+                args_.push_back(arena_.Make<FunctionExpr>(function, arg_array, static_cast<std::uint32_t>(count)));
             }
 
             void exitBinaryOp(FormulaParser::BinaryOpContext *ctx) override {
                 assert(args_.size() >= 2);
 
-                auto rhs = std::move(args_.back());
+                auto rhs = args_.back();
                 args_.pop_back();
 
-                auto lhs = std::move(args_.back());
+                auto lhs = args_.back();
 
                 BinaryOpExpr::Type type;
                 if (ctx->ADD()) {
@@ -363,8 +1270,8 @@ namespace ASTImpl {
                     type = BinaryOpExpr::Divide;
                 }
 
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                args_.back() = std::move(node);
+                auto node = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+                args_.back() = node;
             }
 
             void visitErrorNode(antlr4::tree::ErrorNode *node) override {
@@ -372,8 +1279,19 @@ namespace ASTImpl {
             }
 
         private:
-            std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
+            static Position ToPosition(antlr4::tree::TerminalNode *node) {
+                auto value_str = node->getSymbol()->getText();
+                auto value = Position::FromString(value_str);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + value_str);
+                }
+                return value;
+            }
+
+            ExprArena &arena_;
+            std::vector<const Expr *> args_;
+            std::vector<Position> cells_;
+            std::vector<CellRange> ranges_;
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener {
@@ -385,11 +1303,42 @@ namespace ASTImpl {
                 throw ParsingError("Error when lexing: " + msg);
             }
         };
+#endif
 
     }  // namespace
 }  // namespace ASTImpl
 
+FormulaAST ParseFormulaAST(std::string_view in_str) {
+    try {
+        ExprArena arena;
+        ASTImpl::FormulaReader reader(in_str, arena);
+        const auto root = reader.ParseMain();
+        auto cells = reader.MoveCells();
+        return FormulaAST(std::move(arena), root, std::move(cells), reader.MoveRanges());
+    } catch (...) {
+        throw FormulaException("Incorrect formula");
+    }
+}
+
+std::string MakeFormulaShapeKey(std::string_view expression, Position anchor) {
+    std::string key;
+    key.reserve(expression.size() + 8);
+    try {
+        ExprArena unused;
+        ASTImpl::FormulaReader(expression, unused).AppendShapeKey(anchor, key);
+    } catch (...) {
+        return {};
+    }
+    return key;
+}
+
 FormulaAST ParseFormulaAST(std::istream &in) {
+    const std::string in_str{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(in_str);
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
+FormulaAST ParseFormulaASTWithAntlr(std::istream &in) {
     using namespace antlr4;
     try {
         ANTLRInputStream input(in);
@@ -407,19 +1356,23 @@ FormulaAST ParseFormulaAST(std::istream &in) {
         parser.removeErrorListeners();
 
         tree::ParseTree *tree = parser.main();
-        ASTImpl::ParseASTListener listener;
+        ExprArena arena;
+        ASTImpl::ParseASTListener listener(arena);
         tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-        return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+        const auto root = listener.MoveRoot();
+        auto cells = listener.MoveCells();
+        return FormulaAST(std::move(arena), root, std::move(cells), listener.MoveRanges());
     } catch (...) {
         throw FormulaException("Incorrect formula");
     }
 }
 
-FormulaAST ParseFormulaAST(const std::string &in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+FormulaAST ParseFormulaASTWithAntlr(std::string_view in_str) {
+    std::istringstream in{std::string(in_str)};
+    return ParseFormulaASTWithAntlr(in);
 }
+#endif
 
 void FormulaAST::PrintCells(std::ostream &out) const {
     for (auto cell: cells_) {
@@ -431,17 +1384,263 @@ void FormulaAST::Print(std::ostream &out) const {
     root_expr_->Print(out);
 }
 
-void FormulaAST::PrintFormula(std::ostream &out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream &out, Position offset) const {
+    root_expr_->PrintFormula(out, offset, ASTImpl::EP_ATOM);
 }
 
 double FormulaAST::Execute(const std::function<double(Position)> &args) const {
     return root_expr_->Evaluate(args);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-        : root_expr_(std::move(root_expr)), cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+FormulaAST::FormulaAST(ExprArena arena, const ASTImpl::Expr *root_expr,
+                       std::vector<Position> cells, std::vector<CellRange> ranges)
+        : arena_(std::move(arena)), root_expr_(root_expr), cells_(std::move(cells)), ranges_(std::move(ranges)) {
+    // to avoid sorting in GetReferencedCells and to number the program slots
+    std::sort(cells_.begin(), cells_.end());
+    cells_.erase(std::unique(cells_.begin(), cells_.end()), cells_.end());
+    std::sort(ranges_.begin(), ranges_.end());
+    ranges_.erase(std::unique(ranges_.begin(), ranges_.end()), ranges_.end());
+
+    ASTImpl::ProgramCompiler compiler(cells_, ranges_);
+    root_expr_->Compile(compiler);
+    program_ = compiler.Finish();
+}
+
+void FormulaAST::Serialize(std::string &out) const {
+    root_expr_->Serialize(out);
+}
+
+FormulaAST DeserializeFormulaAST(std::string_view data) {
+    using namespace ASTImpl;
+
+    // the nodes read so far whose parent has not come yet; a range can only
+    // be an argument of a function
+    struct Operand {
+        const Expr *expr;
+        bool is_range;
+    };
+    std::vector<Operand> operands;
+    std::vector<Position> cells;
+    std::vector<CellRange> ranges;
+    ExprArena arena;
+
+    ByteReader reader(data);
+    const auto fail = [] {
+        return ParsingError("Corrupt formula tree");
+    };
+    const auto read_cell = [&] {
+        std::int32_t row = 0;
+        std::int32_t col = 0;
+        if (!reader.Read(row) || !reader.Read(col)) { throw fail(); }
+        // the parser only makes valid cells
+        const Position cell{row, col};
+        if (!cell.IsValid()) { throw fail(); }
+        return cell;
+    };
+    const auto pop = [&] {
+        if (operands.empty() || operands.back().is_range) { throw fail(); }
+        const auto expr = operands.back().expr;
+        operands.pop_back();
+        return expr;
+    };
+
+    while (!reader.AtEnd()) {
+        NodeTag tag{};
+        reader.Read(tag);
+        switch (tag) {
+            case NodeTag::Number: {
+                double value = 0;
+                if (!reader.Read(value)) { throw fail(); }
+                operands.push_back({arena.Make<NumberExpr>(value), false});
+                break;
+            }
+            case NodeTag::Cell: {
+                const auto cell = read_cell();
+                cells.push_back(cell);
+                operands.push_back({arena.Make<CellExpr>(cell), false});
+                break;
+            }
+            case NodeTag::Range: {
+                const auto first = read_cell();
+                const auto last = read_cell();
+                if (!(CellRange::Normalized(first, last) == CellRange{first, last})) { throw fail(); }
+                ranges.push_back(CellRange{first, last});
+                operands.push_back({arena.Make<RangeExpr>(CellRange{first, last}), true});
+                break;
+            }
+            case NodeTag::UnaryPlus:
+            case NodeTag::UnaryMinus: {
+                const auto operand = pop();
+                const auto type = tag == NodeTag::UnaryMinus ? UnaryOpExpr::UnaryMinus : UnaryOpExpr::UnaryPlus;
+                operands.push_back({arena.Make<UnaryOpExpr>(type, operand), false});
+                break;
+            }
+            case NodeTag::Add:
+            case NodeTag::Subtract:
+            case NodeTag::Multiply:
+            case NodeTag::Divide: {
+                const auto rhs = pop();
+                const auto lhs = pop();
+                const auto type = tag == NodeTag::Add ? BinaryOpExpr::Add
+                                  : tag == NodeTag::Subtract ? BinaryOpExpr::Subtract
+                                  : tag == NodeTag::Multiply ? BinaryOpExpr::Multiply
+                                  : BinaryOpExpr::Divide;
+                operands.push_back({arena.Make<BinaryOpExpr>(type, lhs, rhs), false});
+                break;
+            }
+            case NodeTag::Function: {
+                FormulaProgram::Function function{};
+                std::uint32_t count = 0;
+                if (!reader.Read(function) || !reader.Read(count)
+                    || function > FormulaProgram::Function::Count || count == 0 || count > operands.size()) {
+                    throw fail();
+                }
+                const auto args = arena.MakeArray<const Expr *>(count);
+                const auto first = operands.end() - count;
+                for (std::uint32_t i = 0; i < count; ++i) {
+                    args[i] = first[i].expr;
+                }
+                operands.erase(first, operands.end());
+                operands.push_back({arena.Make<FunctionExpr>(function, args, count), false});
+                break;
+            }
+            default:
+                throw fail();
+        }
+    }
+
+    const auto root = pop();
+    if (!operands.empty()) { throw fail(); }
+    return FormulaAST(std::move(arena), root, std::move(cells), std::move(ranges));
+}
+
+FormulaProgram::FormulaProgram(std::vector<Instruction> code, std::size_t stack_depth, std::size_t aggregate_depth)
+        : code_(std::move(code)), stack_depth_(stack_depth), aggregate_depth_(aggregate_depth) {
+}
+
+namespace {
+    FormulaProgram::Result RunProgram(const std::vector<FormulaProgram::Instruction> &code,
+                                      const double *slot_values, const FormulaProgram::RangeValues *range_values,
+                                      double *stack, ASTImpl::Aggregate *aggregates) {
+        using OpCode = FormulaProgram::OpCode;
+
+        // top points past the last pushed value, aggregate at the innermost open one
+        double *top = stack;
+        ASTImpl::Aggregate *aggregate = aggregates - 1;
+        bool failed = false;
+        for (const auto &instr: code) {
+            switch (instr.op) {
+                case OpCode::PushNumber:
+                    *top++ = instr.number;
+                    break;
+                case OpCode::PushCell:
+                    *top++ = slot_values[instr.slot];
+                    break;
+                case OpCode::Add:
+                    --top;
+                    top[-1] = ASTImpl::Add(top[-1], *top, failed);
+                    break;
+                case OpCode::Subtract:
+                    --top;
+                    top[-1] = ASTImpl::Subtract(top[-1], *top, failed);
+                    break;
+                case OpCode::Multiply:
+                    --top;
+                    top[-1] = ASTImpl::Multiply(top[-1], *top, failed);
+                    break;
+                case OpCode::Divide:
+                    --top;
+                    top[-1] = ASTImpl::Divide(top[-1], *top, failed);
+                    break;
+                case OpCode::Negate:
+                    top[-1] = -top[-1];
+                    break;
+                case OpCode::AggBegin:
+                    (++aggregate)->Start(instr.function);
+                    break;
+                case OpCode::AggValue:
+                    aggregate->Add(*--top);
+                    break;
+                case OpCode::AggRange:
+                    aggregate->AddAll(range_values[instr.range].data, range_values[instr.range].size);
+                    break;
+                case OpCode::AggEnd:
+                    *top++ = (aggregate--)->Finish(failed);
+                    break;
+            }
+        }
+
+        assert(top == stack + 1);
+        if (failed) { return FormulaError(FormulaError::Category::Div0); }
+        return *stack;
+    }
+}  // namespace
+
+FormulaProgram::Result FormulaProgram::Execute(const double *slot_values, const RangeValues *range_values) const {
+    constexpr std::size_t INLINE_STACK_SIZE = 32;
+    constexpr std::size_t INLINE_AGGREGATE_COUNT = 8;
+
+    if (stack_depth_ <= INLINE_STACK_SIZE && aggregate_depth_ <= INLINE_AGGREGATE_COUNT) {
+        double stack[INLINE_STACK_SIZE];
+        ASTImpl::Aggregate aggregates[INLINE_AGGREGATE_COUNT];
+        return RunProgram(code_, slot_values, range_values, stack, aggregates);
+    }
+
+    std::vector<double> stack(stack_depth_);
+    std::vector<ASTImpl::Aggregate> aggregates(aggregate_depth_);
+    return RunProgram(code_, slot_values, range_values, stack.data(), aggregates.data());
 }
 
 FormulaAST::~FormulaAST() = default;
+
+std::size_t FormulaAST::GetMemoryUsage() const {
+    return arena_.GetAllocatedBytes() + cells_.capacity() * sizeof(Position)
+           + ranges_.capacity() * sizeof(CellRange)
+           + program_.GetCode().capacity() * sizeof(FormulaProgram::Instruction);
+}
+
+ExprArena::ExprArena(ExprArena &&other) noexcept
+        : head_(std::exchange(other.head_, nullptr)), pos_(std::exchange(other.pos_, nullptr)),
+          end_(std::exchange(other.end_, nullptr)), allocated_(std::exchange(other.allocated_, 0)) {
+}
+
+ExprArena &ExprArena::operator=(ExprArena &&other) noexcept {
+    if (this != &other) {
+        Release();
+        head_ = std::exchange(other.head_, nullptr);
+        pos_ = std::exchange(other.pos_, nullptr);
+        end_ = std::exchange(other.end_, nullptr);
+        allocated_ = std::exchange(other.allocated_, 0);
+    }
+    return *this;
+}
+
+ExprArena::~ExprArena() {
+    Release();
+}
+
+void *ExprArena::Allocate(std::size_t size) {
+    size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    if (static_cast<std::size_t>(end_ - pos_) < size) {
+        const auto capacity = std::max(size, head_ ? 2 * static_cast<std::size_t>(end_ - FirstByte(head_))
+                                                   : FIRST_BLOCK_SIZE);
+        auto block = static_cast<Block *>(::operator new(sizeof(Block) + capacity));
+        allocated_ += sizeof(Block) + capacity;
+        block->next = head_;
+        head_ = block;
+        pos_ = FirstByte(block);
+        end_ = pos_ + capacity;
+    }
+
+    void *result = pos_;
+    pos_ += size;
+    return result;
+}
+
+void ExprArena::Release() {
+    while (head_) {
+        ::operator delete(std::exchange(head_, head_->next));
+    }
+    pos_ = end_ = nullptr;
+    allocated_ = 0;
+}
@@ -1,11 +1,18 @@
 #pragma once
 
-#include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
     class Expr;
@@ -15,10 +22,140 @@ class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// Bump allocator for the nodes of one formula's AST. A small formula fits in
+// a single block and the whole tree is released at once with the arena, which
+// never runs node destructors.
+class ExprArena {
+public:
+    ExprArena() = default;
+
+    ExprArena(ExprArena &&other) noexcept;
+
+    ExprArena &operator=(ExprArena &&other) noexcept;
+
+    ~ExprArena();
+
+    template <class T, class... Args>
+    const T *Make(Args &&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena nodes are never destroyed");
+        static_assert(alignof(T) <= ALIGNMENT);
+        return new(Allocate(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // uninitialized room for count objects of a trivial type
+    template <class T>
+    T *MakeArray(std::size_t count) {
+        static_assert(std::is_trivial_v<T>);
+        static_assert(alignof(T) <= ALIGNMENT);
+        return static_cast<T *>(Allocate(count * sizeof(T)));
+    }
+
+    // bytes of all the blocks
+    std::size_t GetAllocatedBytes() const {
+        return allocated_;
+    }
+
+private:
+    static constexpr std::size_t ALIGNMENT = alignof(std::max_align_t);
+    static constexpr std::size_t FIRST_BLOCK_SIZE = 128;
+
+    struct alignas(ALIGNMENT) Block {
+        Block *next;
+    };
+
+    static std::byte *FirstByte(Block *block) {
+        return reinterpret_cast<std::byte *>(block + 1);
+    }
+
+    void *Allocate(std::size_t size);
+
+    void Release();
+
+    Block *head_ = nullptr;
+    std::byte *pos_ = nullptr;
+    std::byte *end_ = nullptr;
+    std::size_t allocated_ = 0;
+};
+
+// Compiled form of a formula: a flat postfix instruction array executed
+// on a value stack. Cell references are encoded as slots, i.e. indices into
+// the sorted list of referenced cells, so the caller resolves every cell once
+// and passes the values in slot order. Ranges are numbered the same way.
+//
+// An aggregate function runs on a stack of accumulators of its own:
+// AggBegin opens one, AggValue pops a value into it, AggRange adds the
+// values of a range and AggEnd closes it, pushing the result.
+class FormulaProgram {
+public:
+    enum class OpCode : std::uint8_t {
+        PushNumber,
+        PushCell,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        AggBegin,
+        AggValue,
+        AggRange,
+        AggEnd,
+    };
+
+    enum class Function : std::uint8_t {
+        Sum,
+        Average,
+        Min,
+        Max,
+        Count,
+    };
+
+    struct Instruction {
+        OpCode op;
+        union {
+            double number;         // PushNumber
+            std::uint32_t slot;    // PushCell
+            std::uint32_t range;   // AggRange
+            Function function;     // AggBegin
+        };
+    };
+
+    // numbers of the non-empty cells of a range, column by column
+    struct RangeValues {
+        const double *data;
+        std::size_t size;
+    };
+
+    // the value or the error the formula evaluates to
+    using Result = std::variant<double, FormulaError>;
+
+    FormulaProgram() = default;
+
+    FormulaProgram(std::vector<Instruction> code, std::size_t stack_depth, std::size_t aggregate_depth);
+
+    // Fails in the same cases as the tree evaluation, but returns the error
+    // instead of throwing it; an arithmetic error anywhere in the program
+    // is #DIV/0!, reported once at the end. range_values is indexed by range
+    // number.
+    Result Execute(const double *slot_values, const RangeValues *range_values = nullptr) const;
+
+    const std::vector<Instruction> &GetCode() const {
+        return code_;
+    }
+
+    std::size_t GetStackDepth() const {
+        return stack_depth_;
+    }
+
+private:
+    std::vector<Instruction> code_;
+    std::size_t stack_depth_ = 0;
+    std::size_t aggregate_depth_ = 0;
+};
+
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    FormulaAST(ExprArena arena, const ASTImpl::Expr *root_expr,
+               std::vector<Position> cells, std::vector<CellRange> ranges);
 
     FormulaAST(FormulaAST &&) = default;
 
@@ -26,31 +163,71 @@ public:
 
     ~FormulaAST();
 
+    // Evaluates the expression tree directly. The compiled program below is
+    // what formulas use; the tree walk is kept as a reference implementation.
+    // It reads ranges through args too, so their empty cells count as zeros.
     double Execute(const std::function<double(Position)> &args) const;
 
+    const FormulaProgram &GetProgram() const {
+        return program_;
+    }
+
     void PrintCells(std::ostream &out) const;
 
     void Print(std::ostream &out) const;
 
-    void PrintFormula(std::ostream &out) const;
+    // prints the formula with every cell moved by offset
+    void PrintFormula(std::ostream &out, Position offset = Position{0, 0}) const;
 
-    std::forward_list<Position> &GetCells() {
+    // sorted and without duplicates, the program's slots index into it
+    const std::vector<Position> &GetCells() const {
         return cells_;
     }
 
-    const std::forward_list<Position> &GetCells() const {
-        return cells_;
+    // ranges of the aggregate functions, sorted and without duplicates
+    const std::vector<CellRange> &GetRanges() const {
+        return ranges_;
     }
 
+    // Appends the tree in a compact binary form, read back without parsing
+    // by DeserializeFormulaAST.
+    void Serialize(std::string &out) const;
+
+    // heap bytes of the tree, the reference lists and the program
+    std::size_t GetMemoryUsage() const;
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // owns the nodes of the tree
+    ExprArena arena_;
+    const ASTImpl::Expr *root_expr_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    std::vector<Position> cells_;
+    std::vector<CellRange> ranges_;
+
+    FormulaProgram program_;
 };
 
+// Single-pass parser for the Formula.g4 grammar, throws FormulaException.
+FormulaAST ParseFormulaAST(std::string_view in_str);
+
 FormulaAST ParseFormulaAST(std::istream &in);
 
-FormulaAST ParseFormulaAST(const std::string &in_str);
+// Rebuilds a serialized tree and compiles it again, which is a single pass
+// over the nodes. Throws ParsingError if the data is not a well-formed tree.
+FormulaAST DeserializeFormulaAST(std::string_view data);
+
+// Identifies the formula up to where it is anchored: the tokens with the
+// cells written as row and column offsets from the anchor. Expressions with
+// equal keys parse to the same tree with all the cells moved by the
+// difference of their anchors. Empty if the expression does not lex.
+std::string MakeFormulaShapeKey(std::string_view expression, Position anchor);
+
+#ifdef SPREADSHEET_WITH_ANTLR
+// The ANTLR-generated parser, kept to cross-check the hand-written one.
+FormulaAST ParseFormulaASTWithAntlr(std::string_view in_str);
+
+FormulaAST ParseFormulaASTWithAntlr(std::istream &in);
+#endif
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+inline volatile double bench_sink = 0.0;
+
+// Keeps the optimizer from dropping a computed value.
+inline void DoNotOptimize(double value) {
+    bench_sink = value;
+}
+
+// Runs the benchmarks, printing every result to stderr as it is measured
+// and keeping them all for the JSON report.
+class BenchRunner {
+public:
+    struct Result {
+        std::string name;
+        std::size_t iterations;
+        double ns_per_op;
+        // extra figures reported by the benchmark, such as allocation counts
+        std::vector<std::pair<std::string, double>> counters;
+    };
+
+    // only the benchmarks whose names contain filter are run
+    explicit BenchRunner(std::string filter = {}) : filter_(std::move(filter)) {
+    }
+
+    bool IsEnabled(std::string_view name) const {
+        return name.find(filter_) != std::string_view::npos;
+    }
+
+    // Calls func() the given number of times and reports the mean time per call.
+    template <class Func>
+    void Measure(const std::string &name, std::size_t iterations, Func func) {
+        if (!IsEnabled(name)) { return; }
+
+        const auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < iterations; ++i) {
+            func();
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        const double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+        const double ns_per_op = ns / static_cast<double>(iterations);
+        std::cerr << name << ": " << ns_per_op << " ns/op, " << 1e9 / ns_per_op << " ops/s ("
+                  << iterations << " iterations)" << std::endl;
+        results_.push_back(Result{name, iterations, ns_per_op, {}});
+    }
+
+    // Attaches a figure to the last measured benchmark of that name.
+    void Counter(const std::string &name, const std::string &counter, double value) {
+        if (!IsEnabled(name)) { return; }
+
+        std::cerr << name << ": " << counter << " " << value << std::endl;
+        for (auto it = results_.rbegin(); it != results_.rend(); ++it) {
+            if (it->name == name) {
+                it->counters.emplace_back(counter, value);
+                return;
+            }
+        }
+    }
+
+    // {"benchmarks": [{"name": ..., "iterations": ..., "ns_per_op": ...,
+    // "ops_per_s": ..., "counters": {...}}, ...]}
+    void WriteJson(std::ostream &out) const {
+        out << "{\n  \"benchmarks\": [";
+        for (std::size_t i = 0; i < results_.size(); ++i) {
+            const auto &result = results_[i];
+            out << (i == 0 ? "\n" : ",\n") << "    {\"name\": ";
+            WriteString(out, result.name);
+            out << ", \"iterations\": " << result.iterations
+                << ", \"ns_per_op\": " << FormatNumber(result.ns_per_op)
+                << ", \"ops_per_s\": " << FormatNumber(1e9 / result.ns_per_op)
+                << ", \"counters\": {";
+            for (std::size_t j = 0; j < result.counters.size(); ++j) {
+                out << (j == 0 ? "" : ", ");
+                WriteString(out, result.counters[j].first);
+                out << ": " << FormatNumber(result.counters[j].second);
+            }
+            out << "}}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    static void WriteString(std::ostream &out, std::string_view str) {
+        out << '"';
+        for (const char c: str) {
+            if (c == '"' || c == '\\') {
+                out << '\\' << c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out << escaped;
+            } else {
+                out << c;
+            }
+        }
+        out << '"';
+    }
+
+    // exact for the counts, and no inf or nan, which JSON lacks
+    static std::string FormatNumber(double value) {
+        if (value != value || value - value != 0) { return "null"; }
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.10g", value);
+        return buf;
+    }
+
+    std::string filter_;
+    std::vector<Result> results_;
+};
@@ -0,0 +1,666 @@
+#include "../common.h"
+#include "../FormulaAST.h"
+#include "../sheet.h"
+#include "bench_runner_p.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Counts every global allocation so that benchmarks can report them.
+std::size_t allocation_count = 0;
+std::size_t allocated_bytes = 0;
+
+void *operator new(std::size_t size) {
+    ++allocation_count;
+    allocated_bytes += size;
+    if (void *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+namespace {
+
+    double ReadNumber(const SheetInterface &sheet, Position pos) {
+        const auto cell = sheet.GetCell(pos);
+        if (!cell) { return 0.0; }
+        const auto value = cell->GetValue();
+        if (std::holds_alternative<double>(value)) { return std::get<double>(value); }
+        double d = 0.0;
+        std::istringstream(std::get<std::string>(value)) >> d;
+        return d;
+    }
+
+    // Conversions between positions and their names over the whole sheet.
+    void BenchPosition(BenchRunner &br) {
+        constexpr std::size_t ITERATIONS = 2'000'000;
+
+        // a fixed walk that visits names of one to three letters
+        std::vector<std::string> names;
+        for (int i = 0; i < 1024; ++i) {
+            names.push_back(Position{(i * 7919) % Position::MAX_ROWS, (i * 104729) % Position::MAX_COLS}.ToString());
+        }
+
+        std::size_t i = 0;
+        br.Measure("position/from_string", ITERATIONS, [&] {
+            DoNotOptimize(Position::FromString(names[i++ % names.size()]).col);
+        });
+        br.Measure("position/to_string", ITERATIONS, [&] {
+            const Position pos{static_cast<int>(i * 7919 % Position::MAX_ROWS),
+                               static_cast<int>(i * 104729 % Position::MAX_COLS)};
+            ++i;
+            DoNotOptimize(static_cast<double>(pos.ToString().size()));
+        });
+    }
+
+    // Tree walk with a std::function callback per reference against the
+    // compiled postfix program with references resolved once per slot.
+    void BenchFormulaTreeVsProgram(BenchRunner &br) {
+        constexpr std::size_t ITERATIONS = 1'000'000;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < 10; ++row) {
+            sheet->SetCell(Position{row, 0}, "=" + std::to_string(row + 1));
+        }
+
+        const auto ast = ParseFormulaAST("(A1+A2)*(A3-A4)/(A5+1)+A6*A7-A8/(A9+2)+A10*A1-A2");
+
+        br.Measure("formula/tree", ITERATIONS, [&] {
+            DoNotOptimize(ast.Execute([&](Position pos) { return ReadNumber(*sheet, pos); }));
+        });
+
+        br.Measure("formula/program", ITERATIONS, [&] {
+            const auto &cells = ast.GetCells();
+            double values[16];
+            for (std::size_t i = 0; i < cells.size(); ++i) {
+                values[i] = ReadNumber(*sheet, cells[i]);
+            }
+            DoNotOptimize(std::get<double>(ast.GetProgram().Execute(values)));
+        });
+    }
+
+    // A formula whose constant subexpressions are folded when it is compiled.
+    void BenchConstantFolding(BenchRunner &br) {
+        constexpr std::size_t ITERATIONS = 1'000'000;
+
+        const auto ast = ParseFormulaAST("(2*3.5+1)*A1+(4-1)*A2/(2+2)-(1/3+--A3)*(60*60*24)");
+        br.Measure("formula/program_constants", ITERATIONS, [&] {
+            const double values[] = {1.5, 2.5, 3.5};
+            DoNotOptimize(std::get<double>(ast.GetProgram().Execute(values)));
+        });
+    }
+
+    // A formula over ten cells holding numbers as text, as imported sheets do.
+    void BenchFormulaOverTextCells(BenchRunner &br) {
+        constexpr std::size_t ITERATIONS = 1'000'000;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < 10; ++row) {
+            sheet->SetCell(Position{row, 0}, std::to_string(row * 1.25));
+        }
+        const auto formula = ParseFormula("A1+A2+A3+A4+A5+A6+A7+A8+A9+A10");
+
+        br.Measure("formula/text_cells", ITERATIONS, [&] {
+            DoNotOptimize(std::get<double>(formula->Evaluate(*sheet)));
+        });
+    }
+
+    // Formulas that evaluate to an error: one referring to a cell with an
+    // error and one dividing by an empty cell.
+    void BenchFormulaErrors(BenchRunner &br) {
+        constexpr std::size_t ITERATIONS = 1'000'000;
+
+        auto sheet = CreateSheet();
+        sheet->SetCell(Position{0, 0}, "=1/0");
+        sheet->SetCell(Position{0, 1}, "2");
+        const auto referenced_error = ParseFormula("A1*2+B1");
+        const auto division_by_zero = ParseFormula("B1/C1+1");
+
+        br.Measure("formula/referenced_error", ITERATIONS, [&] {
+            DoNotOptimize(static_cast<double>(referenced_error->Evaluate(*sheet).index()));
+        });
+        br.Measure("formula/division_by_zero", ITERATIONS, [&] {
+            DoNotOptimize(static_cast<double>(division_by_zero->Evaluate(*sheet).index()));
+        });
+    }
+
+    // Summing a column of 1000 numbers with SUM over a range and with the
+    // chain of additions it replaces, parsing included.
+    void BenchSumRange(BenchRunner &br) {
+        constexpr int LENGTH = 1000;
+
+        auto sheet = CreateSheet();
+        std::string chain = "A1";
+        for (int row = 0; row < LENGTH; ++row) {
+            sheet->SetCell(Position{row, 0}, std::to_string(row * 0.5));
+            if (row > 0) { chain += "+A" + std::to_string(row + 1); }
+        }
+        const std::string range = "SUM(A1:A" + std::to_string(LENGTH) + ")";
+
+        const auto range_formula = ParseFormula(range);
+        const auto chain_formula = ParseFormula(chain);
+        br.Measure("aggregate/sum_range", 20'000, [&] {
+            DoNotOptimize(std::get<double>(range_formula->Evaluate(*sheet)));
+        });
+        br.Measure("aggregate/sum_chain", 20'000, [&] {
+            DoNotOptimize(std::get<double>(chain_formula->Evaluate(*sheet)));
+        });
+
+        br.Measure("aggregate/parse_sum_range", 200'000, [&] {
+            DoNotOptimize(static_cast<double>(ParseFormulaAST(range).GetRanges().size()));
+        });
+        br.Measure("aggregate/parse_sum_chain", 2'000, [&] {
+            DoNotOptimize(static_cast<double>(ParseFormulaAST(chain).GetCells().size()));
+        });
+    }
+
+    // Setting a formula over a large range of a sparse sheet, and editing
+    // a cell covered by the ranges of many formulas.
+    void BenchRangeDependencies(BenchRunner &br) {
+        constexpr int FORMULAS = 100;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < Position::MAX_ROWS; row += 997) {
+            sheet->SetCell(Position{row, row % 26}, "1");
+        }
+        int round = 0;
+        br.Measure("range/set_wide_sum", 20, [&] {
+            sheet->SetCell(Position{0, 26}, ++round % 2 ? "=SUM(A1:Z16384)" : "=MAX(A1:Z16384)");
+            DoNotOptimize(std::get<double>(sheet->GetCell(Position{0, 26})->GetValue()));
+        });
+
+        for (int i = 0; i < FORMULAS; ++i) {
+            sheet->SetCell(Position{i, 28}, "=SUM(A1:Z" + std::to_string(1000 + i) + ")");
+        }
+        br.Measure("range/edit_inside", 2'000, [&] {
+            sheet->SetCell(Position{499, 1}, std::to_string(++round % 7));
+            DoNotOptimize(std::get<double>(sheet->GetCell(Position{FORMULAS - 1, 28})->GetValue()));
+        });
+
+        // a total under every column, the ranges side by side across the
+        // middle row of the sheet
+        constexpr int COLUMNS = 2'000;
+        auto totals = CreateSheet();
+        for (int col = 0; col < COLUMNS; ++col) {
+            const auto column = Position{0, col}.ToString();
+            const auto name = column.substr(0, column.size() - 1);
+            totals->SetCell(Position{Position::MAX_ROWS - 1, col}, "=SUM(" + name + "1:" + name + "16000)");
+        }
+        br.Measure("range/edit_under_totals", 20'000, [&] {
+            totals->SetCell(Position{8'000, COLUMNS / 2}, std::to_string(++round % 7));
+        });
+    }
+
+    // Throughput of the formula parser in formulas per second.
+    void BenchParseFormula(BenchRunner &br) {
+        constexpr std::size_t ITERATIONS = 500'000;
+
+        const std::vector<std::string> formulas = {
+                "A1",
+                "1+2*3",
+                "(A1+B2)*C3-D4/E5",
+                "-(A10*2.5e3+B20)/(C30-1.25)",
+                "(12+13) * (14+(13-24/(1+1))*55-46)",
+                "A1+A2+A3+A4+A5+A6+A7+A8+A9+A10+A11+A12+A13+A14+A15+A16",
+        };
+
+        std::size_t i = 0;
+        br.Measure("parse/formula", ITERATIONS, [&] {
+            const auto ast = ParseFormulaAST(formulas[i++ % formulas.size()]);
+            DoNotOptimize(static_cast<double>(ast.GetCells().size()));
+        });
+
+        // the public entry point, compiling the program as well, without
+        // and with the parse cache
+        auto &cache = FormulaCache::GetGlobal();
+        cache.SetCapacity(0);
+        br.Measure("parse/parse_formula", ITERATIONS, [&] {
+            const auto formula = ParseFormula(formulas[i++ % formulas.size()]);
+            DoNotOptimize(static_cast<double>(formula->GetReferencedCells().size()));
+        });
+        cache.SetCapacity(FormulaCache::DEFAULT_CAPACITY);
+        br.Measure("parse/parse_formula_cached", ITERATIONS, [&] {
+            const auto formula = ParseFormula(formulas[i++ % formulas.size()]);
+            DoNotOptimize(static_cast<double>(formula->GetReferencedCells().size()));
+        });
+
+#ifdef SPREADSHEET_WITH_ANTLR
+        br.Measure("parse/formula_antlr", ITERATIONS / 20, [&] {
+            const auto ast = ParseFormulaASTWithAntlr(formulas[i++ % formulas.size()]);
+            DoNotOptimize(static_cast<double>(ast.GetCells().size()));
+        });
+#endif
+    }
+
+    // Heap allocations made while loading a 1000x1000 sheet: numbers in the
+    // even columns and formulas over their left neighbour in the odd ones.
+    void BenchLoadAllocations(BenchRunner &br) {
+        constexpr int SIZE = 1000;
+
+        const auto allocations_before = allocation_count;
+        const auto bytes_before = allocated_bytes;
+        br.Measure("load/1M_cells", 1, [&] {
+            auto sheet = CreateSheet();
+            for (int row = 0; row < SIZE; ++row) {
+                for (int col = 0; col < SIZE; col += 2) {
+                    sheet->SetCell(Position{row, col}, std::to_string(row + col));
+                    sheet->SetCell(Position{row, col + 1}, "=" + Position{row, col}.ToString() + "*2+1");
+                }
+            }
+        });
+        br.Counter("load/1M_cells", "allocations", static_cast<double>(allocation_count - allocations_before));
+        br.Counter("load/1M_cells", "bytes", static_cast<double>(allocated_bytes - bytes_before));
+
+        br.Measure("load/1M_cells_batch", 1, [&] {
+            std::vector<std::pair<Position, std::string>> cells;
+            cells.reserve(SIZE * SIZE);
+            for (int row = 0; row < SIZE; ++row) {
+                for (int col = 0; col < SIZE; col += 2) {
+                    cells.emplace_back(Position{row, col}, std::to_string(row + col));
+                    cells.emplace_back(Position{row, col + 1}, "=" + Position{row, col}.ToString() + "*2+1");
+                }
+            }
+            Sheet sheet;
+            sheet.SetCells(std::move(cells));
+        });
+    }
+
+    // Filling a 100x1000 block, row by row, with texts and with formulas
+    // over the cell above.
+    void BenchSetCell(BenchRunner &br) {
+        constexpr int ROWS = 1000;
+        constexpr int COLS = 100;
+        constexpr std::size_t CELLS = ROWS * COLS;
+
+        std::vector<std::string> texts;
+        for (int i = 0; i < 64; ++i) {
+            texts.push_back(i % 2 ? std::to_string(i * 1.5) : "text " + std::to_string(i));
+        }
+
+        auto sheet = CreateSheet();
+        std::size_t i = 0;
+        br.Measure("set/text", CELLS, [&] {
+            sheet->SetCell(Position{static_cast<int>(i / COLS), static_cast<int>(i % COLS)}, texts[i % texts.size()]);
+            ++i;
+        });
+
+        sheet = CreateSheet();
+        i = 0;
+        br.Measure("set/formula", CELLS, [&] {
+            const Position pos{static_cast<int>(i / COLS), static_cast<int>(i % COLS)};
+            sheet->SetCell(pos, pos.row == 0 ? "=1" : "=" + Position{pos.row - 1, pos.col}.ToString() + "*2+1");
+            ++i;
+        });
+
+        // the same formulas again, which leaves the cells as they are
+        i = 0;
+        br.Measure("set/same_formula", CELLS, [&] {
+            const Position pos{static_cast<int>(i / COLS), static_cast<int>(i % COLS)};
+            sheet->SetCell(pos, pos.row == 0 ? "=1" : "=" + Position{pos.row - 1, pos.col}.ToString() + "*2+1");
+            ++i;
+        });
+
+        // filling and clearing the far corner of a sheet with only A1 else,
+        // which shrinks the printable area over every row and column
+        sheet = CreateSheet();
+        sheet->SetCell(Position{0, 0}, "x");
+        br.Measure("set/fill_clear_corner", 20'000, [&] {
+            const Position corner{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+            sheet->SetCell(corner, "x");
+            sheet->ClearCell(corner);
+        });
+    }
+
+    // Reading a formula after its sources changed: the tip of a 10000 cell
+    // chain, and 10000 formulas over a single cell.
+    void BenchGetValue(BenchRunner &br) {
+        constexpr int LENGTH = 10'000;
+
+        auto chain = CreateSheet();
+        chain->SetCell(Position{0, 0}, "1");
+        for (int row = 1; row < LENGTH; ++row) {
+            chain->SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+        int value = 0;
+        br.Measure("value/chain_10000", 100, [&] {
+            chain->SetCell(Position{0, 0}, std::to_string(++value));
+            DoNotOptimize(std::get<double>(chain->GetCell(Position{LENGTH - 1, 0})->GetValue()));
+        });
+
+        auto fan_out = CreateSheet();
+        fan_out->SetCell(Position{0, 0}, "1");
+        for (int i = 0; i < LENGTH; ++i) {
+            fan_out->SetCell(Position{i % 1000, 1 + i / 1000}, "=A1*" + std::to_string(i));
+        }
+        br.Measure("value/fan_out_10000", 100, [&] {
+            fan_out->SetCell(Position{0, 0}, std::to_string(++value));
+            double sum = 0;
+            for (int i = 0; i < LENGTH; ++i) {
+                sum += std::get<double>(fan_out->GetCell(Position{i % 1000, 1 + i / 1000})->GetValue());
+            }
+            DoNotOptimize(sum);
+        });
+    }
+
+    // Rejecting an edit that closes a cycle through a 16384 cell chain,
+    // with the edge going with and against the order of the chain.
+    void BenchCycleDetection(BenchRunner &br) {
+        constexpr int LENGTH = Position::MAX_ROWS;
+
+        auto sheet = CreateSheet();
+        sheet->SetCell(Position{0, 0}, "1");
+        for (int row = 1; row < LENGTH; ++row) {
+            sheet->SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+
+        const auto last = Position{LENGTH - 1, 0}.ToString();
+        const auto measure = [&](const std::string &name, Position pos, const std::string &text) {
+            br.Measure(name, 100, [&] {
+                try {
+                    sheet->SetCell(pos, text);
+                } catch (const CircularDependencyException &) {
+                    return;
+                }
+                std::abort();
+            });
+        };
+        measure("cycle/deep_chain_head", Position{0, 0}, "=" + last);
+        measure("cycle/deep_chain_middle", Position{LENGTH / 2, 0}, "=" + last + "+1");
+    }
+
+    // Discards the output, only counting its size.
+    class NullBuffer : public std::streambuf {
+    public:
+        std::size_t GetSize() const {
+            return size_;
+        }
+
+    protected:
+        std::streamsize xsputn(const char *, std::streamsize count) override {
+            size_ += static_cast<std::size_t>(count);
+            return count;
+        }
+
+        int overflow(int c) override {
+            ++size_;
+            return c;
+        }
+
+    private:
+        std::size_t size_ = 0;
+    };
+
+    // A 1000x100 sheet of numbers, texts and formulas.
+    void BenchPrintDense(BenchRunner &br) {
+        constexpr int ROWS = 1000;
+        constexpr int COLS = 100;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                const Position pos{row, col};
+                if (col % 3 == 0) {
+                    sheet->SetCell(pos, std::to_string(row * 0.25 + col));
+                } else if (col % 3 == 1) {
+                    sheet->SetCell(pos, "cell " + pos.ToString());
+                } else {
+                    sheet->SetCell(pos, "=" + Position{row, col - 2}.ToString() + "/3");
+                }
+            }
+        }
+
+        NullBuffer buffer;
+        std::ostream output(&buffer);
+        br.Measure("print/values_dense_1000x100", 20, [&] {
+            sheet->PrintValues(output);
+        });
+        br.Measure("print/texts_dense_1000x100", 20, [&] {
+            sheet->PrintTexts(output);
+        });
+        DoNotOptimize(static_cast<double>(buffer.GetSize()));
+    }
+
+    // Two far-apart cells make the whole 16384x16384 area printable.
+    void BenchPrintSparse(BenchRunner &br) {
+        auto sheet = CreateSheet();
+        sheet->SetCell(Position{0, 0}, "=1/3");
+        sheet->SetCell(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "text");
+
+        NullBuffer buffer;
+        std::ostream output(&buffer);
+        br.Measure("print/values_sparse_16384x16384", 3, [&] {
+            sheet->PrintValues(output);
+        });
+        DoNotOptimize(static_cast<double>(buffer.GetSize()));
+    }
+
+    // 64 columns of independent formulas over 1000 rows, all referring to
+    // A1 so that every iteration invalidates and recalculates all of them.
+    void BenchRecalculateAll(BenchRunner &br) {
+        constexpr int ROWS = 1000;
+        constexpr int COLS = 64;
+
+        Sheet sheet;
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row));
+            const auto source = Position{row, 0}.ToString();
+            for (int col = 1; col <= COLS; ++col) {
+                sheet.SetCell(Position{row, col}, "=(" + source + "+A1)*" + std::to_string(col) + "/(1+" + source + ")");
+            }
+        }
+
+        const auto hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+        for (const std::size_t threads: {std::size_t{1}, std::size_t{hardware_threads}}) {
+            int value = 0;
+            br.Measure("recalc/64k_formulas_" + std::to_string(threads) + "_threads", 20, [&] {
+                sheet.SetCell(Position{0, 0}, std::to_string(++value));
+                sheet.RecalculateAll(threads);
+            });
+        }
+    }
+
+    // Edits on a 16384 cell chain down column A: building it in both
+    // directions and relinking a cell in the middle of it.
+    void BenchDeepChainEdits(BenchRunner &br) {
+        constexpr int LENGTH = Position::MAX_ROWS;
+
+        br.Measure("edit/deep_chain_build_downwards", 1, [&] {
+            auto sheet = CreateSheet();
+            for (int row = 0; row < LENGTH - 1; ++row) {
+                sheet->SetCell(Position{row, 0}, "=A" + std::to_string(row + 2) + "+1");
+            }
+        });
+
+        auto sheet = CreateSheet();
+        br.Measure("edit/deep_chain_build_upwards", 1, [&] {
+            sheet->SetCell(Position{0, 0}, "1");
+            for (int row = 1; row < LENGTH; ++row) {
+                sheet->SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+            }
+        });
+
+        int value = 0;
+        const auto middle = Position{LENGTH / 2, 0};
+        const auto previous = Position{LENGTH / 2 - 1, 0}.ToString();
+        br.Measure("edit/deep_chain_relink_middle", 10'000, [&] {
+            sheet->SetCell(middle, "=" + previous + "+" + std::to_string(++value % 2));
+        });
+    }
+
+    // A 1000x17 sheet of numbers and formulas saved into a snapshot and
+    // loaded back, against entering all its texts again with SetCells.
+    void BenchSnapshot(BenchRunner &br) {
+        constexpr int ROWS = 1000;
+        constexpr int COLS = 16;
+
+        std::vector<std::pair<Position, std::string>> texts;
+        for (int row = 0; row < ROWS; ++row) {
+            texts.emplace_back(Position{row, 0}, std::to_string(row));
+            const auto source = Position{row, 0}.ToString();
+            for (int col = 1; col <= COLS; ++col) {
+                texts.emplace_back(Position{row, col},
+                                   "=(" + source + "+A1)*" + std::to_string(col) + "/SUM(A1:" + source + ")");
+            }
+        }
+
+        Sheet sheet;
+        sheet.SetCells(texts);
+        sheet.RecalculateAll(1);
+
+        const auto path = (std::filesystem::temp_directory_path() / "spreadsheet_bench.snapshot").string();
+        // the file to load, whichever of the measurements run
+        sheet.SaveSnapshot(path);
+        br.Measure("snapshot/save_17k_cells", 20, [&] {
+            sheet.SaveSnapshot(path);
+        });
+        if (br.IsEnabled("snapshot/save_17k_cells")) {
+            br.Counter("snapshot/save_17k_cells", "file_bytes", static_cast<double>(std::filesystem::file_size(path)));
+        }
+        br.Measure("snapshot/load_17k_cells", 20, [&] {
+            DoNotOptimize(static_cast<double>(Sheet::LoadSnapshot(path)->GetPrintableSize().rows));
+        });
+        br.Measure("snapshot/replay_17k_cells", 20, [&] {
+            Sheet replayed;
+            replayed.SetCells(texts);
+            DoNotOptimize(static_cast<double>(replayed.GetPrintableSize().rows));
+        });
+        std::filesystem::remove(path);
+    }
+
+    // Journaled edits committed in groups against a commit for every edit,
+    // and the recovery that replays them.
+    void BenchJournal(BenchRunner &br) {
+        constexpr int EDITS = 2000;
+
+        const auto directory = std::filesystem::temp_directory_path() / "spreadsheet_bench_journal";
+        std::filesystem::remove_all(directory);
+        std::filesystem::create_directory(directory);
+        const auto snapshot = (directory / "sheet.snapshot").string();
+        const auto journal = (directory / "sheet.journal").string();
+
+        const auto edit = [](Sheet &sheet, int i) {
+            const Position pos{i % 100, i / 100 % 10};
+            sheet.SetCell(pos, i % 3 == 0 ? "=Z1+" + std::to_string(i) : std::to_string(i));
+        };
+        for (const bool wait: {false, true}) {
+            std::filesystem::remove(journal);
+            Journal::Options options;
+            options.wait_for_commit = wait;
+            const auto sheet = Sheet::Recover(snapshot, journal, options);
+            int i = 0;
+            const auto name = std::string("journal/set_cell_") + (wait ? "commit_each" : "group_commit");
+            br.Measure(name, EDITS, [&] {
+                edit(*sheet, i++);
+            });
+        }
+
+        br.Measure("journal/recover_2000_edits", 20, [&] {
+            DoNotOptimize(static_cast<double>(Sheet::Recover(snapshot, journal)->GetPrintableSize().rows));
+        });
+        std::filesystem::remove_all(directory);
+    }
+
+    // A delimited grid imported with its formulas parsed in parallel against
+    // the same cells set through SetCells.
+    void BenchImport(BenchRunner &br) {
+        constexpr int ROWS = 16000;
+        constexpr int COLS = 8;
+
+        std::string data;
+        std::vector<std::pair<Position, std::string>> texts;
+        for (int row = 0; row < ROWS; ++row) {
+            const auto source = Position{row, 0}.ToString();
+            for (int col = 0; col < COLS; ++col) {
+                // the constants make every formula a shape of its own
+                auto text = col == 0 ? std::to_string(row)
+                                     : "=(" + source + "+" + std::to_string(row * COLS + col) + ")*" + source;
+                data += text;
+                data += col + 1 == COLS ? '\n' : '\t';
+                texts.emplace_back(Position{row, col}, std::move(text));
+            }
+        }
+
+        for (const std::size_t threads: {std::size_t{1}, std::size_t{4}}) {
+            br.Measure("import/128k_cells_" + std::to_string(threads) + "_threads", 5, [&] {
+                Sheet sheet;
+                sheet.ImportTexts(data, '\t', threads);
+                DoNotOptimize(static_cast<double>(sheet.GetPrintableSize().rows));
+            });
+        }
+        br.Measure("import/128k_cells_set_cells", 5, [&] {
+            Sheet sheet;
+            sheet.SetCells(texts);
+            DoNotOptimize(static_cast<double>(sheet.GetPrintableSize().rows));
+        });
+    }
+
+}  // namespace
+
+// Usage: spreadsheet_bench [--filter SUBSTRING] [--json FILE]
+// Results go to stderr as they are measured; with --json they are also
+// written to FILE ("-" for stdout) at the end. The inputs are fixed, so runs
+// of two builds measure the same work.
+int main(int argc, char **argv) {
+    std::string filter;
+    const char *json_path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--filter SUBSTRING] [--json FILE]" << std::endl;
+            return 2;
+        }
+    }
+
+    BenchRunner br(filter);
+    BenchPosition(br);
+    BenchFormulaTreeVsProgram(br);
+    BenchConstantFolding(br);
+    BenchFormulaOverTextCells(br);
+    BenchFormulaErrors(br);
+    BenchSumRange(br);
+    BenchRangeDependencies(br);
+    BenchParseFormula(br);
+    BenchSetCell(br);
+    BenchGetValue(br);
+    BenchCycleDetection(br);
+    BenchLoadAllocations(br);
+    BenchPrintDense(br);
+    BenchPrintSparse(br);
+    BenchRecalculateAll(br);
+    BenchDeepChainEdits(br);
+    BenchSnapshot(br);
+    BenchJournal(br);
+    BenchImport(br);
+
+    if (json_path) {
+        if (std::strcmp(json_path, "-") == 0) {
+            br.WriteJson(std::cout);
+        } else {
+            std::ofstream out(json_path);
+            br.WriteJson(out);
+            if (!out) {
+                std::cerr << "cannot write " << json_path << std::endl;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
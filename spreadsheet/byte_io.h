@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Plain binary encoding for the snapshot files: values are copied as they lie
+// in memory, so a file is only read back on a machine of the same byte order.
+
+template <class T>
+void AppendBytes(std::string &out, T value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+inline void AppendString(std::string &out, std::string_view str) {
+    AppendBytes(out, static_cast<std::uint32_t>(str.size()));
+    out.append(str);
+}
+
+// Reads the values back in order; every read fails once the data runs out.
+class ByteReader {
+public:
+    explicit ByteReader(std::string_view data) : data_(data) {
+    }
+
+    template <class T>
+    bool Read(T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (data_.size() < sizeof(T)) { return false; }
+        std::memcpy(&value, data_.data(), sizeof(T));
+        data_.remove_prefix(sizeof(T));
+        return true;
+    }
+
+    // a view of the next size bytes
+    bool ReadBytes(std::size_t size, std::string_view &bytes) {
+        if (data_.size() < size) { return false; }
+        bytes = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return true;
+    }
+
+    bool ReadString(std::string_view &str) {
+        std::uint32_t size = 0;
+        return Read(size) && ReadBytes(size, str);
+    }
+
+    bool AtEnd() const {
+        return data_.empty();
+    }
+
+    std::size_t GetRemaining() const {
+        return data_.size();
+    }
+
+private:
+    std::string_view data_;
+};
@@ -1,286 +1,718 @@
-#include "cell.h"
-#include "sheet.h"
-
-#include <iostream>
-#include <string>
-#include <optional>
-#include <queue>
-#include <unordered_set>
-
-
-// Реализуйте следующие методы
-
-class Cell::Impl {
-public:
-    Impl(Sheet *sheet, Cell *cell) : sheet_(sheet), cell_(cell) {}
-
-    virtual Value GetValue() const = 0;
-
-    virtual std::string GetText() const = 0;
-
-    virtual std::vector<Position> GetReferencedCells() const;
-
-    virtual std::vector<Cell *> GetReferencedCellsPtr() const;
-
-    virtual bool HasCircularDependency() const;
-
-    virtual bool HasCache() const;
-
-    virtual void ClearCache() const;
-
-    virtual void AddDependencies() const;
-
-    virtual void RemoveDependencies() const;
-
-    virtual ~Impl() = default;
-
-protected:
-    Sheet *sheet_;
-    Cell *cell_;
-};
-
-class Cell::EmptyImpl : public Impl {
-public:
-    EmptyImpl(Sheet *sheet, Cell *cell) : Impl(sheet, cell) {}
-
-    Value GetValue() const override;
-
-    std::string GetText() const override;
-
-};
-
-class Cell::TextImpl : public Impl {
-public:
-
-    explicit TextImpl(std::string text, Sheet *sheet, Cell *cell) : Impl(sheet, cell), text_(std::move(text)) {}
-
-    Value GetValue() const override;
-
-    std::string GetText() const override;
-
-private:
-    std::string text_;
-};
-
-
-class Cell::FormulaImpl : public Impl {
-public:
-
-    FormulaImpl(std::string text, Sheet *sheet, Cell *cell);
-
-    Value GetValue() const override;
-
-    std::string GetText() const override;
-
-    std::vector<Position> GetReferencedCells() const override;
-
-    std::vector<Cell *> GetReferencedCellsPtr() const override;
-
-    bool HasCircularDependency() const override;
-
-    bool HasCache() const override;
-
-    void ClearCache() const override;
-
-    void AddDependencies() const override;
-
-    void RemoveDependencies() const override;
-
-private:
-    std::unique_ptr<FormulaInterface> formula_ptr_;
-    std::deque<Cell *> depend_on_;
-    mutable std::optional<Cell::Value> cache_;
-};
-
-Cell::Cell(Sheet &sheet, Position pos) : sheet_(sheet), position_(pos),
-                                         impl_(std::make_unique<EmptyImpl>(&sheet_, this)) {}
-
-Cell::~Cell() = default;
-
-void Cell::Set(std::string text) {
-    if (text == impl_->GetText()) return;
-
-    try {
-        std::unique_ptr<Cell::Impl> temp;
-
-        if (text.empty()) {
-            temp = std::make_unique<EmptyImpl>(&sheet_, this);
-        } else if (text.size() > 1 && text.at(0) == FORMULA_SIGN) {
-            temp = std::make_unique<FormulaImpl>(std::move(text), &sheet_, this);
-        } else {
-            temp = std::make_unique<TextImpl>(std::move(text), &sheet_, this);
-        }
-
-        if (IsReferenced()) {
-            ClearCache();
-        }
-        impl_->RemoveDependencies();
-        impl_ = std::move(temp);
-        impl_->AddDependencies();
-    } catch (...) {
-        throw;
-    }
-}
-
-void Cell::Clear() {
-    Set("");
-}
-
-Cell::Value Cell::GetValue() const { return impl_->GetValue(); }
-
-std::string Cell::GetText() const { return impl_->GetText(); }
-
-std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
-}
-
-bool Cell::IsReferenced() const {
-    return !affect_on_.empty();
-}
-
-Position Cell::GetPosition() const {
-    return position_;
-}
-
-Cell::Value Cell::EmptyImpl::GetValue() const { return 0.0; }
-
-std::string Cell::EmptyImpl::GetText() const { return std::string{}; }
-
-
-Cell::Value Cell::TextImpl::GetValue() const {
-    return text_.at(0) == ESCAPE_SIGN ? text_.substr(1) : text_;
-}
-
-std::string Cell::TextImpl::GetText() const { return text_; }
-
-Cell::Value Cell::FormulaImpl::GetValue() const {
-    if (!cache_.has_value()) {
-        const auto res = formula_ptr_->Evaluate(*sheet_);
-
-        if (std::holds_alternative<double>(res)) {
-            cache_ = std::make_optional<Cell::Value>(std::get<double>(res));
-        } else {
-            cache_ = std::make_optional<Cell::Value>(std::get<FormulaError>(res));
-        }
-    }
-    return cache_.value();
-}
-
-std::string Cell::FormulaImpl::GetText() const { return FORMULA_SIGN + formula_ptr_->GetExpression(); }
-
-bool Cell::FormulaImpl::HasCircularDependency() const {
-    std::unordered_set<const Cell *> visited;
-    std::queue<const Cell *> queue;
-
-    for (const auto &d: depend_on_) {
-        queue.push(d);
-    }
-
-    while (!queue.empty()) {
-        const auto current_cell = queue.front();
-        if (current_cell == cell_) { return true; }
-        visited.emplace(current_cell);
-
-        const auto deps_pos = current_cell->GetReferencedCells();
-        for (const auto &pos: deps_pos) {
-            const auto cell = sheet_->GetCellPtr(pos);
-            if (!visited.count(cell)) { queue.push(cell); }
-        }
-        queue.pop();
-    }
-    return false;
-}
-
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    std::vector<Position> res;
-    res.reserve(depend_on_.size());
-
-    for (const auto &cell: depend_on_) {
-        res.emplace_back(cell->GetPosition());
-    }
-    return res;
-}
-
-Cell::FormulaImpl::FormulaImpl(std::string text, Sheet *sheet, Cell *cell) :
-        Impl(sheet, cell), formula_ptr_(
-        ParseFormula(text.substr(1))) {
-    const auto ref_cells_pos = formula_ptr_->GetReferencedCells();
-    for (const auto &pos: ref_cells_pos) {
-        auto ref_cell_ptr = sheet_->GetCell(pos);
-        if (!ref_cell_ptr) {
-            sheet_->SetCell(pos, "");
-        }
-        depend_on_.push_back(sheet_->GetCellPtr(pos));
-    }
-    if (this->HasCircularDependency()) {
-        throw CircularDependencyException("Formula has circular dependency");
-    }
-}
-
-void Cell::FormulaImpl::ClearCache() const {
-    cache_.reset();
-}
-
-void Cell::FormulaImpl::RemoveDependencies() const {
-    for (const auto &cell: depend_on_) {
-        cell->RemoveAffected(cell_);
-    }
-}
-
-std::vector<Cell *> Cell::FormulaImpl::GetReferencedCellsPtr() const {
-    return std::vector<Cell *>{depend_on_.begin(), depend_on_.end()};
-}
-
-void Cell::FormulaImpl::AddDependencies() const {
-    for (const auto dep_cell: depend_on_) {
-        dep_cell->AddAffected(cell_);
-    }
-}
-
-bool Cell::FormulaImpl::HasCache() const {
-    return cache_.has_value();
-}
-
-std::vector<Position> Cell::Impl::GetReferencedCells() const {
-    return {};
-}
-
-bool Cell::Impl::HasCircularDependency() const {
-    return false;
-}
-
-void Cell::Impl::ClearCache() const {}
-
-void Cell::Impl::RemoveDependencies() const {}
-
-std::vector<Cell *> Cell::Impl::GetReferencedCellsPtr() const {
-    return {};
-}
-
-void Cell::Impl::AddDependencies() const {}
-
-bool Cell::Impl::HasCache() const {
-    return false;
-}
-
-void Cell::AddAffected(Cell *cell) {
-    if (std::find(affect_on_.begin(), affect_on_.end(), cell) == affect_on_.end()) {
-        affect_on_.insert(cell);
-    }
-}
-
-void Cell::RemoveAffected(Cell *cell) {
-    affect_on_.erase(cell);
-}
-
-void Cell::ClearCache() const {
-    impl_->ClearCache();
-
-    for (const auto &cell: affect_on_) {
-        if (cell->HasCache()) cell->ClearCache();
-    }
-}
-
-bool Cell::HasCache() const {
-    return impl_->HasCache();
-}
+#include "cell.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <optional>
+#include <queue>
+#include <sstream>
+#include <unordered_set>
+
+
+// Реализуйте следующие методы
+
+class Cell::Impl {
+public:
+    Impl(Sheet *sheet, Cell *cell) : sheet_(sheet), cell_(cell) {}
+
+    virtual Value GetValue() const = 0;
+
+    virtual const std::string &GetText() const = 0;
+
+    // whether setting text would leave the cell as it is
+    virtual bool HasText(const std::string &text) const;
+
+    virtual FormulaInterface::Value GetNumericValue() const = 0;
+
+    virtual bool IsEmpty() const;
+
+    virtual bool IsFormula() const;
+
+    virtual std::vector<Position> GetReferencedCells() const;
+
+    // the cells a formula refers to on their own, nullptr for other cells
+    virtual const CellList *GetDependencyList() const;
+
+    // the ranges of a formula, nullptr for other cells
+    virtual const RangeList *GetRangeList() const;
+
+    virtual bool HasCache() const;
+
+    // the formula and its cached value, for snapshots
+    virtual const FormulaInterface *GetFormula() const;
+
+    virtual std::optional<FormulaInterface::Value> GetCache() const;
+
+    virtual void ClearCache() const;
+
+    virtual void AddDependencies() const;
+
+    virtual void RemoveDependencies() const;
+
+    virtual ~Impl() = default;
+
+protected:
+    Sheet *sheet_;
+    Cell *cell_;
+};
+
+class Cell::EmptyImpl : public Impl {
+public:
+    EmptyImpl(Sheet *sheet, Cell *cell) : Impl(sheet, cell) {}
+
+    Value GetValue() const override;
+
+    const std::string &GetText() const override;
+
+    FormulaInterface::Value GetNumericValue() const override;
+
+    bool IsEmpty() const override;
+};
+
+class Cell::TextImpl : public Impl {
+public:
+
+    explicit TextImpl(std::string text, Sheet *sheet, Cell *cell);
+
+    // the number is the one the text was found to be, if any
+    TextImpl(std::string text, std::optional<double> number, Sheet *sheet, Cell *cell);
+
+    Value GetValue() const override;
+
+    const std::string &GetText() const override;
+
+    FormulaInterface::Value GetNumericValue() const override;
+
+private:
+    std::string text_;
+    // the value of the text as a number, empty if it is not one
+    std::optional<double> number_;
+};
+
+
+class Cell::FormulaImpl : public Impl {
+public:
+
+    FormulaImpl(std::string text, Sheet *sheet, Cell *cell);
+
+    // the same for a formula parsed from text already
+    FormulaImpl(std::unique_ptr<FormulaInterface> formula, std::string text, Sheet *sheet, Cell *cell);
+
+    // a formula restored from a snapshot with the cells it refers to
+    FormulaImpl(std::unique_ptr<FormulaInterface> formula, const std::vector<Cell *> &dependencies,
+                std::optional<FormulaInterface::Value> cache, Sheet *sheet, Cell *cell);
+
+    Value GetValue() const override;
+
+    // the canonical text, rendered from the formula the first time
+    const std::string &GetText() const override;
+
+    bool HasText(const std::string &text) const override;
+
+    FormulaInterface::Value GetNumericValue() const override;
+
+    bool IsFormula() const override;
+
+    std::vector<Position> GetReferencedCells() const override;
+
+    const CellList *GetDependencyList() const override;
+
+    const RangeList *GetRangeList() const override;
+
+    bool HasCache() const override;
+
+    const FormulaInterface *GetFormula() const override;
+
+    std::optional<FormulaInterface::Value> GetCache() const override;
+
+    void ClearCache() const override;
+
+    void AddDependencies() const override;
+
+    void RemoveDependencies() const override;
+
+private:
+    FormulaImpl(std::unique_ptr<FormulaInterface> formula, Sheet *sheet, Cell *cell);
+
+    std::unique_ptr<FormulaInterface> formula_ptr_;
+    // the text the formula was entered with, empty for a restored one,
+    // until GetText replaces it with the canonical text
+    mutable std::string text_;
+    mutable bool canonical_ = false;
+    CellList depend_on_;
+    RangeList ranges_;
+    mutable std::optional<FormulaInterface::Value> cache_;
+};
+
+Cell::Cell(Sheet &sheet, Position pos) : sheet_(sheet), position_(pos),
+                                         impl_(MakePooled<EmptyImpl>(sheet.GetPool(), &sheet_, this)),
+                                         affect_on_(PoolAllocator<Cell *>(sheet.GetPool())),
+                                         order_(sheet.TakeOrderAbove()) {
+    sheet.GetNumericColumns().Reserve(pos);
+    OrderBeforeRangeDependents();
+}
+
+Cell::~Cell() = default;
+
+PoolPtr<Cell::Impl> Cell::MakeImpl(std::string text, std::unique_ptr<FormulaInterface> formula) {
+    auto &pool = sheet_.GetPool();
+
+    if (text.empty()) {
+        return MakePooled<EmptyImpl>(pool, &sheet_, this);
+    } else if (text.size() > 1 && text.at(0) == FORMULA_SIGN) {
+        if (formula) { return MakePooled<FormulaImpl>(pool, std::move(formula), std::move(text), &sheet_, this); }
+        return MakePooled<FormulaImpl>(pool, std::move(text), &sheet_, this);
+    } else {
+        return MakePooled<TextImpl>(pool, std::move(text), &sheet_, this);
+    }
+}
+
+bool Cell::Set(std::string text) {
+    if (impl_->HasText(text)) return false;
+
+    auto temp = MakeImpl(std::move(text));
+
+    // The new edges are inserted while the old ones are still there: those
+    // end in this cell and cannot be a part of a cycle through a new edge.
+    if (const auto new_deps = temp->GetDependencyList()) {
+        const auto old_deps = impl_->GetDependencyList();
+        const auto old_ranges = impl_->GetRangeList();
+        const auto is_old = [old_deps](Cell *cell) {
+            return old_deps && std::find(old_deps->begin(), old_deps->end(), cell) != old_deps->end();
+        };
+        const auto is_old_range = [old_ranges](const CellRange &range) {
+            return old_ranges && std::find(old_ranges->begin(), old_ranges->end(), range) != old_ranges->end();
+        };
+        // the order stays valid when edges are removed
+        const auto remove_added = [&](CellList::const_iterator end) {
+            for (auto added = new_deps->begin(); added != end; ++added) {
+                if (!is_old(*added)) { (*added)->RemoveAffected(this); }
+            }
+        };
+
+        for (auto it = new_deps->begin(); it != new_deps->end(); ++it) {
+            if (is_old(*it) || (*it)->AddAffectedOrdered(this)) { continue; }
+
+            remove_added(it);
+            throw CircularDependencyException("Formula has circular dependency");
+        }
+        // the ranges go into the index with the rest of the new formula
+        for (const auto &range: *temp->GetRangeList()) {
+            if (is_old_range(range) || AddRangeOrdered(range)) { continue; }
+
+            remove_added(new_deps->end());
+            throw CircularDependencyException("Formula has circular dependency");
+        }
+    }
+
+    ClearCache();
+    impl_->RemoveDependencies();
+    impl_ = std::move(temp);
+    impl_->AddDependencies();
+    UpdateNumericColumns();
+    sheet_.GetCounters().Add(EngineCounters::Counter::Edits);
+    return true;
+}
+
+std::vector<bool> Cell::SetMany(std::vector<Change> changes) {
+    // parse everything before touching the graph
+    std::vector<std::pair<Cell *, PoolPtr<Impl>>> impls;
+    std::vector<bool> changed;
+    impls.reserve(changes.size());
+    changed.reserve(changes.size());
+    for (auto &[cell, text, formula]: changes) {
+        changed.push_back(!cell->impl_->HasText(text));
+        if (changed.back()) {
+            impls.emplace_back(cell, cell->MakeImpl(std::move(text), std::move(formula)));
+        }
+    }
+
+    // The edges of the old formulas go first, as one of them could close a
+    // false cycle with the new ones. Until its new edges are in, a cell is
+    // not followed by the backward search of AddAffectedOrdered.
+    const auto install = [&impls] {
+        for (auto &[cell, impl]: impls) {
+            cell->impl_->RemoveDependencies();
+            cell->impl_.swap(impl);
+            cell->edges_pending_ = true;
+        }
+    };
+    const auto add_edges = [&impls] {
+        for (auto &[cell, impl]: impls) {
+            if (const auto deps = cell->impl_->GetDependencyList()) {
+                for (const auto dep: *deps) {
+                    if (!dep->AddAffectedOrdered(cell)) { return false; }
+                }
+            }
+            if (const auto ranges = cell->impl_->GetRangeList()) {
+                for (const auto &range: *ranges) {
+                    if (!cell->AddRangeOrdered(range)) { return false; }
+                    cell->sheet_.GetRangeIndex().Insert(range, cell);
+                }
+            }
+            cell->edges_pending_ = false;
+        }
+        return true;
+    };
+
+    install();
+    if (!add_edges()) {
+        // the old graph has no cycles, putting it back cannot fail
+        install();
+        add_edges();
+        throw CircularDependencyException("Formula has circular dependency");
+    }
+
+    for (const auto &[cell, impl]: impls) {
+        cell->ClearCache();
+        cell->UpdateNumericColumns();
+    }
+    if (!impls.empty()) {
+        impls.front().first->sheet_.GetCounters().Add(EngineCounters::Counter::Edits, impls.size());
+    }
+    return changed;
+}
+
+void Cell::Clear() {
+    Set("");
+}
+
+Cell::Value Cell::GetValue() const { return impl_->GetValue(); }
+
+FormulaInterface::Value Cell::GetNumericValue() const { return impl_->GetNumericValue(); }
+
+std::string Cell::GetText() const { return impl_->GetText(); }
+
+const std::string &Cell::GetTextRef() const { return impl_->GetText(); }
+
+std::vector<Position> Cell::GetReferencedCells() const {
+    return impl_->GetReferencedCells();
+}
+
+bool Cell::IsReferenced() const {
+    return !affect_on_.empty();
+}
+
+bool Cell::IsEmpty() const {
+    return impl_->IsEmpty();
+}
+
+bool Cell::IsFormula() const {
+    return impl_->IsFormula();
+}
+
+Position Cell::GetPosition() const {
+    return position_;
+}
+
+Cell::Value Cell::EmptyImpl::GetValue() const { return 0.0; }
+
+const std::string &Cell::EmptyImpl::GetText() const {
+    static const std::string empty;
+    return empty;
+}
+
+FormulaInterface::Value Cell::EmptyImpl::GetNumericValue() const { return 0.0; }
+
+bool Cell::EmptyImpl::IsEmpty() const { return true; }
+
+Cell::TextImpl::TextImpl(std::string text, Sheet *sheet, Cell *cell) : Impl(sheet, cell), text_(std::move(text)) {
+    const auto value = text_.at(0) == ESCAPE_SIGN ? text_.substr(1) : text_;
+    if (value.empty()) {
+        number_ = 0.0;
+    } else if (double d{}; (std::istringstream(value) >> d >> std::ws).eof()) {
+        number_ = d;
+    }
+}
+
+Cell::TextImpl::TextImpl(std::string text, std::optional<double> number, Sheet *sheet, Cell *cell)
+        : Impl(sheet, cell), text_(std::move(text)), number_(number) {
+}
+
+Cell::Value Cell::TextImpl::GetValue() const {
+    return text_.at(0) == ESCAPE_SIGN ? text_.substr(1) : text_;
+}
+
+const std::string &Cell::TextImpl::GetText() const { return text_; }
+
+FormulaInterface::Value Cell::TextImpl::GetNumericValue() const {
+    if (number_) { return *number_; }
+    return FormulaError(FormulaError::Category::Value);
+}
+
+Cell::Value Cell::FormulaImpl::GetValue() const {
+    const auto res = GetNumericValue();
+    if (std::holds_alternative<double>(res)) {
+        return std::get<double>(res);
+    }
+    return std::get<FormulaError>(res);
+}
+
+FormulaInterface::Value Cell::FormulaImpl::GetNumericValue() const {
+    if (cache_.has_value()) {
+        sheet_->GetCounters().Add(EngineCounters::Counter::CacheHits);
+    } else {
+        sheet_->GetCounters().Add(EngineCounters::Counter::CacheMisses);
+        cache_ = formula_ptr_->Evaluate(*sheet_);
+        if (const auto number = std::get_if<double>(&*cache_)) {
+            sheet_->GetNumericColumns().SetNumber(cell_->position_, *number);
+        }
+    }
+    return cache_.value();
+}
+
+const std::string &Cell::FormulaImpl::GetText() const {
+    if (!canonical_) {
+        text_ = FORMULA_SIGN + formula_ptr_->GetExpression();
+        canonical_ = true;
+    }
+    return text_;
+}
+
+// The text the formula was entered with parses to the same formula again,
+// so resending it is recognised without rendering the canonical text.
+bool Cell::FormulaImpl::HasText(const std::string &text) const {
+    if (!text_.empty() && text == text_) { return true; }
+    return !canonical_ && text == GetText();
+}
+
+bool Cell::FormulaImpl::IsFormula() const { return true; }
+
+std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
+    return formula_ptr_->GetReferencedCells();
+}
+
+// Only the cells referenced on their own are created. A range is a single
+// entry of the sheet's range index, its cells are found through their
+// positions.
+Cell::FormulaImpl::FormulaImpl(std::string text, Sheet *sheet, Cell *cell) :
+        FormulaImpl(sheet->GetFormulaInterner().Parse(text.substr(1), cell->position_), sheet, cell) {
+    text_ = std::move(text);
+}
+
+Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, std::string text, Sheet *sheet,
+                               Cell *cell) : FormulaImpl(std::move(formula), sheet, cell) {
+    text_ = std::move(text);
+}
+
+Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, Sheet *sheet, Cell *cell) :
+        Impl(sheet, cell), formula_ptr_(std::move(formula)),
+        depend_on_(PoolAllocator<Cell *>(sheet->GetPool())),
+        ranges_(PoolAllocator<CellRange>(sheet->GetPool())) {
+    const auto references = formula_ptr_->GetReferences();
+    ranges_.assign(references.ranges.begin(), references.ranges.end());
+
+    const auto &ref_cells_pos = references.cells;
+    depend_on_.reserve(ref_cells_pos.size());
+    for (const auto &pos: ref_cells_pos) {
+        auto ref_cell_ptr = sheet_->GetCellPtr(pos);
+        if (!ref_cell_ptr) {
+            ref_cell_ptr = sheet_->CreateEmptyCell(pos);
+            // a new referenced cell only has outgoing edges, putting it
+            // first makes the edge to this formula agree with the order
+            ref_cell_ptr->order_ = sheet_->TakeOrderBelow();
+        }
+        depend_on_.push_back(ref_cell_ptr);
+    }
+}
+
+Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, const std::vector<Cell *> &dependencies,
+                               std::optional<FormulaInterface::Value> cache, Sheet *sheet, Cell *cell) :
+        Impl(sheet, cell), formula_ptr_(std::move(formula)),
+        depend_on_(dependencies.begin(), dependencies.end(), PoolAllocator<Cell *>(sheet->GetPool())),
+        ranges_(PoolAllocator<CellRange>(sheet->GetPool())), cache_(cache) {
+    const auto references = formula_ptr_->GetReferences();
+    ranges_.assign(references.ranges.begin(), references.ranges.end());
+}
+
+void Cell::FormulaImpl::ClearCache() const {
+    cache_.reset();
+    sheet_->GetNumericColumns().SetOther(cell_->position_);
+}
+
+void Cell::FormulaImpl::RemoveDependencies() const {
+    for (const auto &cell: depend_on_) {
+        cell->RemoveAffected(cell_);
+    }
+    for (const auto &range: ranges_) {
+        sheet_->GetRangeIndex().Erase(range, cell_);
+    }
+}
+
+const Cell::CellList *Cell::FormulaImpl::GetDependencyList() const {
+    return &depend_on_;
+}
+
+const Cell::RangeList *Cell::FormulaImpl::GetRangeList() const {
+    return &ranges_;
+}
+
+void Cell::FormulaImpl::AddDependencies() const {
+    for (const auto dep_cell: depend_on_) {
+        dep_cell->AddAffected(cell_);
+    }
+    for (const auto &range: ranges_) {
+        sheet_->GetRangeIndex().Insert(range, cell_);
+    }
+}
+
+bool Cell::FormulaImpl::HasCache() const {
+    return cache_.has_value();
+}
+
+const FormulaInterface *Cell::FormulaImpl::GetFormula() const {
+    return formula_ptr_.get();
+}
+
+std::optional<FormulaInterface::Value> Cell::FormulaImpl::GetCache() const {
+    return cache_;
+}
+
+bool Cell::Impl::HasText(const std::string &text) const {
+    return text == GetText();
+}
+
+bool Cell::Impl::IsEmpty() const {
+    return false;
+}
+
+bool Cell::Impl::IsFormula() const {
+    return false;
+}
+
+std::vector<Position> Cell::Impl::GetReferencedCells() const {
+    return {};
+}
+
+const Cell::CellList *Cell::Impl::GetDependencyList() const {
+    return nullptr;
+}
+
+const Cell::RangeList *Cell::Impl::GetRangeList() const {
+    return nullptr;
+}
+
+void Cell::Impl::ClearCache() const {}
+
+void Cell::Impl::RemoveDependencies() const {}
+
+void Cell::Impl::AddDependencies() const {}
+
+bool Cell::Impl::HasCache() const {
+    return false;
+}
+
+const FormulaInterface *Cell::Impl::GetFormula() const {
+    return nullptr;
+}
+
+std::optional<FormulaInterface::Value> Cell::Impl::GetCache() const {
+    return std::nullopt;
+}
+
+void Cell::AddAffected(Cell *cell) {
+    affect_on_.insert(cell);
+}
+
+template <class Func>
+void Cell::ForEachDependency(Func func) const {
+    if (const auto deps = impl_->GetDependencyList()) {
+        for (const auto dep: *deps) {
+            func(dep);
+        }
+    }
+    if (const auto ranges = impl_->GetRangeList()) {
+        for (const auto &range: *ranges) {
+            sheet_.ForEachCellInRange(range, [&func](Cell &cell) { func(&cell); });
+        }
+    }
+}
+
+bool Cell::AddAffectedOrdered(Cell *cell) {
+    if (cell == this) { return false; }
+    if (order_ > cell->order_ && !cell->OrderAfter(CellRange{position_, position_}, {this})) {
+        return false;
+    }
+
+    AddAffected(cell);
+    return true;
+}
+
+bool Cell::AddRangeOrdered(const CellRange &range) {
+    if (range.Contains(position_)) { return false; }
+
+    // a cycle would have to go through one of these
+    std::vector<Cell *> sources;
+    sheet_.ForEachCellInRange(range, [&](Cell &cell) {
+        if (cell.order_ > order_) { sources.push_back(&cell); }
+    });
+    return sources.empty() || OrderAfter(range, std::move(sources));
+}
+
+bool Cell::OrderAfter(const CellRange &range, std::vector<Cell *> sources) {
+    const auto lower = order_;
+    std::int64_t upper = lower;
+    for (const auto source: sources) { upper = std::max(upper, source->order_); }
+    const auto unmark = [](const std::vector<Cell *> &cells) {
+        for (const auto c: cells) { c->marked_ = false; }
+    };
+
+    // what the new edges would push down: the cells reachable from this one
+    // that are ordered before the last source; reaching a cell of the range
+    // means a cycle
+    std::vector<Cell *> forward{this};
+    marked_ = true;
+    bool cycle = false;
+    for (std::size_t i = 0; i < forward.size() && !cycle; ++i) {
+        forward[i]->ForEachDependent([&](Cell *dependent) {
+            if (range.Contains(dependent->position_)) {
+                cycle = true;
+            } else if (!dependent->marked_ && dependent->order_ < upper) {
+                dependent->marked_ = true;
+                forward.push_back(dependent);
+            }
+        });
+    }
+    if (cycle) {
+        unmark(forward);
+        sheet_.GetCounters().Add(EngineCounters::Counter::CycleCheckVisits, forward.size());
+        return false;
+    }
+
+    // what has to stay above them: the sources and the cells they depend on
+    // that are ordered after this one
+    std::vector<Cell *> backward = std::move(sources);
+    for (const auto source: backward) { source->marked_ = true; }
+    for (std::size_t i = 0; i < backward.size(); ++i) {
+        if (backward[i]->edges_pending_) { continue; }
+        backward[i]->ForEachDependency([&](Cell *dep) {
+            if (!dep->marked_ && dep->order_ > lower) {
+                dep->marked_ = true;
+                backward.push_back(dep);
+            }
+        });
+    }
+    unmark(forward);
+    unmark(backward);
+    sheet_.GetCounters().Add(EngineCounters::Counter::CycleCheckVisits, forward.size() + backward.size());
+
+    // hand the same positions out again, the backward part first, keeping
+    // the relative order inside both parts
+    const auto by_order = [](const Cell *lhs, const Cell *rhs) { return lhs->order_ < rhs->order_; };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+
+    std::vector<std::int64_t> orders;
+    orders.reserve(forward.size() + backward.size());
+    for (const auto c: backward) { orders.push_back(c->order_); }
+    for (const auto c: forward) { orders.push_back(c->order_); }
+    std::sort(orders.begin(), orders.end());
+
+    auto next = orders.begin();
+    for (const auto c: backward) { c->order_ = *next++; }
+    for (const auto c: forward) { c->order_ = *next++; }
+    return true;
+}
+
+void Cell::OrderBeforeRangeDependents() {
+    std::vector<Cell *> covering;
+    GetRangeIndex().ForEachCovering(position_, [&](Cell *formula) { covering.push_back(formula); });
+
+    // the cell has no edges into it yet, so this cannot find a cycle
+    for (const auto formula: covering) {
+        if (formula->order_ < order_) {
+            formula->OrderAfter(CellRange{position_, position_}, {this});
+        }
+    }
+}
+
+const RangeIndex &Cell::GetRangeIndex() const {
+    return sheet_.GetRangeIndex();
+}
+
+void Cell::RemoveAffected(Cell *cell) {
+    affect_on_.erase(cell);
+}
+
+void Cell::ClearCache() const {
+    impl_->ClearCache();
+
+    // an explicit worklist, so that a long chain of formulas cannot exhaust
+    // the stack; a cell without a cache is not followed, as nothing that
+    // depends on it can have one
+    std::vector<const Cell *> pending;
+    const auto push = [&pending](const Cell *cell) {
+        if (cell->HasCache()) { pending.push_back(cell); }
+    };
+    ForEachDependent(push);
+
+    std::uint64_t cleared = 0;
+    while (!pending.empty()) {
+        const auto cell = pending.back();
+        pending.pop_back();
+        // reached twice through a diamond
+        if (!cell->HasCache()) { continue; }
+
+        cell->impl_->ClearCache();
+        cell->ForEachDependent(push);
+        ++cleared;
+    }
+
+    auto &counters = sheet_.GetCounters();
+    counters.Add(EngineCounters::Counter::InvalidatedCells, cleared);
+    counters.Max(EngineCounters::Counter::MaxInvalidatedCells, cleared);
+}
+
+void Cell::UpdateNumericColumns() const {
+    auto &columns = sheet_.GetNumericColumns();
+    if (impl_->IsEmpty()) {
+        columns.SetEmpty(position_);
+    } else if (NeedsEvaluation()) {
+        columns.SetOther(position_);
+    } else if (const auto value = impl_->GetNumericValue(); std::holds_alternative<double>(value)) {
+        columns.SetNumber(position_, std::get<double>(value));
+    } else {
+        columns.SetOther(position_);
+    }
+}
+
+bool Cell::HasCache() const {
+    return impl_->HasCache();
+}
+
+bool Cell::NeedsEvaluation() const {
+    return impl_->IsFormula() && !impl_->HasCache();
+}
+
+std::vector<Cell *> Cell::GetDependencies() const {
+    std::vector<Cell *> dependencies;
+    ForEachDependency([&](Cell *cell) { dependencies.push_back(cell); });
+    return dependencies;
+}
+
+const FormulaInterface *Cell::GetFormula() const {
+    return impl_->GetFormula();
+}
+
+std::optional<FormulaInterface::Value> Cell::GetCachedValue() const {
+    return impl_->GetCache();
+}
+
+const Cell::CellList *Cell::GetDependencyList() const {
+    return impl_->GetDependencyList();
+}
+
+void Cell::RestoreText(std::string text, std::optional<double> number) {
+    impl_ = MakePooled<TextImpl>(sheet_.GetPool(), std::move(text), number, &sheet_, this);
+}
+
+void Cell::RestoreFormula(std::unique_ptr<FormulaInterface> formula, const std::vector<Cell *> &dependencies,
+                          std::optional<FormulaInterface::Value> cache) {
+    impl_ = MakePooled<FormulaImpl>(sheet_.GetPool(), std::move(formula), dependencies, cache, &sheet_, this);
+}
+
+void Cell::RestoreEdges() {
+    impl_->AddDependencies();
+    UpdateNumericColumns();
+}
@@ -2,7 +2,10 @@
 
 #include "common.h"
 #include "formula.h"
+#include "pool_allocator.h"
+#include "range_index.h"
 
+#include <cstdint>
 #include <functional>
 #include <unordered_set>
 #include <optional>
@@ -18,7 +21,21 @@ public:
 
     ~Cell() override;
 
-    void Set(std::string text);
+    // false if the cell holds the text already and nothing was done
+    bool Set(std::string text);
+
+    // a text for SetMany with its formula, if the caller has parsed it
+    struct Change {
+        Cell *cell;
+        std::string text;
+        std::unique_ptr<FormulaInterface> formula;
+    };
+
+    // Sets the texts of several distinct cells of one sheet at once: the
+    // formulas are parsed and wired first and the caches are invalidated
+    // after that. If any of them throws, none of the cells is changed.
+    // Returns for every change whether it set a new text.
+    static std::vector<bool> SetMany(std::vector<Change> changes);
 
     void Clear();
 
@@ -26,22 +43,79 @@ public:
 
     std::string GetText() const override;
 
+    // The cell as a formula reads it: a number or the error it evaluates
+    // to. Text is parsed when it is set, so this never allocates.
+    FormulaInterface::Value GetNumericValue() const;
+
     bool IsReferenced() const;
 
+    bool IsEmpty() const;
+
+    bool IsFormula() const;
+
     bool HasCache() const;
 
+    // a formula whose value is not cached yet
+    bool NeedsEvaluation() const;
+
+    // Cells the formula refers to, the stored cells of its ranges included,
+    // empty for other cells. A cell is listed once for every reference.
+    std::vector<Cell *> GetDependencies() const;
+
+    // Calls func for every formula that refers to this cell, on its own or
+    // through a range; once for every such reference, like GetDependencies.
+    template <class Func>
+    void ForEachDependent(Func func) const {
+        for (Cell *cell: affect_on_) {
+            func(cell);
+        }
+        GetRangeIndex().ForEachCovering(position_, func);
+    }
+
 private:
+    // saves and restores the cells in snapshots
+    friend class Sheet;
 
     std::vector<Position> GetReferencedCells() const override;
 
+    // GetText without the copy
+    const std::string &GetTextRef() const;
+
     Position GetPosition() const;
 
     void AddAffected(Cell *cell);
 
+    // Adds the edge this -> cell unless it closes a cycle, keeping order_
+    // topological (Pearce-Kelly): when the edge goes against the order, only
+    // the cells ordered between the two ends are searched and renumbered.
+    bool AddAffectedOrdered(Cell *cell);
+
+    // The same for the edges from the stored cells of the range to this
+    // formula. The range itself is not added to the index.
+    bool AddRangeOrdered(const CellRange &range);
+
+    // Pearce-Kelly for a set of edges into this cell: sources are the cells
+    // of the range that are ordered after it. Fails when this cell reaches
+    // a cell of the range.
+    bool OrderAfter(const CellRange &range, std::vector<Cell *> sources);
+
+    // a new cell takes the top of the order, the formulas whose ranges
+    // cover it are moved above it
+    void OrderBeforeRangeDependents();
+
+    // calls func for every stored cell this formula depends on
+    template <class Func>
+    void ForEachDependency(Func func) const;
+
+    const RangeIndex &GetRangeIndex() const;
+
     void RemoveAffected(Cell *cell);
 
     void ClearCache() const;
 
+    // writes the value of the cell into the sheet's numeric columns
+    void UpdateNumericColumns() const;
+
     class Impl;
 
     class EmptyImpl;
@@ -50,9 +124,44 @@ private:
 
     class FormulaImpl;
 
+    // the implementation for the text, as Set would install it; a formula
+    // text is only parsed if formula is null
+    PoolPtr<Impl> MakeImpl(std::string text, std::unique_ptr<FormulaInterface> formula = nullptr);
+
+    using CellSet = std::unordered_set<Cell *, std::hash<Cell *>, std::equal_to<Cell *>, PoolAllocator<Cell *>>;
+
+    using CellList = std::vector<Cell *, PoolAllocator<Cell *>>;
+
+    using RangeList = std::vector<CellRange, PoolAllocator<CellRange>>;
+
+    // the formula of the cell, nullptr for other cells
+    const FormulaInterface *GetFormula() const;
+
+    // the value of a formula if it is cached, without counting a hit
+    std::optional<FormulaInterface::Value> GetCachedValue() const;
+
+    // the cells the formula refers to on their own, nullptr for other cells
+    const CellList *GetDependencyList() const;
+
+    // Install the state read from a snapshot without parsing it. The edges
+    // are added by RestoreEdges once all the cells of the sheet exist.
+    void RestoreText(std::string text, std::optional<double> number);
+
+    void RestoreFormula(std::unique_ptr<FormulaInterface> formula, const std::vector<Cell *> &dependencies,
+                        std::optional<FormulaInterface::Value> cache);
+
+    void RestoreEdges();
+
     Sheet &sheet_;
     Position position_;
-    std::unique_ptr<Impl> impl_;
-    std::unordered_set<Cell*> affect_on_;
+    PoolPtr<Impl> impl_;
+    CellSet affect_on_;
+    // every cell comes before the cells it affects
+    std::int64_t order_;
+    // set while the cell is in the search region of AddAffectedOrdered
+    bool marked_ = false;
+    // set while SetMany has not yet added the edges to the formula, which
+    // then does not count as depending on anything
+    bool edges_pending_ = false;
 
 };
\ No newline at end of file
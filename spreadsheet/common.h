@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -13,19 +14,102 @@ struct Position {
     int row = 0;
     int col = 0;
 
-    bool operator==(Position rhs) const;
-    bool operator<(Position rhs) const;
+    constexpr bool operator==(Position rhs) const;
+    constexpr bool operator<(Position rhs) const;
 
-    bool IsValid() const;
+    constexpr bool IsValid() const;
     std::string ToString() const;
 
-    static Position FromString(std::string_view str);
+    // Writes the position into buf (at least MAX_STRING_LENGTH chars)
+    // without a terminating zero and returns the number of chars written,
+    // 0 for an invalid position.
+    constexpr std::size_t ToChars(char *buf) const;
+
+    static constexpr Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    static const int MAX_STRING_LENGTH = 8;  // XFD16384
     static const Position NONE;
 };
 
+inline constexpr Position Position::NONE = {-1, -1};
+
+constexpr bool Position::operator==(const Position rhs) const {
+    return row == rhs.row && col == rhs.col;
+}
+
+constexpr bool Position::operator<(const Position rhs) const {
+    return row < rhs.row || (row == rhs.row && col < rhs.col);
+}
+
+constexpr bool Position::IsValid() const {
+    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+}
+
+constexpr std::size_t Position::ToChars(char *buf) const {
+    constexpr int LETTERS = 26;
+
+    if (!IsValid()) {
+        return 0;
+    }
+
+    // the letters of the column come out last first
+    char letters[MAX_STRING_LENGTH] = {};
+    std::size_t letter_count = 0;
+    for (int c = col; c >= 0; c = c / LETTERS - 1) {
+        letters[letter_count++] = static_cast<char>('A' + c % LETTERS);
+    }
+
+    char digits[MAX_STRING_LENGTH] = {};
+    std::size_t digit_count = 0;
+    for (int r = row + 1; r > 0; r /= 10) {
+        digits[digit_count++] = static_cast<char>('0' + r % 10);
+    }
+
+    std::size_t length = 0;
+    while (letter_count > 0) {
+        buf[length++] = letters[--letter_count];
+    }
+    while (digit_count > 0) {
+        buf[length++] = digits[--digit_count];
+    }
+    return length;
+}
+
+// Accepts 1-3 capital letters and 1-5 digits, like "A1" or "XFD16384".
+constexpr Position Position::FromString(std::string_view str) {
+    constexpr int LETTERS = 26;
+    constexpr std::size_t MAX_LETTER_COUNT = 3;
+    constexpr std::size_t MAX_DIGIT_COUNT = 5;
+
+    std::size_t i = 0;
+    int col = 0;
+    for (; i < str.size() && str[i] >= 'A' && str[i] <= 'Z'; ++i) {
+        if (i == MAX_LETTER_COUNT) {
+            return NONE;
+        }
+        col = col * LETTERS + (str[i] - 'A' + 1);
+    }
+
+    const std::size_t letter_count = i;
+    const std::size_t digit_count = str.size() - letter_count;
+    if (letter_count == 0 || digit_count == 0 || digit_count > MAX_DIGIT_COUNT) {
+        return NONE;
+    }
+
+    int row = 0;
+    for (; i < str.size(); ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return NONE;
+        }
+        row = row * 10 + (str[i] - '0');
+    }
+
+    const Position res{row - 1, col - 1};
+    return res.IsValid() ? res : NONE;
+}
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -33,6 +117,31 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// A rectangle of cells such as A1:B10: first is the top left corner, last
+// the bottom right one.
+struct CellRange {
+    Position first;
+    Position last;
+
+    constexpr bool operator==(const CellRange &rhs) const {
+        return first == rhs.first && last == rhs.last;
+    }
+
+    constexpr bool operator<(const CellRange &rhs) const {
+        return first < rhs.first || (first == rhs.first && last < rhs.last);
+    }
+
+    constexpr bool Contains(Position pos) const {
+        return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+    }
+
+    // the range with the same corners where first is not right of or below last
+    static constexpr CellRange Normalized(Position a, Position b) {
+        return {{a.row < b.row ? a.row : b.row, a.col < b.col ? a.col : b.col},
+                {a.row < b.row ? b.row : a.row, a.col < b.col ? b.col : a.col}};
+    }
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -0,0 +1,77 @@
+#include "durable_file.h"
+
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+void ReplaceFileDurably(const std::string &path, const std::vector<std::string_view> &parts) {
+    const auto temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        for (const auto part: parts) {
+            out.write(part.data(), static_cast<std::streamsize>(part.size()));
+        }
+        out.close();
+        if (!out) { throw std::runtime_error("Cannot write " + temp_path); }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    if (error) { throw std::runtime_error("Cannot replace " + path + ": " + error.message()); }
+}
+
+void SyncParentDirectory(const std::string &) {
+}
+#else
+namespace {
+    std::runtime_error SystemError(const std::string &what, const std::string &path) {
+        return std::runtime_error(what + " " + path + ": " + std::generic_category().message(errno));
+    }
+}  // namespace
+
+void ReplaceFileDurably(const std::string &path, const std::vector<std::string_view> &parts) {
+    const auto temp_path = path + ".tmp";
+    const int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { throw SystemError("Cannot create", temp_path); }
+
+    for (auto part: parts) {
+        while (!part.empty()) {
+            const auto written = ::write(fd, part.data(), part.size());
+            if (written < 0 && errno == EINTR) { continue; }
+            if (written < 0) {
+                const auto error = SystemError("Cannot write", temp_path);
+                ::close(fd);
+                throw error;
+            }
+            part.remove_prefix(static_cast<std::size_t>(written));
+        }
+    }
+    if (::fsync(fd) != 0) {
+        const auto error = SystemError("Cannot flush", temp_path);
+        ::close(fd);
+        throw error;
+    }
+    ::close(fd);
+
+    if (::rename(temp_path.c_str(), path.c_str()) != 0) { throw SystemError("Cannot replace", path); }
+    SyncParentDirectory(path);
+}
+
+void SyncParentDirectory(const std::string &path) {
+    auto directory = std::filesystem::path(path).parent_path();
+    if (directory.empty()) { directory = "."; }
+    const int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0) { throw SystemError("Cannot open", directory.string()); }
+    const bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    if (!synced) { throw SystemError("Cannot flush", directory.string()); }
+}
+#endif
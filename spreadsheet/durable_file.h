@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Replaces the file at path with the concatenation of parts so that after a
+// crash it holds either the old or the new content: the parts are written to
+// a temporary file, which is flushed to disk and renamed over path, and the
+// rename is flushed too. Throws std::runtime_error on failure.
+void ReplaceFileDurably(const std::string &path, const std::vector<std::string_view> &parts);
+
+// flushes the entry of a renamed or created file, a no-op where the system
+// does not need it
+void SyncParentDirectory(const std::string &path);
@@ -1,73 +1,437 @@
-#include "formula.h"
-
-#include "FormulaAST.h"
-#include "sheet.h"
-
-#include <algorithm>
-#include <cassert>
-#include <cctype>
-#include <sstream>
-
-using namespace std::literals;
-
-std::ostream &operator<<(std::ostream &output, FormulaError fe) {
-    return output << fe.ToString();
-}
-
-namespace {
-    class Formula : public FormulaInterface {
-    public:
-// Реализуйте следующие методы:
-        explicit Formula(std::string expression) : ast_(ParseFormulaAST(expression)) {
-        }
-
-        Value Evaluate(const SheetInterface &sheet) const override {
-            try {
-                std::function<double(const Position)> GetValue = [&sheet](const Position pos) -> double {
-                    const auto cell = sheet.GetCell(pos);
-                    if (!cell) {
-                        if (pos.IsValid()) { return 0.0; }
-                        else { throw FormulaError{FormulaError::Category::Ref}; }
-                    }
-
-                    return std::visit([](auto &&arg) -> double {
-                        using T = std::decay_t<decltype(arg)>;
-                        if constexpr (std::is_same_v<T, double>) { return arg; }
-                        else if constexpr (std::is_same_v<T, std::string>) {
-                            if (arg.empty()) { return 0.0; }
-                            else if (double d{};(std::istringstream(arg) >> d >> std::ws).eof()) { return d; }
-                            else { throw FormulaError{FormulaError::Category::Value}; }
-                        } else if constexpr (std::is_same_v<T, FormulaError>) {
-                            throw arg;
-                        }
-                    }, cell->GetValue());
-                };
-
-                return ast_.Execute(GetValue);
-            } catch (const FormulaError &evaluate_error) {
-                return evaluate_error;
-            }
-        }
-
-        std::string GetExpression() const override {
-            std::ostringstream out;
-            ast_.PrintFormula(out);
-            return out.str();
-        }
-
-        std::vector<Position> GetReferencedCells() const override;
-
-    private:
-        FormulaAST ast_;
-    };
-
-    std::vector<Position> Formula::GetReferencedCells() const {
-        auto cells = ast_.GetCells();
-        cells.unique();
-        return std::vector<Position> {cells.begin(), cells.end()};
-    }
-}  // namespace
-
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
-}
\ No newline at end of file
+#include "formula.h"
+
+#include "FormulaAST.h"
+#include "byte_io.h"
+#include "sheet.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <chrono>
+#include <optional>
+#include <sstream>
+
+using namespace std::literals;
+
+std::ostream &operator<<(std::ostream &output, FormulaError fe) {
+    return output << fe.ToString();
+}
+
+namespace {
+    // Reads a referenced cell as a number or the error it gives.
+    FormulaInterface::Value GetCellNumber(const SheetInterface &sheet, const Position pos) {
+        const auto cell = sheet.GetCell(pos);
+        if (!cell) {
+            if (pos.IsValid()) { return 0.0; }
+            else { return FormulaError{FormulaError::Category::Ref}; }
+        }
+
+        return std::visit([](auto &&arg) -> FormulaInterface::Value {
+            using T = std::decay_t<decltype(arg)>;
+            if constexpr (std::is_same_v<T, double>) { return arg; }
+            else if constexpr (std::is_same_v<T, std::string>) {
+                if (arg.empty()) { return 0.0; }
+                else if (double d{};(std::istringstream(arg) >> d >> std::ws).eof()) { return d; }
+                else { return FormulaError{FormulaError::Category::Value}; }
+            } else if constexpr (std::is_same_v<T, FormulaError>) {
+                return arg;
+            }
+        }, cell->GetValue());
+    }
+
+    // The same for the cells of a Sheet, which keep their text parsed as a
+    // number, so reading one does not copy its value.
+    FormulaInterface::Value GetCellNumber(const Sheet &sheet, const Position pos) {
+        const auto cell = sheet.GetCellPtr(pos);
+        if (!cell) { return 0.0; }
+        return cell->GetNumericValue();
+    }
+
+    // Reads a cell of a range, false for an empty cell, which the aggregate
+    // functions skip.
+    bool GetRangeCellNumber(const SheetInterface &sheet, const Position pos, FormulaInterface::Value &value) {
+        const auto cell = sheet.GetCell(pos);
+        if (!cell || cell->GetText().empty()) { return false; }
+        value = GetCellNumber(sheet, pos);
+        return true;
+    }
+
+    // Appends the numbers of the non-empty cells of the range, column by column.
+    // Returns the first error among them.
+    std::optional<FormulaError> ReadRange(const SheetInterface &sheet, const CellRange &range, std::vector<double> &values) {
+        constexpr std::size_t MAX_RESERVE = 1 << 16;
+
+        if (!range.first.IsValid() || !range.last.IsValid()) {
+            return FormulaError{FormulaError::Category::Ref};
+        }
+        const auto area = static_cast<std::size_t>(range.last.row - range.first.row + 1)
+                          * static_cast<std::size_t>(range.last.col - range.first.col + 1);
+        values.reserve(values.size() + std::min(area, MAX_RESERVE));
+
+        FormulaInterface::Value value;
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            for (int row = range.first.row; row <= range.last.row; ++row) {
+                if (!GetRangeCellNumber(sheet, Position{row, col}, value)) { continue; }
+                if (const auto number = std::get_if<double>(&value)) {
+                    values.push_back(*number);
+                } else {
+                    return std::get<FormulaError>(value);
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+    // The same for the own sheet, streaming its numeric columns: only the
+    // filled cells without a known number are read from the cells.
+    std::optional<FormulaError> ReadRange(const Sheet &sheet, const CellRange &range, std::vector<double> &values) {
+        if (!range.first.IsValid() || !range.last.IsValid()) {
+            return FormulaError{FormulaError::Category::Ref};
+        }
+
+        const auto &columns = sheet.GetNumericColumns();
+        std::optional<FormulaError> error;
+        for (int col = range.first.col; col <= range.last.col && !error; ++col) {
+            columns.ForEachFilled(col, range.first.row, range.last.row, [&values](double number) {
+                values.push_back(number);
+            }, [&](int row) {
+                const auto value = sheet.GetCellPtr(Position{row, col})->GetNumericValue();
+                if (const auto number = std::get_if<double>(&value)) {
+                    values.push_back(*number);
+                    return true;
+                }
+                error = std::get<FormulaError>(value);
+                return false;
+            });
+        }
+        return error;
+    }
+
+    class Formula : public FormulaInterface {
+    public:
+        // every cell of the body is moved by offset
+        Formula(std::shared_ptr<const FormulaBody> body, Position offset);
+
+        Value Evaluate(const SheetInterface &sheet) const override;
+
+        std::string GetExpression() const override;
+
+        std::vector<Position> GetReferencedCells() const override;
+
+        References GetReferences() const override;
+
+        const std::shared_ptr<const FormulaBody> &GetBody() const {
+            return body_;
+        }
+
+        Position GetOffset() const {
+            return offset_;
+        }
+
+    private:
+        Position Translate(Position cell) const {
+            return Position{cell.row + offset_.row, cell.col + offset_.col};
+        }
+
+        CellRange Translate(const CellRange &range) const {
+            return CellRange{Translate(range.first), Translate(range.last)};
+        }
+
+        std::shared_ptr<const FormulaBody> body_;
+        Position offset_;
+    };
+}  // namespace
+
+// The parsed formula with the anchor its cells are relative to.
+struct FormulaBody {
+    FormulaBody(std::shared_ptr<const FormulaAST> ast, Position anchor) : ast(std::move(ast)), anchor(anchor) {
+    }
+
+    // the tree does not depend on the anchor, a FormulaCache may share it
+    const std::shared_ptr<const FormulaAST> ast;
+    const Position anchor;
+};
+
+namespace {
+    Formula::Formula(std::shared_ptr<const FormulaBody> body, Position offset)
+            : body_(std::move(body)), offset_(offset) {
+    }
+
+    FormulaInterface::Value Formula::Evaluate(const SheetInterface &sheet) const {
+        constexpr std::size_t INLINE_SLOTS = 16;
+
+        // every referenced cell is resolved once, the program reads them by slot
+        const auto &cells = body_->ast->GetCells();
+        double inline_values[INLINE_SLOTS];
+        std::vector<double> heap_values;
+
+        double *values = inline_values;
+        if (cells.size() > INLINE_SLOTS) {
+            heap_values.resize(cells.size());
+            values = heap_values.data();
+        }
+
+        // the numbers of all the ranges are read into one contiguous array
+        const auto &ranges = body_->ast->GetRanges();
+        std::vector<double> range_data;
+        std::vector<FormulaProgram::RangeValues> range_values(ranges.size());
+
+        // The first referenced error, row by row and the ranges after the
+        // cells, is the result before the program runs, so it wins over an
+        // arithmetic error wherever that is in the formula.
+        const auto resolve_cells = [&](const auto &source) -> std::optional<FormulaError> {
+            for (std::size_t i = 0; i < cells.size(); ++i) {
+                const auto value = GetCellNumber(source, Translate(cells[i]));
+                if (const auto error = std::get_if<FormulaError>(&value)) { return *error; }
+                values[i] = std::get<double>(value);
+            }
+            return std::nullopt;
+        };
+        const auto resolve_ranges = [&](const auto &source) -> std::optional<FormulaError> {
+            for (std::size_t i = 0; i < ranges.size(); ++i) {
+                if (const auto error = ReadRange(source, Translate(ranges[i]), range_data)) { return error; }
+                range_values[i].size = range_data.size();
+            }
+            return std::nullopt;
+        };
+
+        const auto own_sheet = dynamic_cast<const Sheet *>(&sheet);
+        if (const auto error = own_sheet ? resolve_cells(*own_sheet) : resolve_cells(sheet)) {
+            return *error;
+        }
+        if (const auto error = own_sheet ? resolve_ranges(*own_sheet) : resolve_ranges(sheet)) {
+            return *error;
+        }
+
+        // sizes hold the end offsets until the data stops moving
+        std::size_t begin = 0;
+        for (auto &range: range_values) {
+            range.data = range_data.data() + begin;
+            range.size -= std::exchange(begin, range.size);
+        }
+        return body_->ast->GetProgram().Execute(values, range_values.data());
+    }
+
+    std::string Formula::GetExpression() const {
+        std::ostringstream out;
+        body_->ast->PrintFormula(out, offset_);
+        return out.str();
+    }
+
+    std::vector<Position> Formula::GetReferencedCells() const {
+        // moving all the cells keeps them sorted
+        const auto &cells = body_->ast->GetCells();
+        std::vector<Position> result;
+        result.reserve(cells.size());
+        for (const auto cell: cells) {
+            result.push_back(Translate(cell));
+        }
+
+        // every cell of a range is referenced too
+        const auto &ranges = body_->ast->GetRanges();
+        if (!ranges.empty()) {
+            for (const auto &range: ranges) {
+                const auto moved = Translate(range);
+                for (int row = moved.first.row; row <= moved.last.row; ++row) {
+                    for (int col = moved.first.col; col <= moved.last.col; ++col) {
+                        result.push_back(Position{row, col});
+                    }
+                }
+            }
+            std::sort(result.begin(), result.end());
+            result.erase(std::unique(result.begin(), result.end()), result.end());
+        }
+        return result;
+    }
+
+    FormulaInterface::References Formula::GetReferences() const {
+        References references;
+        references.cells.reserve(body_->ast->GetCells().size());
+        for (const auto cell: body_->ast->GetCells()) {
+            references.cells.push_back(Translate(cell));
+        }
+        references.ranges.reserve(body_->ast->GetRanges().size());
+        for (const auto &range: body_->ast->GetRanges()) {
+            references.ranges.push_back(Translate(range));
+        }
+        return references;
+    }
+}  // namespace
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+    // anchored at A1 and not moved
+    return std::make_unique<Formula>(
+            std::make_shared<FormulaBody>(FormulaCache::GetGlobal().Parse(expression), Position{0, 0}), Position{0, 0});
+}
+
+std::pair<std::shared_ptr<const FormulaBody>, Position> GetFormulaBody(const FormulaInterface &formula) {
+    if (const auto own = dynamic_cast<const Formula *>(&formula)) {
+        return {own->GetBody(), own->GetOffset()};
+    }
+    return {nullptr, Position{0, 0}};
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaBody> body, Position offset) {
+    return std::make_unique<Formula>(std::move(body), offset);
+}
+
+std::unique_ptr<FormulaInterface> MakeFormulaAt(std::shared_ptr<const FormulaBody> body, Position anchor) {
+    const Position offset{anchor.row - body->anchor.row, anchor.col - body->anchor.col};
+    return std::make_unique<Formula>(std::move(body), offset);
+}
+
+std::shared_ptr<const FormulaBody> ParseFormulaBody(std::string_view expression, Position anchor, bool *parsed) {
+    return std::make_shared<const FormulaBody>(FormulaCache::GetGlobal().Parse(expression, parsed), anchor);
+}
+
+void SerializeFormulaBody(const FormulaBody &body, std::string &out) {
+    AppendBytes(out, static_cast<std::int32_t>(body.anchor.row));
+    AppendBytes(out, static_cast<std::int32_t>(body.anchor.col));
+    body.ast->Serialize(out);
+}
+
+std::shared_ptr<const FormulaBody> DeserializeFormulaBody(std::string_view data) {
+    ByteReader reader(data);
+    std::int32_t row = 0;
+    std::int32_t col = 0;
+    if (!reader.Read(row) || !reader.Read(col)) { throw ParsingError("Corrupt formula body"); }
+    return std::make_shared<const FormulaBody>(
+            std::make_shared<const FormulaAST>(DeserializeFormulaAST(data.substr(2 * sizeof(std::int32_t)))),
+            Position{row, col});
+}
+
+FormulaInterner::FormulaInterner(EngineCounters *counters) : next_sweep_size_(1024), counters_(counters) {
+}
+
+FormulaInterner::~FormulaInterner() = default;
+
+std::unique_ptr<FormulaInterface> FormulaInterner::Parse(std::string expression, Position anchor) {
+    auto key = MakeFormulaShapeKey(expression, anchor);
+    if (key.empty()) {
+        // let the parser report the error
+        return ParseFormula(std::move(expression));
+    }
+
+    auto &shape = shapes_[std::move(key)];
+    auto body = shape.lock();
+    if (!body) {
+#ifdef SPREADSHEET_WITH_STATS
+        const auto start = std::chrono::steady_clock::now();
+        bool parsed = false;
+        body = std::make_shared<const FormulaBody>(FormulaCache::GetGlobal().Parse(expression, &parsed), anchor);
+        if (counters_ && parsed) {
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            counters_->Add(EngineCounters::Counter::FormulasParsed);
+            counters_->Add(EngineCounters::Counter::ParseNanoseconds, static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        }
+#else
+        body = std::make_shared<const FormulaBody>(FormulaCache::GetGlobal().Parse(expression), anchor);
+#endif
+        shape = body;
+
+        // forget the shapes no formula uses any more once the map has doubled
+        if (shapes_.size() >= next_sweep_size_) {
+            for (auto it = shapes_.begin(); it != shapes_.end();) {
+                it = it->second.expired() ? shapes_.erase(it) : std::next(it);
+            }
+            next_sweep_size_ = std::max<std::size_t>(1024, shapes_.size() * 2);
+        }
+    }
+
+    const Position offset{anchor.row - body->anchor.row, anchor.col - body->anchor.col};
+    return std::make_unique<Formula>(std::move(body), offset);
+}
+
+std::shared_ptr<const FormulaBody> FormulaInterner::Adopt(std::string key, std::shared_ptr<const FormulaBody> body) {
+    if (key.empty()) { return body; }
+
+    auto &shape = shapes_[std::move(key)];
+    if (auto known = shape.lock()) { return known; }
+    shape = body;
+    return body;
+}
+
+std::size_t FormulaInterner::GetMemoryUsage() const {
+    std::size_t bytes = 0;
+    for (const auto &[key, shape]: shapes_) {
+        if (const auto body = shape.lock()) {
+            bytes += sizeof(FormulaBody) + sizeof(FormulaAST) + body->ast->GetMemoryUsage();
+        }
+    }
+    return bytes;
+}
+
+std::size_t FormulaInterner::GetShapeCount() const {
+    std::size_t count = 0;
+    for (const auto &[key, body]: shapes_) {
+        count += body.expired() ? 0 : 1;
+    }
+    return count;
+}
+
+FormulaCache::FormulaCache(std::size_t capacity) : capacity_(capacity) {
+}
+
+FormulaCache::~FormulaCache() = default;
+
+FormulaCache &FormulaCache::GetGlobal() {
+    static FormulaCache cache;
+    return cache;
+}
+
+std::shared_ptr<const FormulaAST> FormulaCache::Parse(std::string_view expression, bool *parsed) {
+    {
+        std::lock_guard lock(mutex_);
+        if (const auto it = index_.find(expression); it != index_.end()) {
+            ++hits_;
+            entries_.splice(entries_.begin(), entries_, it->second);
+            if (parsed) { *parsed = false; }
+            return it->second->ast;
+        }
+        ++misses_;
+    }
+
+    // parsed without the lock, a tree parsed by two threads at once is kept once
+    auto ast = std::make_shared<const FormulaAST>(ParseFormulaAST(expression));
+    if (parsed) { *parsed = true; }
+
+    // the text, the tree and the nodes of the list and of the index
+    const auto bytes = sizeof(Entry) + expression.size() + sizeof(FormulaAST) + ast->GetMemoryUsage()
+                       + sizeof(decltype(index_)::value_type) + 4 * sizeof(void *);
+
+    std::lock_guard lock(mutex_);
+    if (bytes > capacity_ || index_.count(expression) > 0) { return ast; }
+    entries_.push_front(Entry{std::string(expression), ast, bytes});
+    index_.emplace(entries_.front().expression, entries_.begin());
+    bytes_ += bytes;
+    Shrink();
+    return ast;
+}
+
+void FormulaCache::SetCapacity(std::size_t capacity) {
+    std::lock_guard lock(mutex_);
+    capacity_ = capacity;
+    Shrink();
+}
+
+void FormulaCache::Clear() {
+    std::lock_guard lock(mutex_);
+    index_.clear();
+    entries_.clear();
+    bytes_ = 0;
+}
+
+FormulaCache::Stats FormulaCache::GetStats() const {
+    std::lock_guard lock(mutex_);
+    return Stats{hits_, misses_, entries_.size(), bytes_, capacity_};
+}
+
+void FormulaCache::Shrink() {
+    while (bytes_ > capacity_) {
+        bytes_ -= entries_.back().bytes;
+        index_.erase(entries_.back().expression);
+        entries_.pop_back();
+    }
+}
@@ -2,13 +2,22 @@
 
 #include "common.h"
 
+#include <cstdint>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции от диапазонов и выражений: SUM(A1:B10), AVERAGE(A1:A5,C1),
+//   MIN, MAX, COUNT. Пустые ячейки диапазона пропускаются.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,8 +43,156 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // The references of the formula as they are written: lone cells and
+    // ranges. Unlike GetReferencedCells, the cells of the ranges are not
+    // listed. Both lists are sorted and hold no duplicates.
+    struct References {
+        std::vector<Position> cells;
+        std::vector<CellRange> ranges;
+    };
+
+    virtual References GetReferences() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+
+struct FormulaBody;
+
+class EngineCounters;
+
+class FormulaAST;
+
+// Parsed expressions by their text, for clients that send the same formulas
+// again and again: templates reloaded, undo and redo, retries. The trees are
+// immutable and shared by the formulas of any sheet, so one cache serves the
+// whole process. The least recently used trees are dropped once the cache
+// holds more than its capacity. All methods may be called from any thread.
+class FormulaCache {
+public:
+    static constexpr std::size_t DEFAULT_CAPACITY = 1 << 20;
+
+    struct Stats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::size_t entries = 0;
+        // estimated heap bytes of the texts and the trees
+        std::size_t bytes = 0;
+        std::size_t capacity = 0;
+    };
+
+    // capacity in bytes, 0 keeps nothing
+    explicit FormulaCache(std::size_t capacity = DEFAULT_CAPACITY);
+
+    FormulaCache(const FormulaCache &) = delete;
+
+    FormulaCache &operator=(const FormulaCache &) = delete;
+
+    ~FormulaCache();
+
+    // the cache of ParseFormula and of the sheets
+    static FormulaCache &GetGlobal();
+
+    // The tree of expression, parsed only if it is not cached; parsed, if
+    // given, tells which. Throws FormulaException, which is not cached.
+    std::shared_ptr<const FormulaAST> Parse(std::string_view expression, bool *parsed = nullptr);
+
+    // drops the least recently used trees down to the new capacity
+    void SetCapacity(std::size_t capacity);
+
+    void Clear();
+
+    Stats GetStats() const;
+
+private:
+    struct Entry {
+        std::string expression;
+        std::shared_ptr<const FormulaAST> ast;
+        std::size_t bytes;
+    };
+
+    // drops entries from the back until the capacity is met
+    void Shrink();
+
+    mutable std::mutex mutex_;
+    // the most recently used first; the keys of index_ view the expressions
+    std::list<Entry> entries_;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+    std::size_t bytes_ = 0;
+    std::size_t capacity_;
+    std::uint64_t hits_ = 0;
+    std::uint64_t misses_ = 0;
+};
+
+// The body a formula made by a FormulaInterner shares and the offset of the
+// formula's cells from the body's. The body is null for other formulas.
+std::pair<std::shared_ptr<const FormulaBody>, Position> GetFormulaBody(const FormulaInterface &formula);
+
+// the formula of body with its cells moved by offset
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaBody> body, Position offset);
+
+// the formula of body as if it was entered at anchor
+std::unique_ptr<FormulaInterface> MakeFormulaAt(std::shared_ptr<const FormulaBody> body, Position anchor);
+
+// Parses an expression entered at anchor into a body of its own, to be
+// shared with FormulaInterner::Adopt, through the global FormulaCache.
+// Unlike the interner it may be called from any thread. parsed is set as by
+// FormulaCache::Parse. Throws FormulaException.
+std::shared_ptr<const FormulaBody> ParseFormulaBody(std::string_view expression, Position anchor,
+                                                    bool *parsed = nullptr);
+
+// Appends the anchor and the serialized tree of the body.
+void SerializeFormulaBody(const FormulaBody &body, std::string &out);
+
+// Reads a body written by SerializeFormulaBody without parsing any text.
+// Throws ParsingError if the data is corrupt.
+std::shared_ptr<const FormulaBody> DeserializeFormulaBody(std::string_view data);
+
+// Shares one parsed and compiled body between formulas of the same shape,
+// such as a column filled down with =A1*B1, =A2*B2, ... Each formula keeps
+// only the offset of its cells from the body's. A shape that is already
+// known is recognised by a scan of its tokens, without parsing it again; a
+// new one takes its tree from the global FormulaCache.
+class FormulaInterner {
+public:
+    // counters, if given, count the expressions parsed and the time spent
+    explicit FormulaInterner(EngineCounters *counters = nullptr);
+
+    FormulaInterner(const FormulaInterner &) = delete;
+
+    FormulaInterner &operator=(const FormulaInterner &) = delete;
+
+    ~FormulaInterner();
+
+    // ParseFormula for an expression entered in the cell at anchor.
+    std::unique_ptr<FormulaInterface> Parse(std::string expression, Position anchor);
+
+    // Registers a body parsed elsewhere, such as one read from a snapshot,
+    // under its shape key, so that the formulas entered later share it.
+    // Returns the body in use for the shape, which is an earlier one if
+    // the shape is known already.
+    std::shared_ptr<const FormulaBody> Adopt(std::string key, std::shared_ptr<const FormulaBody> body);
+
+    // calls func(key, body) for every shape in use
+    template <class Func>
+    void ForEachShape(Func func) const {
+        for (const auto &[key, shape]: shapes_) {
+            if (const auto body = shape.lock()) { func(key, body); }
+        }
+    }
+
+    // number of distinct shapes in use
+    std::size_t GetShapeCount() const;
+
+    // heap bytes of the bodies of the shapes in use
+    std::size_t GetMemoryUsage() const;
+
+private:
+    // bodies are owned by the formulas, the map forgets the unused ones
+    std::unordered_map<std::string, std::weak_ptr<const FormulaBody>> shapes_;
+    std::size_t next_sweep_size_;
+    EngineCounters *counters_;
+};
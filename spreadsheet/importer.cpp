@@ -0,0 +1,139 @@
+#include "sheet.h"
+
+#include "FormulaAST.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+    // a chunk of lines is split and parsed by one thread
+    constexpr std::size_t CHUNK_BYTES = 256 * 1024;
+    constexpr std::size_t NO_FORMULA = static_cast<std::size_t>(-1);
+
+    struct Field {
+        Position pos;
+        std::string_view text;
+        // set for a formula, with the key of its shape
+        std::shared_ptr<const FormulaBody> body;
+        std::string key;
+    };
+
+    struct Chunk {
+        // whole lines, the last one may lack its line break
+        std::string_view data;
+        int first_row = 0;
+        std::vector<Field> fields;
+        std::size_t formulas_parsed = 0;
+    };
+
+    // Splits the lines of the chunk into fields and parses the formulas. A
+    // formula filled down a column has the shape of the one above it, which
+    // is reused instead of being parsed again.
+    void ParseChunk(Chunk &chunk, char delimiter) {
+        // the index in fields of the last formula of every column
+        std::vector<std::size_t> last_formulas;
+        auto rest = chunk.data;
+        for (int row = chunk.first_row; !rest.empty(); ++row) {
+            const auto line_end = rest.find('\n');
+            auto line = rest.substr(0, line_end);
+            rest.remove_prefix(line_end == std::string_view::npos ? rest.size() : line_end + 1);
+            // a CRLF line break
+            if (!line.empty() && line.back() == '\r') { line.remove_suffix(1); }
+
+            std::size_t start = 0;
+            for (int col = 0;; ++col) {
+                const auto field_end = line.find(delimiter, start);
+                const auto length = field_end == std::string_view::npos ? field_end : field_end - start;
+                const auto text = line.substr(start, length);
+                if (!text.empty()) {
+                    const Position pos{row, col};
+                    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
+
+                    Field field{pos, text, nullptr, {}};
+                    if (text.size() > 1 && text[0] == FORMULA_SIGN) {
+                        const auto expression = text.substr(1);
+                        // an expression that does not lex has no key, the parser reports it
+                        field.key = MakeFormulaShapeKey(expression, pos);
+                        if (last_formulas.size() <= static_cast<std::size_t>(col)) {
+                            last_formulas.resize(col + 1, NO_FORMULA);
+                        }
+                        auto &last = last_formulas[col];
+                        if (!field.key.empty() && last != NO_FORMULA && chunk.fields[last].key == field.key) {
+                            field.body = chunk.fields[last].body;
+                        } else {
+                            bool parsed = false;
+                            field.body = ParseFormulaBody(expression, pos, &parsed);
+                            chunk.formulas_parsed += parsed ? 1 : 0;
+                        }
+                        last = chunk.fields.size();
+                    }
+                    chunk.fields.push_back(std::move(field));
+                }
+                if (field_end == std::string_view::npos) { break; }
+                start = field_end + 1;
+            }
+        }
+    }
+}  // namespace
+
+void Sheet::ImportTexts(std::string_view data, char delimiter, std::size_t thread_count) {
+    // every chunk ends with a line break but the last one
+    std::vector<Chunk> chunks;
+    while (!data.empty()) {
+        auto end = data.size();
+        if (end > CHUNK_BYTES) {
+            const auto line_end = data.find('\n', CHUNK_BYTES - 1);
+            end = line_end == std::string_view::npos ? data.size() : line_end + 1;
+        }
+        chunks.emplace_back();
+        chunks.back().data = data.substr(0, end);
+        data.remove_prefix(end);
+    }
+
+    // the rows of a chunk follow the line breaks of the ones before it
+    auto &pool = GetThreadPool(thread_count);
+    pool.ParallelFor(chunks.size(), 1, [&chunks](std::size_t begin, std::size_t end) {
+        for (auto i = begin; i < end; ++i) {
+            chunks[i].first_row = static_cast<int>(std::count(chunks[i].data.begin(), chunks[i].data.end(), '\n'));
+        }
+    });
+    int row = 0;
+    for (auto &chunk: chunks) {
+        row += std::exchange(chunk.first_row, row);
+    }
+
+    pool.ParallelFor(chunks.size(), 1, [&chunks, delimiter](std::size_t begin, std::size_t end) {
+        for (auto i = begin; i < end; ++i) {
+            ParseChunk(chunks[i], delimiter);
+        }
+    });
+
+    // the interner and the graph are only touched from here on
+    std::vector<Position> positions;
+    std::vector<Cell::Change> changes;
+    std::vector<std::pair<Position, std::string>> logged;
+    std::size_t formulas_parsed = 0;
+    for (auto &chunk: chunks) {
+        formulas_parsed += chunk.formulas_parsed;
+        for (auto &field: chunk.fields) {
+            std::unique_ptr<FormulaInterface> formula;
+            if (field.body) {
+                formula = MakeFormulaAt(formula_interner_.Adopt(std::move(field.key), field.body), field.pos);
+            }
+            positions.push_back(field.pos);
+            changes.push_back(Cell::Change{nullptr, std::string(field.text), std::move(formula)});
+            if (journal_) { logged.emplace_back(field.pos, field.text); }
+        }
+    }
+    counters_.Add(EngineCounters::Counter::FormulasParsed, formulas_parsed);
+
+    const auto changed = SetDistinctCells(positions, std::move(changes));
+
+    if (journal_) { JournalChanged(std::move(logged), changed); }
+}
+
+void Sheet::ImportTextsFile(const std::string &path, char delimiter, std::size_t thread_count) {
+    const MappedFile file(path);
+    ImportTexts(file.GetData(), delimiter, thread_count);
+}
@@ -0,0 +1,406 @@
+#include "journal.h"
+
+#include "byte_io.h"
+#include "durable_file.h"
+#include "mapped_file.h"
+
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <system_error>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Layout of a journal file. Numbers are in the byte order of the machine
+// that wrote it, as in the snapshots.
+//
+//   header   u32 magic, byte order mark, version, u64 LSN of the last
+//            record before the first one in the file
+//   records  u32 payload size, u32 CRC-32 of the payload, payload:
+//            u64 LSN, u8 operation, u32 number of cells, then for every
+//            cell i32 row, i32 col, u32 text size and the text
+//
+// The LSNs of the records follow each other without gaps. The first
+// record that is short, fails its checksum or breaks the sequence ends the
+// journal: it was being written when the process died.
+namespace {
+    constexpr std::uint32_t MAGIC = 0x4c4a5353;  // "SSJL"
+    constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+    constexpr std::uint32_t VERSION = 1;
+    constexpr std::size_t HEADER_SIZE = 3 * sizeof(std::uint32_t) + sizeof(std::uint64_t);
+    constexpr std::size_t FRAME_SIZE = 2 * sizeof(std::uint32_t);
+    // nothing else keeps a corrupt size from claiming the whole file
+    constexpr std::uint32_t MAX_PAYLOAD_SIZE = 1u << 30;
+
+    // CRC-32 with the reflected IEEE polynomial, a byte at a time
+    constexpr std::array<std::uint32_t, 256> MakeCrcTable() {
+        std::array<std::uint32_t, 256> table{};
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            std::uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320u : 0u);
+            }
+            table[i] = crc;
+        }
+        return table;
+    }
+
+    constexpr auto CRC_TABLE = MakeCrcTable();
+
+    std::uint32_t Crc32(std::string_view data) {
+        std::uint32_t crc = ~0u;
+        for (const char c: data) {
+            crc = CRC_TABLE[(crc ^ static_cast<unsigned char>(c)) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    std::string MakeHeader(std::uint64_t last_lsn) {
+        std::string header;
+        AppendBytes(header, MAGIC);
+        AppendBytes(header, BYTE_ORDER_MARK);
+        AppendBytes(header, VERSION);
+        AppendBytes(header, last_lsn);
+        return header;
+    }
+
+    struct ScanResult {
+        // the LSN before the first record and the last intact one
+        std::uint64_t base_lsn;
+        std::uint64_t last_lsn;
+        // where the intact records end
+        std::size_t end;
+    };
+
+    // Calls on_record(lsn, payload) for the intact records of a journal.
+    template <class OnRecord>
+    ScanResult ScanRecords(std::string_view data, const std::string &path, OnRecord on_record) {
+        ByteReader reader(data);
+        std::uint32_t magic = 0;
+        std::uint32_t byte_order = 0;
+        std::uint32_t version = 0;
+        std::uint64_t lsn = 0;
+        if (!reader.Read(magic) || magic != MAGIC) { throw JournalException("Not a journal " + path); }
+        if (!reader.Read(byte_order) || byte_order != BYTE_ORDER_MARK) {
+            throw JournalException("Journal of another byte order " + path);
+        }
+        if (!reader.Read(version) || version != VERSION) {
+            throw JournalException("Unsupported journal version " + std::to_string(version) + " " + path);
+        }
+        if (!reader.Read(lsn)) { throw JournalException("Not a journal " + path); }
+
+        const auto base_lsn = lsn;
+        std::size_t end = HEADER_SIZE;
+        while (true) {
+            std::uint32_t size = 0;
+            std::uint32_t crc = 0;
+            std::string_view payload;
+            std::uint64_t record_lsn = 0;
+            if (!reader.Read(size) || !reader.Read(crc) || size > MAX_PAYLOAD_SIZE
+                || !reader.ReadBytes(size, payload) || Crc32(payload) != crc
+                || !ByteReader(payload).Read(record_lsn) || record_lsn != lsn + 1) {
+                return ScanResult{base_lsn, lsn, end};
+            }
+            on_record(record_lsn, payload);
+            lsn = record_lsn;
+            end += FRAME_SIZE + size;
+        }
+    }
+
+    Journal::Record DecodeRecord(std::string_view payload, const std::string &path) {
+        ByteReader reader(payload);
+        Journal::Record record{};
+        std::uint32_t count = 0;
+        // the checksum matched, so anything wrong here was written that way
+        const auto corrupt = [&path] {
+            return JournalException("Corrupt journal record in " + path);
+        };
+        if (!reader.Read(record.lsn) || !reader.Read(record.operation) || !reader.Read(count)
+            || record.operation > Journal::Operation::SetMany) {
+            throw corrupt();
+        }
+        for (std::uint32_t i = 0; i < count; ++i) {
+            std::int32_t row = 0;
+            std::int32_t col = 0;
+            std::string_view text;
+            if (!reader.Read(row) || !reader.Read(col) || !reader.ReadString(text)) { throw corrupt(); }
+            record.cells.emplace_back(Position{row, col}, std::string(text));
+        }
+        if (!reader.AtEnd()) { throw corrupt(); }
+        return record;
+    }
+
+    std::string SystemMessage(const std::string &what, const std::string &path) {
+        return what + " " + path + ": " + std::generic_category().message(errno);
+    }
+
+#ifdef _WIN32
+    int OpenForAppend(const std::string &path) {
+        return ::_open(path.c_str(), _O_WRONLY | _O_APPEND | _O_BINARY);
+    }
+
+    bool WriteAll(int fd, std::string_view data) {
+        while (!data.empty()) {
+            const auto written = ::_write(fd, data.data(), static_cast<unsigned>(data.size()));
+            if (written < 0) { return false; }
+            data.remove_prefix(static_cast<std::size_t>(written));
+        }
+        return true;
+    }
+
+    bool SyncFile(int fd) {
+        return ::_commit(fd) == 0;
+    }
+
+    bool TruncateFile(int fd, std::size_t size) {
+        return ::_chsize_s(fd, static_cast<long long>(size)) == 0;
+    }
+
+    void CloseFile(int fd) {
+        ::_close(fd);
+    }
+#else
+    int OpenForAppend(const std::string &path) {
+        return ::open(path.c_str(), O_WRONLY | O_APPEND);
+    }
+
+    bool WriteAll(int fd, std::string_view data) {
+        while (!data.empty()) {
+            const auto written = ::write(fd, data.data(), data.size());
+            if (written < 0 && errno == EINTR) { continue; }
+            if (written < 0) { return false; }
+            data.remove_prefix(static_cast<std::size_t>(written));
+        }
+        return true;
+    }
+
+    bool SyncFile(int fd) {
+#ifdef __APPLE__
+        return ::fsync(fd) == 0;
+#else
+        // the size of a journal changes with every commit, so fdatasync
+        // still writes it out
+        return ::fdatasync(fd) == 0;
+#endif
+    }
+
+    bool TruncateFile(int fd, std::size_t size) {
+        return ::ftruncate(fd, static_cast<off_t>(size)) == 0;
+    }
+
+    void CloseFile(int fd) {
+        ::close(fd);
+    }
+#endif
+}  // namespace
+
+Journal::Journal(std::string path) : Journal(std::move(path), Options{}) {
+}
+
+Journal::Journal(std::string path, Options options) : path_(std::move(path)), options_(options) {
+    Open();
+    committer_ = std::thread([this] { RunCommits(); });
+}
+
+Journal::~Journal() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    committer_.join();
+    Close();
+}
+
+void Journal::Open() {
+    std::error_code error;
+    if (std::filesystem::file_size(path_, error) == 0 || error) {
+        try {
+            ReplaceFileDurably(path_, {MakeHeader(0)});
+        } catch (const std::runtime_error &e) {
+            throw JournalException(e.what());
+        }
+    }
+
+    std::size_t end = 0;
+    std::size_t size = 0;
+    {
+        std::unique_ptr<MappedFile> file;
+        try {
+            file = std::make_unique<MappedFile>(path_);
+        } catch (const std::runtime_error &e) {
+            throw JournalException(e.what());
+        }
+        const auto scan = ScanRecords(file->GetData(), path_, [](std::uint64_t, std::string_view) {});
+        end = scan.end;
+        size = file->GetData().size();
+        base_lsn_ = scan.base_lsn;
+        last_lsn_ = scan.last_lsn;
+        committed_lsn_ = scan.last_lsn;
+    }
+
+    fd_ = OpenForAppend(path_);
+    if (fd_ < 0) { throw JournalException(SystemMessage("Cannot open", path_)); }
+    // cut off the torn tail, so that new records follow the intact ones
+    if (end < size && (!TruncateFile(fd_, end) || !SyncFile(fd_))) {
+        const auto message = SystemMessage("Cannot truncate", path_);
+        Close();
+        throw JournalException(message);
+    }
+    file_size_ = end;
+}
+
+void Journal::Close() {
+    if (fd_ >= 0) {
+        CloseFile(fd_);
+        fd_ = -1;
+    }
+}
+
+void Journal::Replay(std::uint64_t after_lsn, const std::function<void(const Record &)> &func) const {
+    std::unique_ptr<MappedFile> file;
+    try {
+        file = std::make_unique<MappedFile>(path_);
+    } catch (const std::runtime_error &e) {
+        throw JournalException(e.what());
+    }
+    ScanRecords(file->GetData(), path_, [&](std::uint64_t lsn, std::string_view payload) {
+        if (lsn > after_lsn) { func(DecodeRecord(payload, path_)); }
+    });
+}
+
+std::uint64_t Journal::Append(Operation operation, Position pos, std::string_view text) {
+    std::string payload;
+    payload.reserve(sizeof(std::uint64_t) + 1 + 4 * sizeof(std::uint32_t) + text.size());
+    AppendBytes(payload, std::uint64_t{0});
+    AppendBytes(payload, operation);
+    AppendBytes(payload, std::uint32_t{1});
+    AppendBytes(payload, static_cast<std::int32_t>(pos.row));
+    AppendBytes(payload, static_cast<std::int32_t>(pos.col));
+    AppendString(payload, text);
+    return Enqueue(payload);
+}
+
+std::uint64_t Journal::Append(Operation operation, const std::vector<std::pair<Position, std::string>> &cells) {
+    std::string payload;
+    AppendBytes(payload, std::uint64_t{0});
+    AppendBytes(payload, operation);
+    AppendBytes(payload, static_cast<std::uint32_t>(cells.size()));
+    for (const auto &[pos, text]: cells) {
+        AppendBytes(payload, static_cast<std::int32_t>(pos.row));
+        AppendBytes(payload, static_cast<std::int32_t>(pos.col));
+        AppendString(payload, text);
+    }
+    return Enqueue(payload);
+}
+
+std::uint64_t Journal::Enqueue(std::string &payload) {
+    if (payload.size() > MAX_PAYLOAD_SIZE) { throw JournalException("Journal record too large"); }
+
+    std::unique_lock lock(mutex_);
+    if (!error_.empty()) { throw JournalException(error_); }
+
+    // the LSN is only known here, its room is at the start of the payload
+    const auto lsn = ++last_lsn_;
+    std::memcpy(payload.data(), &lsn, sizeof(lsn));
+    const bool was_empty = queue_.empty();
+    AppendBytes(queue_, static_cast<std::uint32_t>(payload.size()));
+    AppendBytes(queue_, Crc32(payload));
+    queue_ += payload;
+    const bool full = queue_.size() >= options_.commit_bytes;
+    lock.unlock();
+
+    if (was_empty || full) { wake_.notify_one(); }
+    return lsn;
+}
+
+void Journal::WaitForCommit(std::uint64_t lsn) {
+    std::unique_lock lock(mutex_);
+    ++waiting_;
+    wake_.notify_one();
+    committed_.wait(lock, [&] { return committed_lsn_ >= lsn || !error_.empty(); });
+    --waiting_;
+    if (committed_lsn_ < lsn) { throw JournalException(error_); }
+}
+
+void Journal::Sync() {
+    WaitForCommit(GetLastLsn());
+}
+
+void Journal::Reset(std::uint64_t last_lsn) {
+    Sync();
+
+    std::lock_guard lock(mutex_);
+    // the owner appends from one thread, nothing came in since the commit
+    Close();
+    try {
+        ReplaceFileDurably(path_, {MakeHeader(last_lsn)});
+    } catch (const std::runtime_error &e) {
+        error_ = e.what();
+        throw JournalException(error_);
+    }
+    fd_ = OpenForAppend(path_);
+    if (fd_ < 0) {
+        error_ = SystemMessage("Cannot open", path_);
+        throw JournalException(error_);
+    }
+    file_size_ = HEADER_SIZE;
+    base_lsn_ = last_lsn;
+    last_lsn_ = last_lsn;
+    committed_lsn_ = last_lsn;
+}
+
+std::uint64_t Journal::GetBaseLsn() const {
+    std::lock_guard lock(mutex_);
+    return base_lsn_;
+}
+
+std::uint64_t Journal::GetLastLsn() const {
+    std::lock_guard lock(mutex_);
+    return last_lsn_;
+}
+
+std::size_t Journal::GetSize() const {
+    std::lock_guard lock(mutex_);
+    return file_size_ + queue_.size();
+}
+
+void Journal::RunCommits() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) { return; }
+
+        // let the records of a group gather, unless someone is waiting
+        wake_.wait_for(lock, options_.commit_interval, [this] {
+            return stop_ || waiting_ > 0 || queue_.size() >= options_.commit_bytes;
+        });
+
+        std::string batch;
+        batch.swap(queue_);
+        const auto batch_lsn = last_lsn_;
+        const auto fd = fd_;
+        lock.unlock();
+
+        // appends go on into the next batch meanwhile
+        const bool written = WriteAll(fd, batch) && SyncFile(fd);
+        const auto message = written ? std::string{} : SystemMessage("Cannot write", path_);
+
+        lock.lock();
+        if (written) {
+            committed_lsn_ = batch_lsn;
+            file_size_ += batch.size();
+        } else if (error_.empty()) {
+            error_ = message;
+        }
+        committed_.notify_all();
+    }
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A journal that cannot be opened, written or read back.
+class JournalException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Append-only log of the edits of a sheet. Every record gets the next log
+// sequence number (LSN) and is checksummed, so a record torn by a crash is
+// recognised and cut off when the journal is opened again.
+//
+// Append only queues a record. A background thread writes the queue out
+// and commits it with a single fsync, so the edits made while one commit
+// is in flight all go into the next one instead of waiting for a commit
+// each (group commit).
+class Journal {
+public:
+    struct Options {
+        // how long an appended record may wait for its commit
+        std::chrono::milliseconds commit_interval{5};
+        // a batch is committed early once it has grown this large
+        std::size_t commit_bytes = 1 << 20;
+        // the sheet waits for the commit of every edit before returning
+        bool wait_for_commit = false;
+        // the sheet checkpoints once the journal has grown this large, which
+        // bounds the time to replay it; 0 leaves checkpoints to the caller
+        std::size_t checkpoint_bytes = 64 << 20;
+    };
+
+    enum class Operation : std::uint8_t {
+        Set,
+        Clear,
+        // Sheet::SetCells, applied as a whole
+        SetMany,
+    };
+
+    struct Record {
+        std::uint64_t lsn;
+        Operation operation;
+        // the text is empty for Clear
+        std::vector<std::pair<Position, std::string>> cells;
+    };
+
+    // Opens the journal at path, creating it if there is none. A torn
+    // record at the end is cut off. Throws JournalException.
+    explicit Journal(std::string path);
+
+    Journal(std::string path, Options options);
+
+    Journal(const Journal &) = delete;
+
+    Journal &operator=(const Journal &) = delete;
+
+    // commits the queued records
+    ~Journal();
+
+    const Options &GetOptions() const {
+        return options_;
+    }
+
+    // Calls func(record) for the records with an LSN above after_lsn, in order.
+    void Replay(std::uint64_t after_lsn, const std::function<void(const Record &)> &func) const;
+
+    // Queues a record of one cell and returns its LSN.
+    std::uint64_t Append(Operation operation, Position pos, std::string_view text);
+
+    std::uint64_t Append(Operation operation, const std::vector<std::pair<Position, std::string>> &cells);
+
+    // Blocks until the records up to lsn are on disk. Throws
+    // JournalException if the commit failed.
+    void WaitForCommit(std::uint64_t lsn);
+
+    // commits everything appended so far
+    void Sync();
+
+    // Empties the journal once its records are in a snapshot, the next
+    // record gets an LSN above last_lsn. The old journal is replaced
+    // atomically, so a crash leaves one of the two.
+    void Reset(std::uint64_t last_lsn);
+
+    // the LSN of the last record before the first one in the journal,
+    // which a snapshot has to include for the journal to apply to it
+    std::uint64_t GetBaseLsn() const;
+
+    // the LSN of the last record appended
+    std::uint64_t GetLastLsn() const;
+
+    // bytes of the journal, the queued records included
+    std::size_t GetSize() const;
+
+private:
+    void Open();
+
+    void Close();
+
+    // appends the record frame around the payload to the queue
+    std::uint64_t Enqueue(std::string &payload);
+
+    void RunCommits();
+
+    const std::string path_;
+    const Options options_;
+    int fd_ = -1;
+
+    mutable std::mutex mutex_;
+    // signals the committing thread: records are waiting or it has to stop
+    std::condition_variable wake_;
+    // signals the waiters: a commit is done
+    std::condition_variable committed_;
+    std::string queue_;
+    std::uint64_t base_lsn_ = 0;
+    std::uint64_t last_lsn_ = 0;
+    std::uint64_t committed_lsn_ = 0;
+    std::size_t file_size_ = 0;
+    // some caller waits for a commit, which is then not delayed
+    std::size_t waiting_ = 0;
+    bool stop_ = false;
+    std::string error_;
+    std::thread committer_;
+};
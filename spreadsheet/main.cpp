@@ -1,396 +1,1588 @@
-#include <limits>
-#include "common.h"
-#include "formula.h"
-#include "test_runner_p.h"
-
-inline std::ostream &operator<<(std::ostream &output, Position pos) {
-    return output << "(" << pos.row << ", " << pos.col << ")";
-}
-
-inline Position operator "" _pos(const char *str, std::size_t) {
-    return Position::FromString(str);
-}
-
-inline std::ostream &operator<<(std::ostream &output, Size size) {
-    return output << "(" << size.rows << ", " << size.cols << ")";
-}
-
-inline std::ostream &operator<<(std::ostream &output, const CellInterface::Value &value) {
-    std::visit(
-            [&](const auto &x) {
-                output << x;
-            },
-            value);
-    return output;
-}
-
-namespace {
-
-    void TestPositionAndStringConversion() {
-        auto testSingle = [](Position pos, std::string_view str) {
-            ASSERT_EQUAL(pos.ToString(), str);
-            ASSERT_EQUAL(Position::FromString(str), pos);
-        };
-
-        for (int i = 0; i < 25; ++i) {
-            testSingle(Position{i, i}, char('A' + i) + std::to_string(i + 1));
-        }
-
-        testSingle(Position{0, 0}, "A1");
-        testSingle(Position{0, 1}, "B1");
-        testSingle(Position{0, 25}, "Z1");
-        testSingle(Position{0, 26}, "AA1");
-        testSingle(Position{0, 27}, "AB1");
-        testSingle(Position{0, 51}, "AZ1");
-        testSingle(Position{0, 52}, "BA1");
-        testSingle(Position{0, 53}, "BB1");
-        testSingle(Position{0, 77}, "BZ1");
-        testSingle(Position{0, 78}, "CA1");
-        testSingle(Position{0, 701}, "ZZ1");
-        testSingle(Position{0, 702}, "AAA1");
-        testSingle(Position{136, 2}, "C137");
-        testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
-    }
-
-    void TestPositionToStringInvalid() {
-        ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
-        ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
-        ASSERT_EQUAL((Position{1, -3}).ToString(), "");
-    }
-
-    void TestStringToPositionInvalid() {
-        ASSERT(!Position::FromString("").IsValid());
-        ASSERT(!Position::FromString("A").IsValid());
-        ASSERT(!Position::FromString("1").IsValid());
-        ASSERT(!Position::FromString("e2").IsValid());
-        ASSERT(!Position::FromString("A0").IsValid());
-        ASSERT(!Position::FromString("A-1").IsValid());
-        ASSERT(!Position::FromString("A+1").IsValid());
-        ASSERT(!Position::FromString("R2D2").IsValid());
-        ASSERT(!Position::FromString("C3PO").IsValid());
-        ASSERT(!Position::FromString("XFD16385").IsValid());
-        ASSERT(!Position::FromString("XFE16384").IsValid());
-        ASSERT(!Position::FromString("A1234567890123456789").IsValid());
-        ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
-    }
-
-    void TestEmpty() {
-        auto sheet = CreateSheet();
-        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
-    }
-
-    void TestInvalidPosition() {
-        auto sheet = CreateSheet();
-        try {
-            sheet->SetCell(Position{-1, 0}, "");
-        } catch (const InvalidPositionException &) {
-        }
-        try {
-            sheet->GetCell(Position{0, -2});
-        } catch (const InvalidPositionException &) {
-        }
-        try {
-            sheet->ClearCell(Position{Position::MAX_ROWS, 0});
-        } catch (const InvalidPositionException &) {
-        }
-    }
-
-    void TestSetCellPlainText() {
-        auto sheet = CreateSheet();
-
-        auto checkCell = [&](Position pos, std::string text) {
-            sheet->SetCell(pos, text);
-            CellInterface *cell = sheet->GetCell(pos);
-            ASSERT(cell != nullptr);
-            ASSERT_EQUAL(cell->GetText(), text);
-            ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
-        };
-
-        checkCell("A1"_pos, "Hello");
-        checkCell("A1"_pos, "World");
-        checkCell("B2"_pos, "Purr");
-        checkCell("A3"_pos, "Meow");
-
-        const SheetInterface &constSheet = *sheet;
-        ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
-
-        sheet->SetCell("A3"_pos, "'=escaped");
-        CellInterface *cell = sheet->GetCell("A3"_pos);
-        ASSERT_EQUAL(cell->GetText(), "'=escaped");
-        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
-    }
-
-    void TestClearCell() {
-        auto sheet = CreateSheet();
-
-        sheet->SetCell("C2"_pos, "Me gusta");
-        sheet->ClearCell("C2"_pos);
-        ASSERT(sheet->GetCell("C2"_pos) == nullptr);
-
-        sheet->ClearCell("A1"_pos);
-        sheet->ClearCell("J10"_pos);
-    }
-
-    void TestFormulaArithmetic() {
-        auto sheet = CreateSheet();
-        auto evaluate = [&](std::string expr) {
-            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-        };
-
-        ASSERT_EQUAL(evaluate("1"), 1);
-        ASSERT_EQUAL(evaluate("42"), 42);
-        ASSERT_EQUAL(evaluate("2 + 2"), 4);
-        ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
-        ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
-        ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
-        ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
-    }
-
-    void TestFormulaReferences() {
-        auto sheet = CreateSheet();
-        auto evaluate = [&](std::string expr) {
-            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-        };
-
-        sheet->SetCell("A1"_pos, "1");
-        ASSERT_EQUAL(evaluate("A1"), 1);
-        sheet->SetCell("A2"_pos, "2");
-        ASSERT_EQUAL(evaluate("A1+A2"), 3);
-
-        // Тест на нули:
-        sheet->SetCell("B3"_pos, "");
-        ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
-        ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
-        ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
-    }
-
-    void TestFormulaExpressionFormatting() {
-        auto reformat = [](std::string expr) {
-            return ParseFormula(std::move(expr))->GetExpression();
-        };
-
-        ASSERT_EQUAL(reformat("  1  "), "1");
-        ASSERT_EQUAL(reformat("  -1  "), "-1");
-        ASSERT_EQUAL(reformat("2 + 2"), "2+2");
-        ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
-        ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
-        ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
-    }
-
-    void TestFormulaReferencedCells() {
-        ASSERT(ParseFormula("1")->GetReferencedCells().empty());
-
-        auto a1 = ParseFormula("A1");
-        ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{"A1"_pos}));
-
-        auto b2c3 = ParseFormula("B2+C3");
-        ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{"B2"_pos, "C3"_pos}));
-
-        auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
-        auto exp = tricky->GetExpression();
-        auto ref = tricky->GetReferencedCells();
-        ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
-        ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
-    }
-
-    void TestErrorValue() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("E2"_pos, "A1");
-        sheet->SetCell("E4"_pos, "=E2");
-
-        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Value));
-
-        sheet->SetCell("E2"_pos, "3D");
-        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Value));
-    }
-
-    void TestErrorDiv0() {
-        auto sheet = CreateSheet();
-
-        constexpr double max = std::numeric_limits<double>::max();
-
-        sheet->SetCell("A1"_pos, "=1/0");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
-
-        sheet->SetCell("A1"_pos, "=1e+200/1e-200");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
-
-        sheet->SetCell("A1"_pos, "=0/0");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
-
-        {
-            std::ostringstream formula;
-            formula << '=' << max << '+' << max;
-            sheet->SetCell("A1"_pos, formula.str());
-            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                         CellInterface::Value(FormulaError::Category::Div0));
-        }
-
-        {
-            std::ostringstream formula;
-            formula << '=' << -max << '-' << max;
-            sheet->SetCell("A1"_pos, formula.str());
-            auto x = sheet->GetCell("A1"_pos)->GetValue();
-            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                         CellInterface::Value(FormulaError::Category::Div0));
-        }
-
-        {
-            std::ostringstream formula;
-            formula << '=' << max << '*' << max;
-            sheet->SetCell("A1"_pos, formula.str());
-            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                         CellInterface::Value(FormulaError::Category::Div0));
-        }
-    }
-
-    void TestEmptyCellTreatedAsZero() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("A1"_pos, "=B2");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
-    }
-
-    void TestFormulaInvalidPosition() {
-        auto sheet = CreateSheet();
-        auto try_formula = [&](const std::string &formula) {
-            try {
-                sheet->SetCell("A1"_pos, formula);
-                ASSERT(false);
-            } catch (const FormulaException &) {
-                // we expect this one
-            }
-        };
-
-        try_formula("=X0");
-        try_formula("=ABCD1");
-        try_formula("=A123456");
-        try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-        try_formula("=XFD16385");
-        try_formula("=XFE16384");
-        try_formula("=R2D2");
-    }
-
-    void TestPrint() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("A2"_pos, "meow");
-        sheet->SetCell("B2"_pos, "=35");
-
-        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
-
-        std::ostringstream texts;
-        sheet->PrintTexts(texts);
-        ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
-
-        std::ostringstream values;
-        sheet->PrintValues(values);
-        ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
-    }
-
-    void TestCellReferences() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("A1"_pos, "1");
-        sheet->SetCell("A2"_pos, "=A1");
-        sheet->SetCell("B2"_pos, "=A1");
-
-        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
-        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
-
-        // Ссылка на пустую ячейку
-        sheet->SetCell("B2"_pos, "=B1");
-        ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
-        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
-
-        sheet->SetCell("A2"_pos, "");
-        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-        ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
-
-        // Ссылка на ячейку за пределами таблицы
-        sheet->SetCell("B1"_pos, "=C3");
-        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
-    }
-
-    void TestFormulaIncorrect() {
-        auto isIncorrect = [](std::string expression) {
-            try {
-                ParseFormula(std::move(expression));
-            } catch (const FormulaException &) {
-                return true;
-            }
-            return false;
-        };
-
-        ASSERT(isIncorrect("A2B"));
-        ASSERT(isIncorrect("3X"));
-        ASSERT(isIncorrect("A0++"));
-        ASSERT(isIncorrect("((1)"));
-        ASSERT(isIncorrect("2+4-"));
-    }
-
-    void TestCellCircularReferences() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("E2"_pos, "=E4");
-        sheet->SetCell("E4"_pos, "=X9");
-        sheet->SetCell("X9"_pos, "=M6");
-        sheet->SetCell("M6"_pos, "Ready");
-
-        bool caught = false;
-        try {
-            sheet->SetCell("M6"_pos, "=E2");
-        } catch (const CircularDependencyException &) {
-            caught = true;
-        }
-
-        ASSERT(caught);
-        ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
-    }
-
-    void TestCacheConsistency() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("F1"_pos, "=E1+E2");
-        sheet->SetCell("B1"_pos, "=A1");
-        sheet->SetCell("B2"_pos, "=A1");
-        sheet->SetCell("C1"_pos, "=B2");
-        sheet->SetCell("C2"_pos, "=B1");
-        sheet->SetCell("E2"_pos, "=C1+B1");
-        sheet->SetCell("E1"_pos, "=C2+B2");
-        ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(0.0));
-        sheet->SetCell("A1"_pos, "1");
-        ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(4.0));
-        sheet->ClearCell("B1"_pos);
-        ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(2.0));
-        sheet->ClearCell("A1"_pos);
-        ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(0.0));
-    }
-
-}  // namespace
-
-int main() {
-    TestRunner tr;
-    RUN_TEST(tr, TestPositionAndStringConversion);
-    RUN_TEST(tr, TestPositionToStringInvalid);
-    RUN_TEST(tr, TestStringToPositionInvalid);
-    RUN_TEST(tr, TestEmpty);
-    RUN_TEST(tr, TestInvalidPosition);
-    RUN_TEST(tr, TestSetCellPlainText);
-    RUN_TEST(tr, TestClearCell);
-    RUN_TEST(tr, TestFormulaArithmetic);
-    RUN_TEST(tr, TestFormulaReferences);
-    RUN_TEST(tr, TestFormulaExpressionFormatting);
-    RUN_TEST(tr, TestFormulaReferencedCells);
-    RUN_TEST(tr, TestErrorValue);
-    RUN_TEST(tr, TestErrorDiv0);
-    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
-    RUN_TEST(tr, TestFormulaInvalidPosition);
-    RUN_TEST(tr, TestPrint);
-    RUN_TEST(tr, TestCellReferences);
-    RUN_TEST(tr, TestFormulaIncorrect);
-    RUN_TEST(tr, TestCellCircularReferences);
-    RUN_TEST(tr, TestCacheConsistency);
-    return 0;
-}
+#include <limits>
+#include "common.h"
+#include "formula.h"
+#include "FormulaAST.h"
+#include "sheet.h"
+#include "test_runner_p.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <thread>
+
+inline std::ostream &operator<<(std::ostream &output, Position pos) {
+    return output << "(" << pos.row << ", " << pos.col << ")";
+}
+
+constexpr Position operator "" _pos(const char *str, std::size_t size) {
+    return Position::FromString(std::string_view(str, size));
+}
+
+inline std::ostream &operator<<(std::ostream &output, Size size) {
+    return output << "(" << size.rows << ", " << size.cols << ")";
+}
+
+inline std::ostream &operator<<(std::ostream &output, const CellInterface::Value &value) {
+    std::visit(
+            [&](const auto &x) {
+                output << x;
+            },
+            value);
+    return output;
+}
+
+namespace {
+
+    void TestPositionAndStringConversion() {
+        auto testSingle = [](Position pos, std::string_view str) {
+            ASSERT_EQUAL(pos.ToString(), str);
+            ASSERT_EQUAL(Position::FromString(str), pos);
+        };
+
+        for (int i = 0; i < 25; ++i) {
+            testSingle(Position{i, i}, char('A' + i) + std::to_string(i + 1));
+        }
+
+        testSingle(Position{0, 0}, "A1");
+        testSingle(Position{0, 1}, "B1");
+        testSingle(Position{0, 25}, "Z1");
+        testSingle(Position{0, 26}, "AA1");
+        testSingle(Position{0, 27}, "AB1");
+        testSingle(Position{0, 51}, "AZ1");
+        testSingle(Position{0, 52}, "BA1");
+        testSingle(Position{0, 53}, "BB1");
+        testSingle(Position{0, 77}, "BZ1");
+        testSingle(Position{0, 78}, "CA1");
+        testSingle(Position{0, 701}, "ZZ1");
+        testSingle(Position{0, 702}, "AAA1");
+        testSingle(Position{136, 2}, "C137");
+        testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+    }
+
+    void TestPositionConstexpr() {
+        static_assert("A1"_pos == Position{0, 0});
+        static_assert("AA10"_pos == Position{9, 26});
+        static_assert("XFD16384"_pos == Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1});
+        static_assert(!"XFE1"_pos.IsValid());
+        static_assert(!"A00000"_pos.IsValid());
+        static_assert("A00001"_pos == Position{0, 0});
+
+        constexpr auto to_chars_length = [](Position pos) {
+            char buf[Position::MAX_STRING_LENGTH] = {};
+            return pos.ToChars(buf);
+        };
+        static_assert(to_chars_length("ZZ999"_pos) == 5);
+        static_assert(to_chars_length(Position::NONE) == 0);
+
+        char buf[Position::MAX_STRING_LENGTH];
+        const auto length = "XFD16384"_pos.ToChars(buf);
+        ASSERT_EQUAL(std::string(buf, length), "XFD16384");
+    }
+
+    void TestPositionToStringInvalid() {
+        ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
+        ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
+        ASSERT_EQUAL((Position{1, -3}).ToString(), "");
+    }
+
+    void TestStringToPositionInvalid() {
+        ASSERT(!Position::FromString("").IsValid());
+        ASSERT(!Position::FromString("A").IsValid());
+        ASSERT(!Position::FromString("1").IsValid());
+        ASSERT(!Position::FromString("e2").IsValid());
+        ASSERT(!Position::FromString("A0").IsValid());
+        ASSERT(!Position::FromString("A-1").IsValid());
+        ASSERT(!Position::FromString("A+1").IsValid());
+        ASSERT(!Position::FromString("R2D2").IsValid());
+        ASSERT(!Position::FromString("C3PO").IsValid());
+        ASSERT(!Position::FromString("XFD16385").IsValid());
+        ASSERT(!Position::FromString("XFE16384").IsValid());
+        ASSERT(!Position::FromString("A1234567890123456789").IsValid());
+        ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
+    }
+
+    void TestEmpty() {
+        auto sheet = CreateSheet();
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    }
+
+    void TestInvalidPosition() {
+        auto sheet = CreateSheet();
+        try {
+            sheet->SetCell(Position{-1, 0}, "");
+        } catch (const InvalidPositionException &) {
+        }
+        try {
+            sheet->GetCell(Position{0, -2});
+        } catch (const InvalidPositionException &) {
+        }
+        try {
+            sheet->ClearCell(Position{Position::MAX_ROWS, 0});
+        } catch (const InvalidPositionException &) {
+        }
+    }
+
+    void TestSetCellPlainText() {
+        auto sheet = CreateSheet();
+
+        auto checkCell = [&](Position pos, std::string text) {
+            sheet->SetCell(pos, text);
+            CellInterface *cell = sheet->GetCell(pos);
+            ASSERT(cell != nullptr);
+            ASSERT_EQUAL(cell->GetText(), text);
+            ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
+        };
+
+        checkCell("A1"_pos, "Hello");
+        checkCell("A1"_pos, "World");
+        checkCell("B2"_pos, "Purr");
+        checkCell("A3"_pos, "Meow");
+
+        const SheetInterface &constSheet = *sheet;
+        ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
+
+        sheet->SetCell("A3"_pos, "'=escaped");
+        CellInterface *cell = sheet->GetCell("A3"_pos);
+        ASSERT_EQUAL(cell->GetText(), "'=escaped");
+        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
+    }
+
+    void TestClearCell() {
+        auto sheet = CreateSheet();
+
+        sheet->SetCell("C2"_pos, "Me gusta");
+        sheet->ClearCell("C2"_pos);
+        ASSERT(sheet->GetCell("C2"_pos) == nullptr);
+
+        sheet->ClearCell("A1"_pos);
+        sheet->ClearCell("J10"_pos);
+    }
+
+    void TestFormulaArithmetic() {
+        auto sheet = CreateSheet();
+        auto evaluate = [&](std::string expr) {
+            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+        };
+
+        ASSERT_EQUAL(evaluate("1"), 1);
+        ASSERT_EQUAL(evaluate("42"), 42);
+        ASSERT_EQUAL(evaluate("2 + 2"), 4);
+        ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
+        ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
+        ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
+        ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
+    }
+
+    void TestFormulaReferences() {
+        auto sheet = CreateSheet();
+        auto evaluate = [&](std::string expr) {
+            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+        };
+
+        sheet->SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(evaluate("A1"), 1);
+        sheet->SetCell("A2"_pos, "2");
+        ASSERT_EQUAL(evaluate("A1+A2"), 3);
+
+        // Тест на нули:
+        sheet->SetCell("B3"_pos, "");
+        ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
+        ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
+        ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
+    }
+
+    void TestFormulaExpressionFormatting() {
+        auto reformat = [](std::string expr) {
+            return ParseFormula(std::move(expr))->GetExpression();
+        };
+
+        ASSERT_EQUAL(reformat("  1  "), "1");
+        ASSERT_EQUAL(reformat("  -1  "), "-1");
+        ASSERT_EQUAL(reformat("2 + 2"), "2+2");
+        ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
+        ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
+        ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+    }
+
+    void TestFormulaGrammar() {
+        auto reformat = [](std::string expr) {
+            return ParseFormula(std::move(expr))->GetExpression();
+        };
+        auto isIncorrect = [](std::string expression) {
+            try {
+                ParseFormula(std::move(expression));
+            } catch (const FormulaException &) {
+                return true;
+            }
+            return false;
+        };
+
+        ASSERT_EQUAL(reformat("-1*2"), "-1*2");
+        ASSERT_EQUAL(reformat("-(1+2)"), "-(1+2)");
+        ASSERT_EQUAL(reformat("2*-3"), "2*-3");
+        ASSERT_EQUAL(reformat("--+1"), "--+1");
+        ASSERT_EQUAL(reformat("1-(2-3)"), "1-(2-3)");
+        ASSERT_EQUAL(reformat("(1-2)-3"), "1-2-3");
+        ASSERT_EQUAL(reformat("8/(4/2)"), "8/(4/2)");
+        ASSERT_EQUAL(reformat(" \tA1 *\r\n B2 "), "A1*B2");
+        ASSERT_EQUAL(reformat(".5"), "0.5");
+        ASSERT_EQUAL(reformat("1.25e2"), "125");
+        ASSERT_EQUAL(reformat("2E-1"), "0.2");
+        ASSERT_EQUAL(reformat("SUM( B2 : A1 , 1 )*2"), "SUM(A1:B2,1)*2");
+        ASSERT_EQUAL(reformat("-MAX(A1,(A2+1)*2,COUNT(C3))"), "-MAX(A1,(A2+1)*2,COUNT(C3))");
+        ASSERT_EQUAL(reformat("AVERAGE(A1 / 2 - 1)"), "AVERAGE(A1/2-1)");
+
+        ASSERT(isIncorrect(""));
+        ASSERT(isIncorrect("1."));
+        ASSERT(isIncorrect("1e"));
+        ASSERT(isIncorrect("1e+"));
+        ASSERT(isIncorrect("1.2.3"));
+        ASSERT(isIncorrect("1e400"));
+        ASSERT(isIncorrect("A1B2"));
+        ASSERT(isIncorrect("a1"));
+        ASSERT(isIncorrect("()"));
+        ASSERT(isIncorrect("1 2"));
+        ASSERT(isIncorrect("1)"));
+        ASSERT(isIncorrect("*1"));
+        ASSERT(isIncorrect("1 $"));
+        ASSERT(isIncorrect("SUM()"));
+        ASSERT(isIncorrect("SUM(A1:)"));
+        ASSERT(isIncorrect("SUM(A1:2)"));
+        ASSERT(isIncorrect("SUM(A1,)"));
+        ASSERT(isIncorrect("SUM A1"));
+        ASSERT(isIncorrect("A1:B2"));
+        ASSERT(isIncorrect("MEDIAN(A1)"));
+        ASSERT(isIncorrect("SUM(A1:XFD16385)"));
+    }
+
+#ifdef SPREADSHEET_WITH_ANTLR
+    void TestFormulaParserMatchesAntlr() {
+        auto print = [](const FormulaAST &ast) {
+            std::ostringstream out;
+            ast.Print(out);
+            out << " | ";
+            ast.PrintCells(out);
+            return out.str();
+        };
+        auto parse = [&](auto parser, std::string_view expression) -> std::string {
+            try {
+                return print(parser(expression));
+            } catch (const FormulaException &) {
+                return "FormulaException";
+            }
+        };
+
+        for (std::string_view expression: {
+                "1", "A1", "  -1  ", "2 + 2*2", "(2+3)*4 + (3-4)*5", "1-2-3", "8/4/2", "--+A1",
+                "-A1*B2", "2*-3", "1e5", ".5e-3", "1.25E+2", "1e400", "1.", "1e", "A1B2", "3X",
+                "A0++", "((1)", "2+4-", "", "()", "X0", "ABCD1", "XFD16384", "XFD16385", "1 $",
+                "(12+13) * (14+(13-24/(1+1))*55-46)", "A1 + A2 + A1 + A3 + A1 + A2 + A1",
+                "SUM(B2:A1, 1)", "MAX(A1, A2+1, -A3)", "COUNT(A1:A1)", "SUM()", "SUM(A1:)", "FOO(1)"}) {
+            ASSERT_EQUAL(parse([](auto e) { return ParseFormulaAST(e); }, expression),
+                         parse([](auto e) { return ParseFormulaASTWithAntlr(e); }, expression));
+        }
+    }
+#endif
+
+    void TestExprArenaMove() {
+        ExprArena arena;
+        arena.MakeArray<int>(4);
+        ExprArena moved(std::move(arena));
+        const auto bytes = moved.GetAllocatedBytes();
+        ASSERT(bytes > 0);
+
+        // a moved-from arena starts over with blocks of its own
+        arena.MakeArray<int>(4);
+        ASSERT(arena.GetAllocatedBytes() > 0);
+        ExprArena assigned;
+        assigned = std::move(moved);
+        ASSERT_EQUAL(assigned.GetAllocatedBytes(), bytes);
+        moved.MakeArray<int>(4);
+        ASSERT(moved.GetAllocatedBytes() > 0);
+    }
+
+    void TestFormulaReferencedCells() {
+        ASSERT(ParseFormula("1")->GetReferencedCells().empty());
+
+        auto a1 = ParseFormula("A1");
+        ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{"A1"_pos}));
+
+        auto b2c3 = ParseFormula("B2+C3");
+        ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{"B2"_pos, "C3"_pos}));
+
+        auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
+        auto exp = tricky->GetExpression();
+        auto ref = tricky->GetReferencedCells();
+        ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
+        ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
+
+        auto range = ParseFormula("SUM(B1:A2)+A1");
+        ASSERT_EQUAL(range->GetReferencedCells(), (std::vector{"A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos}));
+    }
+
+    void TestErrorValue() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("E2"_pos, "A1");
+        sheet->SetCell("E4"_pos, "=E2");
+
+        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Value));
+
+        sheet->SetCell("E2"_pos, "3D");
+        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Value));
+
+        // A referenced error wins over an arithmetic one wherever the
+        // latter is in the formula, and of several referenced errors the
+        // one of the first cell row by row wins, the ranges after the lone
+        // cells.
+        sheet->SetCell("F1"_pos, "=1/0+E2");
+        ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Value));
+        sheet->SetCell("F2"_pos, "=E2/0");
+        ASSERT_EQUAL(sheet->GetCell("F2"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Value));
+        sheet->SetCell("G1"_pos, "=1/0");
+        sheet->SetCell("F3"_pos, "=E2+G1");
+        ASSERT_EQUAL(sheet->GetCell("F3"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+        sheet->SetCell("F4"_pos, "=SUM(E2:E2)+G1");
+        ASSERT_EQUAL(sheet->GetCell("F4"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+    }
+
+    void TestFormulaInterning() {
+        Sheet sheet;
+        for (int row = 0; row < 100; ++row) {
+            const auto n = std::to_string(row + 1);
+            sheet.SetCell(Position{row, 0}, n);
+            sheet.SetCell(Position{row, 1}, "=A" + n + "*2+C" + n);
+            sheet.SetCell(Position{row, 3}, "=(A" + n + " + 1)");
+        }
+        ASSERT_EQUAL(sheet.GetFormulaInterner().GetShapeCount(), 2u);
+
+        ASSERT_EQUAL(sheet.GetCell("B50"_pos)->GetText(), "=A50*2+C50");
+        ASSERT_EQUAL(sheet.GetCell("B50"_pos)->GetValue(), CellInterface::Value(100.0));
+        ASSERT_EQUAL(sheet.GetCell("B50"_pos)->GetReferencedCells(), (std::vector{"A50"_pos, "C50"_pos}));
+        ASSERT_EQUAL(sheet.GetCell("D100"_pos)->GetText(), "=A100+1");
+        ASSERT_EQUAL(sheet.GetCell("D100"_pos)->GetValue(), CellInterface::Value(101.0));
+
+        // the same text elsewhere is another shape
+        sheet.SetCell("E1"_pos, "=A1*2+C1");
+        ASSERT_EQUAL(sheet.GetFormulaInterner().GetShapeCount(), 3u);
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // a known shape that would point outside of the sheet is not reused
+        bool caught = false;
+        try {
+            sheet.SetCell("B16384"_pos, "=A16385*2+C16385");
+        } catch (const FormulaException &) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        for (int row = 0; row < 100; ++row) {
+            sheet.ClearCell(Position{row, 1});
+        }
+        ASSERT_EQUAL(sheet.GetFormulaInterner().GetShapeCount(), 2u);
+    }
+
+    void TestTextCellsAsNumbers() {
+        auto sheet = CreateSheet();
+        const auto value_of = [&](std::string text) {
+            sheet->SetCell("A1"_pos, std::move(text));
+            sheet->SetCell("B1"_pos, "=A1");
+            return sheet->GetCell("B1"_pos)->GetValue();
+        };
+
+        ASSERT_EQUAL(value_of("12"), CellInterface::Value(12.0));
+        ASSERT_EQUAL(value_of("'12"), CellInterface::Value(12.0));
+        ASSERT_EQUAL(value_of(" -1.5e3 "), CellInterface::Value(-1500.0));
+        ASSERT_EQUAL(value_of("'"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value_of(" "), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value_of("12abc"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(value_of("''12"), CellInterface::Value(FormulaError::Category::Value));
+        // the text is still the value of the cell itself
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value("'12"));
+        ASSERT_EQUAL(value_of("7"), CellInterface::Value(7.0));
+    }
+
+    void TestFormulaCache() {
+        FormulaCache cache(1 << 20);
+        bool parsed = false;
+        const auto first = cache.Parse("A1+B2*3", &parsed);
+        ASSERT(parsed);
+        ASSERT(cache.Parse("A1+B2*3", &parsed) == first);
+        ASSERT(!parsed);
+        auto stats = cache.GetStats();
+        ASSERT_EQUAL(stats.hits, 1u);
+        ASSERT_EQUAL(stats.misses, 1u);
+        ASSERT_EQUAL(stats.entries, 1u);
+        ASSERT(stats.bytes > 0);
+
+        // an error is not kept
+        for (int i = 0; i < 2; ++i) {
+            bool caught = false;
+            try {
+                cache.Parse("1+", &parsed);
+            } catch (const FormulaException &) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+        ASSERT_EQUAL(cache.GetStats().entries, 1u);
+
+        // the least recently used trees go first
+        const auto second = cache.Parse("C3");
+        cache.Parse("A1+B2*3");
+        cache.SetCapacity(cache.GetStats().bytes - 1);
+        ASSERT_EQUAL(cache.GetStats().entries, 1u);
+        ASSERT(cache.Parse("A1+B2*3", &parsed) == first);
+        ASSERT(!parsed);
+        ASSERT(cache.Parse("C3", &parsed) != second);
+        ASSERT(parsed);
+
+        cache.SetCapacity(0);
+        ASSERT_EQUAL(cache.GetStats().entries, 0u);
+        cache.Parse("C3", &parsed);
+        ASSERT(parsed);
+        ASSERT_EQUAL(cache.GetStats().entries, 0u);
+
+        // sheets share the global cache, the formulas still evaluate in their own
+        const auto hits = FormulaCache::GetGlobal().GetStats().hits;
+        Sheet first_sheet;
+        Sheet second_sheet;
+        first_sheet.SetCell("A1"_pos, "2");
+        second_sheet.SetCell("A1"_pos, "5");
+        first_sheet.SetCell("D4"_pos, "=A1*100+C1");
+        second_sheet.SetCell("E5"_pos, "=A1*100+C1");
+        ASSERT(FormulaCache::GetGlobal().GetStats().hits > hits);
+        ASSERT_EQUAL(first_sheet.GetCell("D4"_pos)->GetValue(), CellInterface::Value(200.0));
+        ASSERT_EQUAL(second_sheet.GetCell("E5"_pos)->GetValue(), CellInterface::Value(500.0));
+        second_sheet.SetCell("E6"_pos, "=A2*100+C2");
+        ASSERT_EQUAL(second_sheet.GetCell("E6"_pos)->GetText(), "=A2*100+C2");
+
+        // one cache parsed from many threads
+        FormulaCache shared(1 << 10);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&shared] {
+                for (int i = 0; i < 200; ++i) {
+                    shared.Parse("A" + std::to_string(i % 50 + 1) + "*2");
+                }
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        stats = shared.GetStats();
+        ASSERT_EQUAL(stats.hits + stats.misses, 800u);
+        ASSERT(stats.bytes <= stats.capacity);
+    }
+
+    void TestAggregateFunctions() {
+        auto sheet = CreateSheet();
+        using Value = CellInterface::Value;
+        auto evaluate = [&](std::string expr) {
+            return std::visit([](auto value) { return Value(value); }, ParseFormula(std::move(expr))->Evaluate(*sheet));
+        };
+
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "2");
+        sheet->SetCell("B1"_pos, "'3");
+        sheet->SetCell("B3"_pos, "=A1+A2");
+        ASSERT_EQUAL(evaluate("SUM(A1:B3)"), Value(9.0));
+        ASSERT_EQUAL(evaluate("SUM(B3:A1)"), Value(9.0));
+        // empty cells of a range, lone cells included, are skipped
+        ASSERT_EQUAL(evaluate("COUNT(A1:C5)"), Value(4.0));
+        ASSERT_EQUAL(evaluate("AVERAGE(A1:B3)"), Value(2.25));
+        ASSERT_EQUAL(evaluate("AVERAGE(A1:B3,C1)"), Value(2.25));
+        ASSERT_EQUAL(evaluate("AVERAGE(A1:B3,C1+0)"), Value(1.8));
+        ASSERT_EQUAL(evaluate("MIN(A2:B3)"), Value(2.0));
+        ASSERT_EQUAL(evaluate("MAX(A1:B3,-10,A1*4)"), Value(4.0));
+        ASSERT_EQUAL(evaluate("MIN(C1:C9)+MAX(C1:C9)+COUNT(C1:C9)"), Value(0.0));
+        ASSERT_EQUAL(evaluate("SUM(A1,SUM(A1:A2)*MAX(A1:A2),COUNT(A1:A2))"), Value(9.0));
+        ASSERT_EQUAL(evaluate("AVERAGE(C1:C9)"), Value(FormulaError::Category::Div0));
+
+        sheet->SetCell("C2"_pos, "abc");
+        ASSERT_EQUAL(evaluate("SUM(A1:C3)"), Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("SUM(A1:B3)"), Value(9.0));
+
+        // the sum is compensated, the vectorized lanes included
+        std::string terms = "1e16";
+        sheet->SetCell("D1"_pos, "1e16");
+        for (int row = 1; row <= 40; ++row) {
+            sheet->SetCell(Position{row, 3}, "1");
+            terms += ",1";
+        }
+        sheet->SetCell(Position{41, 3}, "-1e16");
+        terms += ",-1e16";
+        ASSERT_EQUAL(evaluate("SUM(D1:D42)"), Value(40.0));
+        ASSERT_EQUAL(evaluate("SUM(" + terms + ")"), Value(40.0));
+
+        // the tree walk agrees with the program
+        const auto ast = ParseFormulaAST("SUM(A1:A2,1)*MAX(A1,5)");
+        ASSERT_EQUAL(ast.Execute([](Position pos) { return pos.row + 1.0; }), 20.0);
+
+        sheet->SetCell("E1"_pos, "=SUM(A1:B3)");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(9.0));
+        sheet->SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(17.0));
+        bool caught = false;
+        try {
+            sheet->SetCell("A3"_pos, "=SUM(A1:E1)");
+        } catch (const CircularDependencyException &) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    void TestConstantFolding() {
+        const auto code_size = [](std::string_view expression) {
+            return ParseFormulaAST(expression).GetProgram().GetCode().size();
+        };
+        ASSERT_EQUAL(code_size("(2*3.5+1)*A1"), 3u);
+        ASSERT_EQUAL(code_size("--A1"), 1u);
+        ASSERT_EQUAL(code_size("-(-(-A1))"), 2u);
+        ASSERT_EQUAL(code_size("+A1"), 1u);
+        ASSERT_EQUAL(code_size("-2*-(3)"), 1u);
+        // identities are kept, they carry the overflow checks
+        ASSERT_EQUAL(code_size("A1*1"), 3u);
+        // a failing operation is left to the program
+        ASSERT_EQUAL(code_size("1/0+A1"), 5u);
+        ASSERT_EQUAL(code_size("SUM(1+2,A1:A3)"), 5u);
+
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "2");
+        const std::vector<std::pair<std::string, CellInterface::Value>> cases = {
+                {"=(2*3.5+1)*A1", 16.0},
+                {"=--A1", 2.0},
+                {"=---A1/4", -0.5},
+                {"=1/0+A1", FormulaError::Category::Div0},
+                {"=1e+200*1e+200*0+A1", FormulaError::Category::Div0},
+                {"=SUM(1+2,A1:A3)*-1", -5.0},
+        };
+        for (const auto &[text, value]: cases) {
+            sheet->SetCell("B1"_pos, text);
+            ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), text);
+            ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), value);
+        }
+    }
+
+    void TestErrorDiv0() {
+        auto sheet = CreateSheet();
+
+        constexpr double max = std::numeric_limits<double>::max();
+
+        sheet->SetCell("A1"_pos, "=1/0");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+
+        sheet->SetCell("A1"_pos, "=1e+200/1e-200");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+
+        sheet->SetCell("A1"_pos, "=0/0");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+
+        {
+            std::ostringstream formula;
+            formula << '=' << max << '+' << max;
+            sheet->SetCell("A1"_pos, formula.str());
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                         CellInterface::Value(FormulaError::Category::Div0));
+        }
+
+        {
+            std::ostringstream formula;
+            formula << '=' << -max << '-' << max;
+            sheet->SetCell("A1"_pos, formula.str());
+            auto x = sheet->GetCell("A1"_pos)->GetValue();
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                         CellInterface::Value(FormulaError::Category::Div0));
+        }
+
+        {
+            std::ostringstream formula;
+            formula << '=' << max << '*' << max;
+            sheet->SetCell("A1"_pos, formula.str());
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                         CellInterface::Value(FormulaError::Category::Div0));
+        }
+    }
+
+    void TestEmptyCellTreatedAsZero() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=B2");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    }
+
+    void TestFormulaInvalidPosition() {
+        auto sheet = CreateSheet();
+        auto try_formula = [&](const std::string &formula) {
+            try {
+                sheet->SetCell("A1"_pos, formula);
+                ASSERT(false);
+            } catch (const FormulaException &) {
+                // we expect this one
+            }
+        };
+
+        try_formula("=X0");
+        try_formula("=ABCD1");
+        try_formula("=A123456");
+        try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
+        try_formula("=XFD16385");
+        try_formula("=XFE16384");
+        try_formula("=R2D2");
+    }
+
+    void TestPrint() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A2"_pos, "meow");
+        sheet->SetCell("B2"_pos, "=35");
+
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+
+        std::ostringstream texts;
+        sheet->PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
+
+        std::ostringstream values;
+        sheet->PrintValues(values);
+        ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
+    }
+
+    void TestPrintValuesFormatting() {
+        auto sheet = CreateSheet();
+        const std::vector<std::string> formulas = {"=1/3", "=1e20", "=-0.5", "=123456789", "=1e-7", "=2/0"};
+        for (std::size_t i = 0; i < formulas.size(); ++i) {
+            sheet->SetCell(Position{0, static_cast<int>(i)}, formulas[i]);
+        }
+
+        for (const int precision: {6, 12}) {
+            std::ostringstream expected;
+            expected.precision(precision);
+            for (std::size_t i = 0; i < formulas.size(); ++i) {
+                expected << (i > 0 ? "\t" : "") << sheet->GetCell(Position{0, static_cast<int>(i)})->GetValue();
+            }
+            expected << '\n';
+
+            std::ostringstream values;
+            values.precision(precision);
+            sheet->PrintValues(values);
+            ASSERT_EQUAL(values.str(), expected.str());
+        }
+
+        std::ostringstream fixed;
+        fixed << std::fixed;
+        sheet->ClearCell(Position{0, 5});
+        sheet->PrintValues(fixed);
+        ASSERT_EQUAL(fixed.str(), "0.333333\t100000000000000000000.000000\t-0.500000\t123456789.000000\t0.000000\n");
+    }
+
+    void TestCellsAcrossTiles() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "a");
+        sheet->SetCell("BM2"_pos, "b");
+        sheet->SetCell("B66"_pos, "c");
+        sheet->SetCell("XFD16384"_pos, "d");
+
+        ASSERT_EQUAL(sheet->GetCell("BM2"_pos)->GetText(), "b");
+        ASSERT(sheet->GetCell("BL2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+
+        sheet->ClearCell("XFD16384"_pos);
+        ASSERT(sheet->GetCell("XFD16384"_pos) == nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{66, 65}));
+
+        sheet->ClearCell("BM2"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{66, 2}));
+
+        std::ostringstream texts;
+        sheet->PrintTexts(texts);
+        std::string expected = "a\t\n";
+        for (int row = 1; row < 65; ++row) {
+            expected += "\t\n";
+        }
+        ASSERT_EQUAL(texts.str(), expected + "\tc\n");
+    }
+
+    void TestPrintableSizeIgnoresEmptyCells() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=C5+E2");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+        sheet->SetCell("C5"_pos, "1");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+
+        // the cell stays because A1 refers to it, but it no longer counts
+        sheet->ClearCell("C5"_pos);
+        ASSERT(sheet->GetCell("C5"_pos) != nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+        sheet->SetCell("B3"_pos, "x");
+        sheet->SetCell("B3"_pos, "");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+        sheet->ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+
+        // the area shrinks to the last filled row and column, found past
+        // the empty words and summary words of the counts
+        sheet->SetCell("B70"_pos, "x");
+        sheet->SetCell("BZ2"_pos, "x");
+        for (int i = 0; i < 3; ++i) {
+            sheet->SetCell(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "x");
+            ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+            sheet->ClearCell(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1});
+            ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{70, 78}));
+        }
+        sheet->ClearCell("B70"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 78}));
+        sheet->ClearCell("BZ2"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    }
+
+    void TestCellReferences() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "=A1");
+        sheet->SetCell("B2"_pos, "=A1");
+
+        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+
+        // Ссылка на пустую ячейку
+        sheet->SetCell("B2"_pos, "=B1");
+        ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
+
+        sheet->SetCell("A2"_pos, "");
+        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+        ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
+
+        // Ссылка на ячейку за пределами таблицы
+        sheet->SetCell("B1"_pos, "=C3");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
+    }
+
+    void TestFormulaIncorrect() {
+        auto isIncorrect = [](std::string expression) {
+            try {
+                ParseFormula(std::move(expression));
+            } catch (const FormulaException &) {
+                return true;
+            }
+            return false;
+        };
+
+        ASSERT(isIncorrect("A2B"));
+        ASSERT(isIncorrect("3X"));
+        ASSERT(isIncorrect("A0++"));
+        ASSERT(isIncorrect("((1)"));
+        ASSERT(isIncorrect("2+4-"));
+    }
+
+    void TestCellCircularReferences() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("E2"_pos, "=E4");
+        sheet->SetCell("E4"_pos, "=X9");
+        sheet->SetCell("X9"_pos, "=M6");
+        sheet->SetCell("M6"_pos, "Ready");
+
+        bool caught = false;
+        try {
+            sheet->SetCell("M6"_pos, "=E2");
+        } catch (const CircularDependencyException &) {
+            caught = true;
+        }
+
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
+    }
+
+    void TestCacheConsistency() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("F1"_pos, "=E1+E2");
+        sheet->SetCell("B1"_pos, "=A1");
+        sheet->SetCell("B2"_pos, "=A1");
+        sheet->SetCell("C1"_pos, "=B2");
+        sheet->SetCell("C2"_pos, "=B1");
+        sheet->SetCell("E2"_pos, "=C1+B1");
+        sheet->SetCell("E1"_pos, "=C2+B2");
+        ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(0.0));
+        sheet->SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(4.0));
+        sheet->ClearCell("B1"_pos);
+        ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(2.0));
+        sheet->ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(0.0));
+    }
+
+    void TestSetSameFormula() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "3");
+        sheet.SetCell("A1"_pos, "=(B1 + 2)");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // neither the text it was entered with nor the canonical one changes
+        // the cell, which keeps its value
+        sheet.SetCell("A1"_pos, "=(B1 + 2)");
+        ASSERT(sheet.GetCellPtr("A1"_pos)->HasCache());
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=B1+2");
+        sheet.SetCell("A1"_pos, "=B1+2");
+        sheet.SetCells({{"A1"_pos, "=B1+2"}});
+        ASSERT(sheet.GetCellPtr("A1"_pos)->HasCache());
+
+        sheet.SetCell("A1"_pos, "=(B1 + 2)*2");
+        ASSERT(!sheet.GetCellPtr("A1"_pos)->HasCache());
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0));
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), "=(B1+2)*2\t3\n");
+    }
+
+    void TestRecalculateAll() {
+        Sheet sheet;
+        for (int row = 0; row < 1000; ++row) {
+            const auto n = std::to_string(row + 1);
+            sheet.SetCell(Position{row, 0}, std::to_string(row));
+            sheet.SetCell(Position{row, 1}, "=A" + n + "*2");
+            // a chain down the column, each level depends on the previous one
+            sheet.SetCell(Position{row, 2}, row == 0 ? "=B1" : "=C" + std::to_string(row) + "+B" + n);
+        }
+        sheet.SetCell("D1"_pos, "=1/(A1)");
+        sheet.SetCell("D2"_pos, "=D1+C1000");
+
+        sheet.RecalculateAll(4);
+        for (int row = 0; row < 1000; ++row) {
+            ASSERT(sheet.GetCellPtr(Position{row, 1})->HasCache());
+            ASSERT(sheet.GetCellPtr(Position{row, 2})->HasCache());
+        }
+        ASSERT_EQUAL(sheet.GetCell("C1000"_pos)->GetValue(), CellInterface::Value(999.0 * 1000.0));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+
+        // only the invalidated part is evaluated again
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT(!sheet.GetCellPtr("C1000"_pos)->HasCache());
+        ASSERT(sheet.GetCellPtr("B2"_pos)->HasCache());
+        sheet.RecalculateAll(3);
+        ASSERT(sheet.GetCellPtr("D2"_pos)->HasCache());
+        ASSERT_EQUAL(sheet.GetCell("C1000"_pos)->GetValue(), CellInterface::Value(999.0 * 1000.0 + 2.0));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(1.0 + 999.0 * 1000.0 + 2.0));
+    }
+
+    void TestLongChainInvalidation() {
+        constexpr int LENGTH = 200'000;
+        const auto link = [](int i) {
+            return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+        };
+
+        // every link refers to the next one, built from the start so that
+        // each new formula only refers to an empty cell
+        Sheet sheet;
+        for (int i = 0; i < LENGTH; ++i) {
+            sheet.SetCell(link(i), "=" + link(i + 1).ToString() + "+1");
+        }
+        sheet.RecalculateAll(1);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(double(LENGTH)));
+
+        sheet.SetCell(link(LENGTH), "5");
+        ASSERT(!sheet.GetCellPtr("A1"_pos)->HasCache());
+        sheet.RecalculateAll(1);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(double(LENGTH + 5)));
+    }
+
+    void TestCircularReferencesAfterReordering() {
+        auto sheet = CreateSheet();
+        const auto is_circular = [&](Position pos, std::string text) {
+            try {
+                sheet->SetCell(pos, std::move(text));
+            } catch (const CircularDependencyException &) {
+                return true;
+            }
+            return false;
+        };
+
+        // G1 is created before the chain, so the edge from it to A101 goes
+        // against the creation order of the cells
+        sheet->SetCell("G1"_pos, "7");
+        for (int row = 0; row < 100; ++row) {
+            sheet->SetCell(Position{row, 0}, "=A" + std::to_string(row + 2) + "+1");
+        }
+        ASSERT(!is_circular("A101"_pos, "=G1"));
+        ASSERT(is_circular("G1"_pos, "=A1"));
+        ASSERT(is_circular("G1"_pos, "=A100*2"));
+        ASSERT(is_circular("A1"_pos, "=A1"));
+
+        ASSERT(!is_circular("B1"_pos, "=A50"));
+        ASSERT(is_circular("A100"_pos, "=B1"));
+        ASSERT(!is_circular("G1"_pos, "=C1"));
+        ASSERT(is_circular("C1"_pos, "=B1+1"));
+
+        // a failed edit leaves the old formula and its edges in place
+        ASSERT_EQUAL(sheet->GetCell("A100"_pos)->GetText(), "=A101+1");
+        ASSERT_EQUAL(sheet->GetCell("G1"_pos)->GetText(), "=C1");
+        sheet->SetCell("C1"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(105.0));
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(56.0));
+
+        // dropping the edge from the chain to G1 allows the reverse one
+        sheet->SetCell("A101"_pos, "1");
+        ASSERT(!is_circular("G1"_pos, "=A1"));
+        ASSERT_EQUAL(sheet->GetCell("G1"_pos)->GetValue(), CellInterface::Value(101.0));
+    }
+
+    void TestRangeDependencies() {
+        Sheet sheet;
+        const auto is_circular = [&](Position pos, std::string text) {
+            try {
+                sheet.SetCell(pos, std::move(text));
+            } catch (const CircularDependencyException &) {
+                return true;
+            }
+            return false;
+        };
+
+        // the cells of a range are not created for it
+        sheet.SetCell("E1"_pos, "=SUM(A1:D16384)+A1");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(0.0));
+        ASSERT(sheet.GetCellPtr("A1"_pos));
+        ASSERT(!sheet.GetCellPtr("B2"_pos));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 5}));
+
+        // a cell created inside the range invalidates the formula
+        sheet.SetCell("B100"_pos, "3");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(3.0));
+        sheet.SetCell("C7"_pos, "=B100*2");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(9.0));
+        sheet.SetCell("B100"_pos, "4");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+        ASSERT(is_circular("C7"_pos, "=E1"));
+        ASSERT(is_circular("E1"_pos, "=SUM(E1:E2)"));
+        ASSERT(!is_circular("F1"_pos, "=E1"));
+        ASSERT(is_circular("D9"_pos, "=F1"));
+        ASSERT(!sheet.GetCellPtr("D9"_pos) || sheet.GetCellPtr("D9"_pos)->IsEmpty());
+
+        // H1 is created before the formulas, so the cycle goes against the
+        // creation order of the cells
+        sheet.SetCell("H1"_pos, "5");
+        sheet.SetCell("G1"_pos, "=SUM(H1:H3)");
+        ASSERT(!is_circular("B1"_pos, "=G1"));
+        ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), CellInterface::Value(17.0));
+        ASSERT(is_circular("H3"_pos, "=F1"));
+        ASSERT(!is_circular("H3"_pos, "=C7"));
+        ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), CellInterface::Value(25.0));
+
+        // the range leaves the index with its formula
+        sheet.SetCell("E1"_pos, "=A1");
+        ASSERT(!is_circular("C7"_pos, "=E1"));
+        sheet.SetCell("B100"_pos, "1");
+        ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell(Position{row, 9}, std::to_string(row));
+            sheet.SetCell(Position{row, 10}, "=SUM(J1:J" + std::to_string(row + 1) + ")");
+        }
+        sheet.SetCell("L1"_pos, "=MAX(K1:K100)+SUM(J1:K100)");
+        sheet.RecalculateAll(2);
+        ASSERT(sheet.GetCellPtr("L1"_pos)->HasCache());
+        ASSERT_EQUAL(sheet.GetCell("K100"_pos)->GetValue(), CellInterface::Value(4950.0));
+        sheet.SetCell("J50"_pos, "");
+        ASSERT(!sheet.GetCellPtr("K100"_pos)->HasCache());
+        ASSERT(sheet.GetCellPtr("K48"_pos)->HasCache());
+        sheet.RecalculateAll(2);
+        ASSERT_EQUAL(sheet.GetCell("K100"_pos)->GetValue(), CellInterface::Value(4901.0));
+    }
+
+    void TestRangeIndex() {
+        // the cells only serve as distinct formulas
+        Sheet sheet;
+        std::vector<Cell *> formulas;
+        for (int row = 0; row < 64; ++row) {
+            sheet.SetCell(Position{row, 0}, "1");
+            formulas.push_back(sheet.GetCellPtr(Position{row, 0}));
+        }
+
+        // Whole columns and rows side by side, as SUM(A1:A16384) in every
+        // column, crossing the middle lines of the sheet, ranges of all
+        // shapes, a single cell and one range twice.
+        std::mt19937 random(42);
+        const auto coordinate = [&random](int size) { return static_cast<int>(random() % size); };
+        std::vector<std::pair<CellRange, Cell *>> entries;
+        for (int col = 0; col < 200; ++col) {
+            entries.push_back({{{0, col}, {Position::MAX_ROWS - 1, col}}, formulas[col % formulas.size()]});
+            entries.push_back({{{col, 0}, {col, Position::MAX_COLS - 1}}, formulas[col % formulas.size()]});
+        }
+        for (int i = 0; i < 1000; ++i) {
+            const auto size = i % 3 == 0 ? Position::MAX_ROWS : 300;
+            entries.push_back({CellRange::Normalized({coordinate(size), coordinate(size)},
+                                                     {coordinate(size), coordinate(size)}),
+                               formulas[i % formulas.size()]});
+        }
+        entries.push_back({{{5, 5}, {5, 5}}, formulas[0]});
+        entries.push_back(entries.front());
+
+        RangeIndex index;
+        for (const auto &[range, formula]: entries) {
+            index.Insert(range, formula);
+        }
+        ASSERT_EQUAL(index.Size(), entries.size());
+
+        const auto check = [&](Position pos) {
+            std::vector<Cell *> expected;
+            for (const auto &[range, formula]: entries) {
+                if (range.Contains(pos)) { expected.push_back(formula); }
+            }
+            std::vector<Cell *> found;
+            index.ForEachCovering(pos, [&found](Cell *formula) { found.push_back(formula); });
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            ASSERT(found == expected);
+        };
+        const auto check_all = [&] {
+            for (const int row: {0, 5, 8191, 8192, Position::MAX_ROWS - 1}) {
+                for (const int col: {0, 5, 150, 8191, 8192, Position::MAX_COLS - 1}) {
+                    check(Position{row, col});
+                }
+            }
+            for (int i = 0; i < 2000; ++i) {
+                const auto size = i % 2 ? Position::MAX_ROWS : 300;
+                check(Position{coordinate(size), coordinate(size)});
+            }
+        };
+        check_all();
+
+        // a missing entry is left alone, and equal ones go one at a time
+        index.Erase({{0, 0}, {Position::MAX_ROWS - 1, 0}}, formulas[1]);
+        ASSERT_EQUAL(index.Size(), entries.size());
+        for (std::size_t i = 0; i < entries.size(); i += 2) {
+            index.Erase(entries[i].first, entries[i].second);
+        }
+        for (std::size_t i = 0; i < entries.size(); i += 2) {
+            entries[i / 2] = entries[i + 1];
+        }
+        entries.resize(entries.size() / 2);
+        ASSERT_EQUAL(index.Size(), entries.size());
+        check_all();
+
+        for (const auto &[range, formula]: entries) {
+            index.Erase(range, formula);
+        }
+        ASSERT_EQUAL(index.Size(), 0u);
+        entries.clear();
+        check_all();
+    }
+
+    void TestNumericColumns() {
+        Sheet sheet;
+        const auto &columns = sheet.GetNumericColumns();
+        // the numbers of the column and the rows read from the cells
+        const auto read = [&](int col, int first_row, int last_row) {
+            std::pair<double, std::vector<int>> result{0.0, {}};
+            columns.ForEachFilled(col, first_row, last_row, [&](double value) { result.first += value; },
+                                  [&](int row) {
+                                      result.second.push_back(row);
+                                      return true;
+                                  });
+            return result;
+        };
+        const auto check = [&](int col, int first_row, int last_row, double sum, std::vector<int> rows) {
+            const auto [actual_sum, actual_rows] = read(col, first_row, last_row);
+            ASSERT_EQUAL(actual_sum, sum);
+            ASSERT_EQUAL(actual_rows, rows);
+        };
+
+        for (int row = 0; row < 200; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row));
+        }
+        sheet.SetCell("A70"_pos, "abc");
+        sheet.SetCell("A71"_pos, "'5");
+        sheet.SetCell("A2000"_pos, "1000");
+        check(0, 0, 16383, 19900.0 - 69.0 - 70.0 + 5.0 + 1000.0, {69});
+        check(0, 10, 12, 33.0, {});
+        check(1, 0, 16383, 0.0, {});
+
+        // a formula is read from its cell until its value is cached
+        sheet.SetCell("A70"_pos, "=A3*2");
+        sheet.SetCell("B1"_pos, "=SUM(A1:A64)+A70");
+        ASSERT_EQUAL(read(1, 0, 0).second, std::vector<int>{0});
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2020.0));
+        check(0, 60, 70, 60.0 + 61.0 + 62.0 + 63.0 + 64.0 + 65.0 + 66.0 + 67.0 + 68.0 + 4.0 + 5.0, {});
+        check(1, 0, 0, 2020.0, {});
+
+        // edits and cleared cells go through to the columns
+        sheet.SetCell("A3"_pos, "10");
+        ASSERT_EQUAL(read(0, 69, 69).second, std::vector<int>{69});
+        ASSERT_EQUAL(read(1, 0, 0).second, std::vector<int>{0});
+        sheet.ClearCell("A2"_pos);
+        sheet.SetCell("A64"_pos, "=1/0");
+        sheet.RecalculateAll(2);
+        check(0, 0, 69, 2016.0 - 1.0 - 2.0 + 10.0 - 63.0 + 330.0 + 20.0, {63});
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+        sheet.SetCell("A64"_pos, "63");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2016.0 - 1.0 - 2.0 + 10.0 + 20.0));
+    }
+
+    void TestStats() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+C1");
+        sheet.SetCell("A3"_pos, "=A2*2");
+        sheet.SetCell("A4"_pos, "=A3+C3");
+        sheet.SetCell("B1"_pos, "text");
+
+        auto stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.empty_cells, 2u);
+        ASSERT_EQUAL(stats.text_cells, 2u);
+        ASSERT_EQUAL(stats.formula_cells, 3u);
+        ASSERT_EQUAL(stats.cache_bytes, 0u);
+        ASSERT(stats.ast_bytes > 0);
+        ASSERT(stats.numeric_column_bytes > 0);
+
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(2.0));
+        stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.cache_bytes, 2 * sizeof(FormulaInterface::Value));
+#ifdef SPREADSHEET_WITH_STATS
+        ASSERT_EQUAL(stats.cache_misses, 2u);
+        ASSERT_EQUAL(stats.cache_hits, 1u);
+        ASSERT_EQUAL(stats.edits, 5u);
+        // A4 has the shape of A2
+        ASSERT_EQUAL(stats.formulas_parsed, 2u);
+        ASSERT(stats.parse_nanoseconds > 0);
+
+        sheet.SetCell("A1"_pos, "2");
+        stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.edits, 6u);
+        ASSERT_EQUAL(stats.invalidated_cells, 2u);
+        ASSERT_EQUAL(stats.max_invalidated_cells, 2u);
+
+        // the edge from A1 to C3 goes against the order of the cells
+        const auto visits = stats.cycle_check_visits;
+        sheet.SetCell("C3"_pos, "=A1");
+        ASSERT(sheet.GetStats().cycle_check_visits > visits);
+#else
+        ASSERT_EQUAL(stats.cache_hits, 0u);
+        ASSERT_EQUAL(stats.edits, 0u);
+#endif
+    }
+
+    void TestSetCells() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("C1"_pos, "=B1*10");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(20.0));
+
+        // B1 and C1 swap the direction of their reference in one edit,
+        // which would be a cycle cell by cell
+        sheet.SetCells({{"B1"_pos, "=C1+1"}, {"C1"_pos, "=A1*10"}, {"A1"_pos, "2"}, {"A1"_pos, "3"}});
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "3");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(31.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+
+        const auto unchanged = [&] {
+            ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=C1+1");
+            ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1*10");
+            ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(31.0));
+            ASSERT(sheet.GetCell("E5"_pos) == nullptr);
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+        };
+
+        bool caught = false;
+        try {
+            sheet.SetCells({{"E5"_pos, "x"}, {"A1"_pos, "=D1"}, {"D1"_pos, "=B1"}});
+        } catch (const CircularDependencyException &) {
+            caught = true;
+        }
+        ASSERT(caught);
+        unchanged();
+
+        caught = false;
+        try {
+            sheet.SetCells({{"E5"_pos, "x"}, {"A1"_pos, "5"}, {"C1"_pos, "=A1+"}});
+        } catch (const FormulaException &) {
+            caught = true;
+        }
+        ASSERT(caught);
+        unchanged();
+
+        caught = false;
+        try {
+            sheet.SetCells({{"E5"_pos, "x"}, {Position{-1, 0}, "5"}});
+        } catch (const InvalidPositionException &) {
+            caught = true;
+        }
+        ASSERT(caught);
+        unchanged();
+
+        // the graph is intact after the rollbacks
+        caught = false;
+        try {
+            sheet.SetCell("A1"_pos, "=B1");
+        } catch (const CircularDependencyException &) {
+            caught = true;
+        }
+        ASSERT(caught);
+        sheet.SetCells({{"A1"_pos, "4"}, {"C1"_pos, ""}});
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+    }
+
+    void TestSnapshot() {
+        const auto path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+        const auto texts = [](const Sheet &sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+
+        std::string saved_texts;
+        {
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "1");
+            sheet.SetCell("A2"_pos, "'=text");
+            sheet.SetCell("C1"_pos, "2.5");
+            sheet.SetCell("B1"_pos, "=A1+C1");
+            sheet.SetCell("B2"_pos, "=A2+C2");
+            sheet.SetCell("B3"_pos, "=SUM(C1:C4)+B1");
+            ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(6.0));
+            ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+            saved_texts = texts(sheet);
+            sheet.SaveSnapshot(path);
+        }
+
+        const auto loaded = Sheet::LoadSnapshot(path);
+        ASSERT_EQUAL(texts(*loaded), saved_texts);
+        ASSERT_EQUAL(loaded->GetPrintableSize(), (Size{3, 3}));
+        ASSERT(loaded->GetCellPtr("B3"_pos)->HasCache());
+        ASSERT_EQUAL(loaded->GetCell("B3"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(loaded->GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(loaded->GetCell("A2"_pos)->GetValue(), CellInterface::Value("=text"));
+        ASSERT_EQUAL(loaded->GetFormulaInterner().GetShapeCount(), 2u);
+
+        // edits go through the restored graph and the restored shapes
+        loaded->SetCell("C2"_pos, "1.5");
+        loaded->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(loaded->GetCell("B3"_pos)->GetValue(), CellInterface::Value(8.5));
+        loaded->SetCell("B4"_pos, "=A4+C4");
+        ASSERT_EQUAL(loaded->GetFormulaInterner().GetShapeCount(), 2u);
+        bool caught = false;
+        try {
+            loaded->SetCell("C1"_pos, "=B3");
+        } catch (const CircularDependencyException &) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // without the values every formula is evaluated again
+        loaded->SaveSnapshot(path, false);
+        const auto bare = Sheet::LoadSnapshot(path);
+        ASSERT_EQUAL(texts(*bare), texts(*loaded));
+        ASSERT(!bare->GetCellPtr("B3"_pos)->HasCache());
+        ASSERT_EQUAL(bare->GetCell("B3"_pos)->GetValue(), CellInterface::Value(8.5));
+
+        // a damaged file is refused, whichever byte is wrong
+        std::string data;
+        {
+            std::ifstream in(path, std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        const auto load_damaged = [&](const std::string &damaged) {
+            std::ofstream(path, std::ios::binary | std::ios::trunc) << damaged;
+            try {
+                Sheet::LoadSnapshot(path);
+            } catch (const SnapshotException &) {
+                return false;
+            }
+            return true;
+        };
+        ASSERT(!load_damaged(data.substr(0, data.size() / 2)));
+        ASSERT(!load_damaged(data + "x"));
+        for (std::size_t i = 0; i < data.size(); ++i) {
+            auto damaged = data;
+            damaged[i] = static_cast<char>(damaged[i] ^ 0x5a);
+            load_damaged(damaged);
+        }
+
+        // Damage that still reads well: the cells are the last records, 33
+        // bytes each without values, holding i32 row, i32 col, i64 order,
+        // u8 kind, u32 body and the i32 offset row and col of the formula.
+        {
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "=SUM(B1:B2)");
+            sheet.SetCell("B1"_pos, "=SUM(C1:C2)");
+            sheet.SaveSnapshot(path, false);
+        }
+        {
+            std::ifstream in(path, std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        constexpr std::size_t RECORD_SIZE = 33;
+        const auto record_of = [&](Position pos) {
+            for (std::size_t record = data.size() - 2 * RECORD_SIZE; record < data.size(); record += RECORD_SIZE) {
+                std::int32_t row = 0;
+                std::int32_t col = 0;
+                std::memcpy(&row, data.data() + record, sizeof(row));
+                std::memcpy(&col, data.data() + record + 4, sizeof(col));
+                if (pos == Position{row, col}) { return record; }
+            }
+            return std::string::npos;
+        };
+        const auto a1 = record_of("A1"_pos);
+        const auto b1 = record_of("B1"_pos);
+        ASSERT(a1 != std::string::npos && b1 != std::string::npos);
+        ASSERT(load_damaged(data));
+        {
+            // B1 reads A1:A2 and comes first, a cycle through a range
+            auto damaged = data;
+            std::swap_ranges(damaged.begin() + a1 + 8, damaged.begin() + a1 + 16, damaged.begin() + b1 + 8);
+            std::int32_t offset_col = -1;
+            std::memcpy(damaged.data() + b1 + 25, &offset_col, sizeof(offset_col));
+            ASSERT(!load_damaged(damaged));
+        }
+        {
+            // A1 reads a range past the last row
+            auto damaged = data;
+            std::int32_t offset_row = Position::MAX_ROWS;
+            std::memcpy(damaged.data() + a1 + 21, &offset_row, sizeof(offset_row));
+            ASSERT(!load_damaged(damaged));
+        }
+        {
+            // the shared body reads B2:B1, a range the parser never makes
+            std::string range;
+            range += '\x02';
+            for (const std::int32_t coordinate: {0, 1, 1, 1}) {
+                range.append(reinterpret_cast<const char *>(&coordinate), sizeof(coordinate));
+            }
+            auto damaged = data;
+            const auto at = damaged.find(range);
+            ASSERT(at != std::string::npos);
+            std::swap_ranges(damaged.begin() + at + 1, damaged.begin() + at + 5, damaged.begin() + at + 9);
+            ASSERT(!load_damaged(damaged));
+        }
+        std::filesystem::remove(path);
+    }
+
+    void TestJournal() {
+        const auto directory = std::filesystem::temp_directory_path() / "spreadsheet_test_journal";
+        std::filesystem::remove_all(directory);
+        std::filesystem::create_directory(directory);
+        const auto snapshot = (directory / "sheet.snapshot").string();
+        const auto journal = (directory / "sheet.journal").string();
+        const auto texts = [](const Sheet &sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+
+        std::string expected;
+        {
+            const auto sheet = Sheet::Recover(snapshot, journal);
+            sheet->SetCell("A1"_pos, "1");
+            sheet->SetCell("A2"_pos, "=A1+B1");
+            sheet->SetCells({{"B1"_pos, "2"}, {"C1"_pos, "x"}});
+            sheet->ClearCell("C1"_pos);
+            // a failed edit is not logged
+            try {
+                sheet->SetCell("A1"_pos, "=A2");
+            } catch (const CircularDependencyException &) {
+            }
+            expected = texts(*sheet);
+        }
+        {
+            const auto sheet = Sheet::Recover(snapshot, journal);
+            ASSERT_EQUAL(texts(*sheet), expected);
+            ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+
+            // only the edits after the checkpoint stay in the journal
+            sheet->Checkpoint();
+            ASSERT(std::filesystem::exists(snapshot));
+            const auto checkpointed_size = std::filesystem::file_size(journal);
+            sheet->SetCell("B1"_pos, "5");
+            sheet->SyncJournal();
+            ASSERT(std::filesystem::file_size(journal) > checkpointed_size);
+            expected = texts(*sheet);
+        }
+
+        // a record torn by a crash is dropped and the next ones follow the
+        // intact records
+        std::ofstream(journal, std::ios::binary | std::ios::app) << "torn";
+        {
+            const auto sheet = Sheet::Recover(snapshot, journal);
+            ASSERT_EQUAL(texts(*sheet), expected);
+            ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+            sheet->SetCell("D1"_pos, "=A2*2");
+            expected = texts(*sheet);
+        }
+        {
+            Journal::Options options;
+            options.wait_for_commit = true;
+            const auto sheet = Sheet::Recover(snapshot, journal, options);
+            ASSERT_EQUAL(texts(*sheet), expected);
+            ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(12.0));
+        }
+
+        // only the edits are logged, not the empty cells their formulas
+        // refer to, nothing of a rejected edit and no edit that leaves the
+        // cells as they are
+        const auto edits = (directory / "edits.journal").string();
+        {
+            const auto sheet = Sheet::Recover((directory / "edits.snapshot").string(), edits);
+            sheet->SetCell("A1"_pos, "=B5+C7");
+            try {
+                sheet->SetCell("F1"_pos, "=F1+Z9");
+            } catch (const CircularDependencyException &) {
+            }
+            sheet->SetCell("A1"_pos, "=B5+C7");
+            sheet->SetCells({{"A1"_pos, "=B5+C7"}, {"B1"_pos, "2"}});
+            sheet->SetCells({{"B1"_pos, "2"}});
+            sheet->ClearCell("B5"_pos);
+            sheet->ClearCell("E9"_pos);
+        }
+        std::vector<Journal::Record> records;
+        Journal(edits).Replay(0, [&records](const Journal::Record &record) {
+            records.push_back(record);
+        });
+        ASSERT_EQUAL(records.size(), 2u);
+        ASSERT(records[0].operation == Journal::Operation::Set);
+        ASSERT_EQUAL(records[0].cells.size(), 1u);
+        ASSERT(records[0].cells[0].first == "A1"_pos);
+        ASSERT_EQUAL(records[0].cells[0].second, "=B5+C7");
+        ASSERT(records[1].operation == Journal::Operation::SetMany);
+        ASSERT_EQUAL(records[1].cells.size(), 1u);
+        ASSERT(records[1].cells[0].first == "B1"_pos);
+        ASSERT_EQUAL(records[1].cells[0].second, "2");
+
+        // the journal has to continue the snapshot
+        std::filesystem::remove(snapshot);
+        bool caught = false;
+        try {
+            Sheet::Recover(snapshot, journal);
+        } catch (const JournalException &) {
+            caught = true;
+        }
+        ASSERT(caught);
+        std::filesystem::remove_all(directory);
+    }
+
+    void TestImportTexts() {
+        const auto texts = [](const Sheet &sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+
+        // what PrintTexts writes is read back as the same sheet
+        Sheet original;
+        original.SetCell("A1"_pos, "1");
+        original.SetCell("C1"_pos, "'=text");
+        original.SetCell("B2"_pos, "=A1+C3");
+        original.SetCell("C3"_pos, "2.5");
+        original.SetCell("A4"_pos, "=SUM(B2:C3)");
+        const auto printed = texts(original);
+        Sheet imported;
+        imported.ImportTexts(printed);
+        ASSERT_EQUAL(texts(imported), printed);
+        ASSERT_EQUAL(imported.GetPrintableSize(), (Size{4, 3}));
+        ASSERT_EQUAL(imported.GetCell("B2"_pos)->GetValue(), CellInterface::Value(3.5));
+        ASSERT_EQUAL(imported.GetCell("A4"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(imported.GetCell("C1"_pos)->GetValue(), CellInterface::Value("=text"));
+
+        // CRLF line breaks, the last line without one
+        Sheet crlf;
+        crlf.ImportTexts("=B1*2\t5\r\n=B1+1\ttext\r\n=B1+2");
+        ASSERT_EQUAL(crlf.GetPrintableSize(), (Size{3, 2}));
+        ASSERT_EQUAL(crlf.GetCell("B1"_pos)->GetText(), "5");
+        ASSERT_EQUAL(crlf.GetCell("B2"_pos)->GetText(), "text");
+        ASSERT_EQUAL(crlf.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT_EQUAL(crlf.GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(crlf.GetCell("A3"_pos)->GetValue(), CellInterface::Value(7.0));
+
+        // rows spread over several chunks and threads, a formula of one
+        // shape per row parsed once per chunk
+        std::string data;
+        for (int row = 0; row < 16000; ++row) {
+            data += std::to_string(row) + "," + (row == 0 ? "=A1" : "=B" + std::to_string(row) + "+A" + std::to_string(row + 1));
+            data += ",padding to fill the chunks\n";
+        }
+        Sheet large;
+        large.ImportTexts(data, ',', 4);
+        ASSERT_EQUAL(large.GetPrintableSize(), (Size{16000, 3}));
+        large.RecalculateAll(4);
+        ASSERT_EQUAL(large.GetCell("B16000"_pos)->GetValue(), CellInterface::Value(15999.0 * 16000 / 2));
+        ASSERT_EQUAL(large.GetFormulaInterner().GetShapeCount(), 2u);
+        ASSERT(large.GetStats().formulas_parsed < 100u);
+
+        // a bad formula fails the whole import
+        bool caught = false;
+        try {
+            imported.ImportTexts("5\t=1+\n");
+        } catch (const FormulaException &) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(texts(imported), printed);
+    }
+
+}  // namespace
+
+int main() {
+    TestRunner tr;
+    RUN_TEST(tr, TestPositionAndStringConversion);
+    RUN_TEST(tr, TestPositionConstexpr);
+    RUN_TEST(tr, TestPositionToStringInvalid);
+    RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestEmpty);
+    RUN_TEST(tr, TestInvalidPosition);
+    RUN_TEST(tr, TestSetCellPlainText);
+    RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestFormulaArithmetic);
+    RUN_TEST(tr, TestFormulaReferences);
+    RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaGrammar);
+#ifdef SPREADSHEET_WITH_ANTLR
+    RUN_TEST(tr, TestFormulaParserMatchesAntlr);
+#endif
+    RUN_TEST(tr, TestExprArenaMove);
+    RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestErrorValue);
+    RUN_TEST(tr, TestTextCellsAsNumbers);
+    RUN_TEST(tr, TestFormulaInterning);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestAggregateFunctions);
+    RUN_TEST(tr, TestConstantFolding);
+    RUN_TEST(tr, TestErrorDiv0);
+    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+    RUN_TEST(tr, TestFormulaInvalidPosition);
+    RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintValuesFormatting);
+    RUN_TEST(tr, TestCellsAcrossTiles);
+    RUN_TEST(tr, TestPrintableSizeIgnoresEmptyCells);
+    RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCacheConsistency);
+    RUN_TEST(tr, TestCircularReferencesAfterReordering);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestRangeIndex);
+    RUN_TEST(tr, TestNumericColumns);
+    RUN_TEST(tr, TestStats);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestSetSameFormula);
+    RUN_TEST(tr, TestRecalculateAll);
+    RUN_TEST(tr, TestLongChainInvalidation);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestJournal);
+    RUN_TEST(tr, TestImportTexts);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include "mapped_file.h"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) { throw std::runtime_error("Cannot open " + path); }
+    buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    if (in.bad()) { throw std::runtime_error("Cannot read " + path); }
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+}
+
+MappedFile::~MappedFile() = default;
+#else
+MappedFile::MappedFile(const std::string &path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) { throw std::runtime_error("Cannot open " + path); }
+
+    struct stat info{};
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Cannot read " + path);
+    }
+    size_ = static_cast<std::size_t>(info.st_size);
+    // an empty file cannot be mapped, it is an empty view
+    if (size_ > 0) {
+        void *data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Cannot map " + path);
+        }
+        data_ = static_cast<const char *>(data);
+    }
+    // the mapping stays valid without the descriptor
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        ::munmap(const_cast<char *>(data_), size_);
+    }
+}
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// A whole file mapped read-only into memory. Where mmap is not available
+// the file is read into a buffer instead, which looks the same to the user.
+class MappedFile {
+public:
+    // throws std::runtime_error if the file cannot be opened or mapped
+    explicit MappedFile(const std::string &path);
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile();
+
+    std::string_view GetData() const {
+        return {data_, size_};
+    }
+
+private:
+    const char *data_ = nullptr;
+    std::size_t size_ = 0;
+#ifdef _WIN32
+    std::string buffer_;
+#endif
+};
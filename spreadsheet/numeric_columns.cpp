@@ -0,0 +1,44 @@
+#include "numeric_columns.h"
+
+NumericColumns::~NumericColumns() = default;
+
+void NumericColumns::Reserve(Position pos) {
+    if (pos.col >= static_cast<int>(columns_.size())) {
+        columns_.resize(pos.col + 1);
+    }
+
+    auto &block = columns_[pos.col][pos.row / BLOCK_ROWS];
+    if (!block) { block = std::make_unique<Block>(); }
+}
+
+std::size_t NumericColumns::GetMemoryUsage() const {
+    std::size_t bytes = columns_.capacity() * sizeof(Column);
+    for (const auto &column: columns_) {
+        for (const auto &block: column) {
+            bytes += block ? sizeof(Block) : 0;
+        }
+    }
+    return bytes;
+}
+
+void NumericColumns::SetEmpty(Position pos) {
+    auto &block = GetBlock(pos);
+    const auto word = pos.row % BLOCK_ROWS / WORD_BITS;
+    block.filled[word].fetch_and(~Bit(pos.row), std::memory_order_relaxed);
+    block.numbers[word].fetch_and(~Bit(pos.row), std::memory_order_relaxed);
+}
+
+void NumericColumns::SetNumber(Position pos, double value) {
+    auto &block = GetBlock(pos);
+    const auto word = pos.row % BLOCK_ROWS / WORD_BITS;
+    block.values[pos.row % BLOCK_ROWS] = value;
+    block.filled[word].fetch_or(Bit(pos.row), std::memory_order_relaxed);
+    block.numbers[word].fetch_or(Bit(pos.row), std::memory_order_relaxed);
+}
+
+void NumericColumns::SetOther(Position pos) {
+    auto &block = GetBlock(pos);
+    const auto word = pos.row % BLOCK_ROWS / WORD_BITS;
+    block.filled[word].fetch_or(Bit(pos.row), std::memory_order_relaxed);
+    block.numbers[word].fetch_and(~Bit(pos.row), std::memory_order_relaxed);
+}
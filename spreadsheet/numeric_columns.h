@@ -0,0 +1,130 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Column-wise shadow of the cell values as formulas read them. A column is
+// split into blocks of rows, allocated with their first cell; a block is a
+// dense array of doubles with two bitmaps over its rows: "filled" for a
+// non-empty cell and "number" for a cell whose number is in the array, i.e.
+// a numeric text or a formula with a cached number. A filled cell without a
+// number (other text, an error, a formula not evaluated yet) has to be read
+// from the cell itself.
+//
+// Blocks are only allocated in Reserve, which runs when a cell is created.
+// The other methods may run concurrently for distinct positions, as caches
+// are filled in parallel by RecalculateAll.
+class NumericColumns {
+public:
+    NumericColumns() = default;
+
+    NumericColumns(const NumericColumns &) = delete;
+
+    NumericColumns &operator=(const NumericColumns &) = delete;
+
+    ~NumericColumns();
+
+    // makes room for pos, which starts empty
+    void Reserve(Position pos);
+
+    // heap bytes of the allocated blocks and the column directory
+    std::size_t GetMemoryUsage() const;
+
+    void SetEmpty(Position pos);
+
+    void SetNumber(Position pos, double value);
+
+    // filled, but the value is not a known number
+    void SetOther(Position pos);
+
+    // Walks the rows first_row..last_row of the column in order, calling
+    // on_number(value) for the cells with a number and on_other(row) for the
+    // other filled cells. Stops when on_other returns false.
+    template <class OnNumber, class OnOther>
+    void ForEachFilled(int col, int first_row, int last_row, OnNumber on_number, OnOther on_other) const;
+
+private:
+    using Word = std::uint64_t;
+    static constexpr int WORD_BITS = 64;
+    static constexpr int BLOCK_ROWS = 1024;
+    static constexpr int BLOCK_WORDS = BLOCK_ROWS / WORD_BITS;
+    static constexpr int COLUMN_BLOCKS = (Position::MAX_ROWS + BLOCK_ROWS - 1) / BLOCK_ROWS;
+
+    struct Block {
+        std::array<double, BLOCK_ROWS> values{};
+        std::array<std::atomic<Word>, BLOCK_WORDS> filled{};
+        std::array<std::atomic<Word>, BLOCK_WORDS> numbers{};
+    };
+
+    using Column = std::array<std::unique_ptr<Block>, COLUMN_BLOCKS>;
+
+    // the bit of the row in its word
+    static Word Bit(int row) {
+        return Word{1} << (row % WORD_BITS);
+    }
+
+    // the index of the lowest set bit of a non-zero word
+    static int LowestBit(Word bits) {
+#ifdef __GNUC__
+        return __builtin_ctzll(bits);
+#else
+        int index = 0;
+        for (; (bits & 1) == 0; bits >>= 1) { ++index; }
+        return index;
+#endif
+    }
+
+    Block &GetBlock(Position pos) {
+        return *columns_[pos.col][pos.row / BLOCK_ROWS];
+    }
+
+    std::vector<Column> columns_;
+};
+
+template <class OnNumber, class OnOther>
+void NumericColumns::ForEachFilled(int col, int first_row, int last_row, OnNumber on_number, OnOther on_other) const {
+    if (col >= static_cast<int>(columns_.size())) { return; }
+    const auto &column = columns_[col];
+
+    for (int word = first_row / WORD_BITS; word <= last_row / WORD_BITS; ++word) {
+        const auto &block_ptr = column[word / BLOCK_WORDS];
+        if (!block_ptr) {
+            // go on from the first word of the next block
+            word = (word / BLOCK_WORDS + 1) * BLOCK_WORDS - 1;
+            continue;
+        }
+        const auto &block = *block_ptr;
+        const auto word_in_block = word % BLOCK_WORDS;
+
+        Word filled = block.filled[word_in_block].load(std::memory_order_relaxed);
+        if (filled == 0) { continue; }
+        const int base = word * WORD_BITS;
+        // cut off the rows outside of the range
+        if (base < first_row) { filled &= ~Word{0} << (first_row - base); }
+        if (base + WORD_BITS - 1 > last_row) { filled &= ~Word{0} >> (base + WORD_BITS - 1 - last_row); }
+
+        const Word numbers = filled & block.numbers[word_in_block].load(std::memory_order_relaxed);
+        const double *values = &block.values[word_in_block * WORD_BITS];
+        if (numbers == ~Word{0}) {
+            // a full run of numbers is read straight from the array
+            for (int offset = 0; offset < WORD_BITS; ++offset) {
+                on_number(values[offset]);
+            }
+            continue;
+        }
+        for (Word bits = filled; bits != 0; bits &= bits - 1) {
+            const int offset = LowestBit(bits);
+            if (numbers & (Word{1} << offset)) {
+                on_number(values[offset]);
+            } else if (!on_other(base + offset)) {
+                return;
+            }
+        }
+    }
+}
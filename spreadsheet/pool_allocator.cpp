@@ -0,0 +1,48 @@
+#include "pool_allocator.h"
+
+SizeClassPool::~SizeClassPool() = default;
+
+void *SizeClassPool::Allocate(std::size_t size) {
+    if (size == 0) {
+        size = 1;
+    }
+    if (size > MAX_POOLED_SIZE) {
+        return ::operator new(size);
+    }
+
+    const auto index = ClassIndex(size);
+    if (auto node = free_lists_[index]) {
+        free_lists_[index] = node->next;
+        return node;
+    }
+
+    const auto class_size = (index + 1) * ALIGNMENT;
+    if (static_cast<std::size_t>(chunk_end_ - chunk_pos_) < class_size) {
+        // the tail of the previous chunk is too small for this class and stays unused
+        chunks_.emplace_back(new std::byte[CHUNK_SIZE]);
+        chunk_pos_ = chunks_.back().get();
+        chunk_end_ = chunk_pos_ + CHUNK_SIZE;
+    }
+
+    void *result = chunk_pos_;
+    chunk_pos_ += class_size;
+    return result;
+}
+
+void SizeClassPool::Deallocate(void *ptr, std::size_t size) noexcept {
+    if (!ptr) {
+        return;
+    }
+    if (size == 0) {
+        size = 1;
+    }
+    if (size > MAX_POOLED_SIZE) {
+        ::operator delete(ptr);
+        return;
+    }
+
+    const auto index = ClassIndex(size);
+    auto node = static_cast<FreeNode *>(ptr);
+    node->next = free_lists_[index];
+    free_lists_[index] = node;
+}
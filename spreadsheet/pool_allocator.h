@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Per-sheet allocator for small objects. Requests are rounded up to a size
+// class, carved out of large chunks and recycled through per-class free
+// lists; larger requests go straight to operator new. Everything still held
+// by the pool is released in bulk when it is destroyed. Not thread-safe.
+class SizeClassPool {
+public:
+    static constexpr std::size_t ALIGNMENT = alignof(std::max_align_t);
+    static constexpr std::size_t MAX_POOLED_SIZE = 256;
+    static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+    SizeClassPool() = default;
+
+    SizeClassPool(const SizeClassPool &) = delete;
+
+    SizeClassPool &operator=(const SizeClassPool &) = delete;
+
+    ~SizeClassPool();
+
+    void *Allocate(std::size_t size);
+
+    void Deallocate(void *ptr, std::size_t size) noexcept;
+
+private:
+    struct FreeNode {
+        FreeNode *next;
+    };
+
+    static std::size_t ClassIndex(std::size_t size) {
+        return (size + ALIGNMENT - 1) / ALIGNMENT - 1;
+    }
+
+    std::array<FreeNode *, MAX_POOLED_SIZE / ALIGNMENT> free_lists_{};
+    std::vector<std::unique_ptr<std::byte[]>> chunks_;
+    std::byte *chunk_pos_ = nullptr;
+    std::byte *chunk_end_ = nullptr;
+};
+
+// Standard allocator interface over a SizeClassPool, for containers owned by
+// objects that live in the pool.
+template <class T>
+class PoolAllocator {
+public:
+    using value_type = T;
+
+    explicit PoolAllocator(SizeClassPool &pool) noexcept : pool_(&pool) {
+    }
+
+    template <class U>
+    PoolAllocator(const PoolAllocator<U> &other) noexcept : pool_(other.GetPool()) {
+    }
+
+    T *allocate(std::size_t n) {
+        return static_cast<T *>(pool_->Allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        pool_->Deallocate(ptr, n * sizeof(T));
+    }
+
+    SizeClassPool *GetPool() const noexcept {
+        return pool_;
+    }
+
+    template <class U>
+    bool operator==(const PoolAllocator<U> &other) const noexcept {
+        return pool_ == other.GetPool();
+    }
+
+    template <class U>
+    bool operator!=(const PoolAllocator<U> &other) const noexcept {
+        return pool_ != other.GetPool();
+    }
+
+private:
+    SizeClassPool *pool_;
+};
+
+// Deleter for objects created by MakePooled. It remembers the allocated size,
+// so a pointer to a base class releases the whole derived object.
+class PoolDeleter {
+public:
+    PoolDeleter() = default;
+
+    PoolDeleter(SizeClassPool *pool, std::size_t size) noexcept : pool_(pool), size_(size) {
+    }
+
+    template <class T>
+    void operator()(T *ptr) const noexcept {
+        ptr->~T();
+        pool_->Deallocate(ptr, size_);
+    }
+
+private:
+    SizeClassPool *pool_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+template <class T>
+using PoolPtr = std::unique_ptr<T, PoolDeleter>;
+
+template <class T, class... Args>
+PoolPtr<T> MakePooled(SizeClassPool &pool, Args &&... args) {
+    void *memory = pool.Allocate(sizeof(T));
+    try {
+        return PoolPtr<T>(new(memory) T(std::forward<Args>(args)...), PoolDeleter(&pool, sizeof(T)));
+    } catch (...) {
+        pool.Deallocate(memory, sizeof(T));
+        throw;
+    }
+}
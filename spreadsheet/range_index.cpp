@@ -0,0 +1,155 @@
+#include "range_index.h"
+
+#include <algorithm>
+
+RangeIndex::~RangeIndex() = default;
+
+void RangeIndex::Insert(const CellRange &range, Cell *formula) {
+    Node *node = &root_;
+    Position origin{0, 0};
+    int size = ROOT_SIZE;
+    // go down while one quadrant holds the whole range
+    while (size > 1) {
+        const int half = size / 2;
+        const auto quadrant = Quadrant(range.first, origin, half);
+        if (quadrant != Quadrant(range.last, origin, half)) { break; }
+
+        auto &child = node->children[quadrant];
+        if (!child) { child = std::make_unique<Node>(); }
+        node = child.get();
+        origin = ChildOrigin(origin, half, quadrant);
+        size = half;
+    }
+
+    const Entry entry{range, formula};
+    const int middle_row = origin.row + size / 2;
+    if (range.first.row < middle_row && range.last.row >= middle_row) {
+        InsertInto(node->across_rows, &Position::col, &Position::row, origin.col, size, entry);
+    } else {
+        InsertInto(node->across_cols, &Position::row, &Position::col, origin.row, size, entry);
+    }
+    ++size_;
+}
+
+void RangeIndex::Erase(const CellRange &range, Cell *formula) {
+    // the squares on the way down, to drop the ones left empty
+    std::array<Node *, MAX_DEPTH> path{};
+    std::array<std::size_t, MAX_DEPTH> quadrants{};
+    std::size_t depth = 0;
+
+    Node *node = &root_;
+    Position origin{0, 0};
+    int size = ROOT_SIZE;
+    while (size > 1) {
+        const int half = size / 2;
+        const auto quadrant = Quadrant(range.first, origin, half);
+        if (quadrant != Quadrant(range.last, origin, half)) { break; }
+
+        Node *child = node->children[quadrant].get();
+        if (!child) { return; }
+        path[depth] = node;
+        quadrants[depth++] = quadrant;
+        node = child;
+        origin = ChildOrigin(origin, half, quadrant);
+        size = half;
+    }
+
+    const Entry entry{range, formula};
+    const int middle_row = origin.row + size / 2;
+    const bool erased = range.first.row < middle_row && range.last.row >= middle_row
+                        ? EraseFrom(node->across_rows, &Position::col, &Position::row, origin.col, size, entry)
+                        : EraseFrom(node->across_cols, &Position::row, &Position::col, origin.row, size, entry);
+    if (!erased) { return; }
+    --size_;
+
+    while (depth > 0 && !node->across_rows && !node->across_cols
+           && std::none_of(node->children.begin(), node->children.end(), [](const auto &child) { return !!child; })) {
+        --depth;
+        node = path[depth];
+        node->children[quadrants[depth]].reset();
+    }
+}
+
+void RangeIndex::InsertInto(std::unique_ptr<Segment> &root, int Position::*along, int Position::*across, int lo,
+                            int size, const Entry &entry) {
+    std::unique_ptr<Segment> *segment = &root;
+    // go down while one half holds the whole range
+    while (true) {
+        if (!*segment) { *segment = std::make_unique<Segment>(); }
+        if (size == 1) { break; }
+
+        const int half = size / 2;
+        const auto which = Half(entry.range.first.*along, lo, half);
+        if (which != Half(entry.range.last.*along, lo, half)) { break; }
+
+        segment = &(*segment)->children[which];
+        lo += which ? half : 0;
+        size = half;
+    }
+
+    // after the entries with the same key, so that equal ones keep their order
+    auto &by_first = (*segment)->by_first;
+    by_first.insert(std::upper_bound(by_first.begin(), by_first.end(), entry,
+                                     [across](const Entry &lhs, const Entry &rhs) {
+                                         return lhs.range.first.*across < rhs.range.first.*across;
+                                     }),
+                    entry);
+    auto &by_last = (*segment)->by_last;
+    by_last.insert(std::upper_bound(by_last.begin(), by_last.end(), entry,
+                                    [across](const Entry &lhs, const Entry &rhs) {
+                                        return lhs.range.last.*across > rhs.range.last.*across;
+                                    }),
+                   entry);
+}
+
+bool RangeIndex::EraseFrom(std::unique_ptr<Segment> &root, int Position::*along, int Position::*across, int lo,
+                           int size, const Entry &entry) {
+    // the segments on the way down, to drop the ones left empty
+    std::array<std::unique_ptr<Segment> *, MAX_DEPTH> path{};
+    std::size_t depth = 0;
+
+    std::unique_ptr<Segment> *segment = &root;
+    while (true) {
+        if (!*segment) { return false; }
+        if (size == 1) { break; }
+
+        const int half = size / 2;
+        const auto which = Half(entry.range.first.*along, lo, half);
+        if (which != Half(entry.range.last.*along, lo, half)) { break; }
+
+        path[depth++] = segment;
+        segment = &(*segment)->children[which];
+        lo += which ? half : 0;
+        size = half;
+    }
+
+    const auto is_entry = [&entry](const Entry &other) {
+        return other.formula == entry.formula && other.range == entry.range;
+    };
+    // the entry is among the ones with its keys
+    auto &by_first = (*segment)->by_first;
+    const auto [first_begin, first_end] = std::equal_range(
+            by_first.begin(), by_first.end(), entry, [across](const Entry &lhs, const Entry &rhs) {
+                return lhs.range.first.*across < rhs.range.first.*across;
+            });
+    const auto in_first = std::find_if(first_begin, first_end, is_entry);
+    if (in_first == first_end) { return false; }
+    by_first.erase(in_first);
+
+    auto &by_last = (*segment)->by_last;
+    const auto [last_begin, last_end] = std::equal_range(
+            by_last.begin(), by_last.end(), entry, [across](const Entry &lhs, const Entry &rhs) {
+                return lhs.range.last.*across > rhs.range.last.*across;
+            });
+    by_last.erase(std::find_if(last_begin, last_end, is_entry));
+
+    const auto is_empty = [](const Segment &node) {
+        return node.by_first.empty() && !node.children[0] && !node.children[1];
+    };
+    while (*segment && is_empty(**segment)) {
+        segment->reset();
+        if (depth == 0) { break; }
+        segment = path[--depth];
+    }
+    return true;
+}
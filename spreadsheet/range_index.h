@@ -0,0 +1,172 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class Cell;
+
+// Spatial index of the ranges formulas refer to, answering which formulas
+// have a range covering a given position. It is an MX-CIF quadtree over the
+// whole sheet: a range is stored in the smallest square of the subdivision
+// that holds it, so a lookup only visits the squares on the path from the
+// root down to the position, at most one per level.
+//
+// The ranges of a square cross its middle row or its middle column. Those
+// crossing the middle row are kept in a binary tree over the columns of the
+// square, each in the node whose middle column it crosses too, and the
+// others likewise in a tree over the rows. A lookup walks down both trees of
+// a square along the position, and in a node only reads the entries whose
+// rows (columns) reach the position, so a long column of ranges side by
+// side costs a path instead of a scan.
+//
+// The other axis of a node is not indexed: its entries all cross the middle
+// of the node's span, and those reaching the position on the sorted axis are
+// checked one by one on the other. So the worst case is still linear: k
+// ranges crossing the middle lines of one node and ending short of the
+// position along the tree's axis, like k wide ranges anchored on the same
+// split column, are all read by a lookup that reports none of them. A
+// lookup reads O(log^2 n) nodes plus, in each of them, the entries reaching
+// the position along the crossed axis.
+class RangeIndex {
+public:
+    RangeIndex() = default;
+
+    RangeIndex(const RangeIndex &) = delete;
+
+    RangeIndex &operator=(const RangeIndex &) = delete;
+
+    ~RangeIndex();
+
+    void Insert(const CellRange &range, Cell *formula);
+
+    // removes one entry equal to the given one, if there is such
+    void Erase(const CellRange &range, Cell *formula);
+
+    std::size_t Size() const {
+        return size_;
+    }
+
+    // Calls func(formula) for every entry whose range covers pos: a formula
+    // with several such ranges is passed once for each of them.
+    template <class Func>
+    void ForEachCovering(Position pos, Func func) const;
+
+private:
+    // the sheet fits into the root square, whose side is a power of two
+    static constexpr int ROOT_SIZE = Position::MAX_ROWS > Position::MAX_COLS ? Position::MAX_ROWS : Position::MAX_COLS;
+    // the deepest path of either tree, down to squares of one cell
+    static constexpr std::size_t MAX_DEPTH = 16;
+
+    static_assert((ROOT_SIZE & (ROOT_SIZE - 1)) == 0);
+    static_assert(ROOT_SIZE < (1 << MAX_DEPTH));
+
+    struct Entry {
+        CellRange range;
+        Cell *formula;
+    };
+
+    // A node of the tree over one axis of a square, holding the entries
+    // that cross its middle line of the other axis. The same entries are
+    // sorted twice by that other axis: by_first by where they begin and
+    // by_last by where they end, descending.
+    struct Segment {
+        std::vector<Entry> by_first;
+        std::vector<Entry> by_last;
+        // the lower and the upper half
+        std::array<std::unique_ptr<Segment>, 2> children;
+    };
+
+    struct Node {
+        // the entries crossing the middle row, over the columns
+        std::unique_ptr<Segment> across_rows;
+        // the other ones, crossing the middle column, over the rows
+        std::unique_ptr<Segment> across_cols;
+        // in the order top-left, top-right, bottom-left, bottom-right
+        std::array<std::unique_ptr<Node>, 4> children;
+    };
+
+    // the quadrant of a square of the given half size that holds pos
+    static std::size_t Quadrant(Position pos, Position origin, int half) {
+        return (pos.row >= origin.row + half ? 2 : 0) + (pos.col >= origin.col + half ? 1 : 0);
+    }
+
+    static Position ChildOrigin(Position origin, int half, std::size_t quadrant) {
+        return Position{origin.row + (quadrant >= 2 ? half : 0), origin.col + (quadrant % 2 == 1 ? half : 0)};
+    }
+
+    // the half of a segment starting at lo that holds the coordinate
+    static std::size_t Half(int coordinate, int lo, int half) {
+        return coordinate >= lo + half ? 1 : 0;
+    }
+
+    // Calls func for the entries of the segment tree that cover pos. The
+    // tree splits [lo, lo + size) of the along axis, and its entries cross
+    // line on the other one, the across axis.
+    template <int Position::*along, int Position::*across, class Func>
+    static void ForEachCoveringIn(const Segment *segment, int lo, int size, int line, Position pos, Func &func);
+
+    static void InsertInto(std::unique_ptr<Segment> &root, int Position::*along, int Position::*across, int lo,
+                           int size, const Entry &entry);
+
+    // false if there is no such entry
+    static bool EraseFrom(std::unique_ptr<Segment> &root, int Position::*along, int Position::*across, int lo,
+                          int size, const Entry &entry);
+
+    Node root_;
+    std::size_t size_ = 0;
+};
+
+template <int Position::*along, int Position::*across, class Func>
+void RangeIndex::ForEachCoveringIn(const Segment *segment, int lo, int size, int line, Position pos, Func &func) {
+    // every entry reaches line, so only the side of pos has to be checked
+    // on the across axis, and the sorted entries stop at the first miss;
+    // the along axis is checked entry by entry
+    const int coordinate = pos.*across;
+    const int other = pos.*along;
+    const auto covers = [other](const Entry &entry) {
+        return entry.range.first.*along <= other && entry.range.last.*along >= other;
+    };
+    while (segment) {
+        if (coordinate < line) {
+            for (const auto &entry: segment->by_first) {
+                if (entry.range.first.*across > coordinate) { break; }
+                if (covers(entry)) { func(entry.formula); }
+            }
+        } else {
+            for (const auto &entry: segment->by_last) {
+                if (entry.range.last.*across < coordinate) { break; }
+                if (covers(entry)) { func(entry.formula); }
+            }
+        }
+        if (size == 1) { break; }
+
+        size /= 2;
+        const auto half = Half(other, lo, size);
+        lo += half ? size : 0;
+        segment = segment->children[half].get();
+    }
+}
+
+template <class Func>
+void RangeIndex::ForEachCovering(Position pos, Func func) const {
+    const Node *node = &root_;
+    Position origin{0, 0};
+    int size = ROOT_SIZE;
+    while (node) {
+        const int half = size / 2;
+        ForEachCoveringIn<&Position::col, &Position::row>(node->across_rows.get(), origin.col, size,
+                                                          origin.row + half, pos, func);
+        ForEachCoveringIn<&Position::row, &Position::col>(node->across_cols.get(), origin.row, size,
+                                                          origin.col + half, pos, func);
+        if (size == 1) { break; }
+
+        const auto quadrant = Quadrant(pos, origin, half);
+        origin = ChildOrigin(origin, half, quadrant);
+        node = node->children[quadrant].get();
+        size = half;
+    }
+}
@@ -1,128 +1,445 @@
-#include "common.h"
-#include "sheet.h"
-#include "cell.h"
-
-#include <functional>
-#include <iostream>
-#include <optional>
-
-using namespace std::literals;
-
-
-void Sheet::SetCell(Position pos, std::string text) {
-    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
-
-    auto pos_it = data_.find(pos);
-    if (pos_it == data_.end()) {
-        pos_it = data_.emplace(pos, std::make_unique<Cell>(*this, pos)).first;
-    }
-    pos_it->second->Set(std::move(text));
-
-}
-
-const CellInterface *Sheet::GetCell(Position pos) const {
-    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
-
-    if (const auto pos_it = data_.find(pos);pos_it == data_.end()) { return nullptr; }
-    else { return pos_it->second.get(); }
-}
-
-CellInterface *Sheet::GetCell(Position pos) {
-    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
-
-    if (const auto pos_it = data_.find(pos);pos_it == data_.end()) { return nullptr; }
-    else { return pos_it->second.get(); }
-}
-
-void Sheet::ClearCell(Position pos) {
-    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
-
-    if (const auto pos_it = data_.find(pos); pos_it != data_.end()) {
-        pos_it->second->Clear();
-        if (!pos_it->second->IsReferenced()) { data_.erase(pos_it); }
-    }
-
-}
-
-Size Sheet::GetPrintableSize() const {
-    int rows = 0, cols = 0;
-    for (const auto &[pos, ptr]: data_) {
-        if (ptr) {
-            if (pos.row >= rows) { rows = pos.row + 1; }
-            if (pos.col >= cols) { cols = pos.col + 1; }
-        }
-    }
-    return {rows, cols};
-}
-
-void Sheet::PrintValues(std::ostream &output) const {
-    const Size printable_size = GetPrintableSize();
-    if (printable_size == Size{0, 0}) { return; }
-    bool first_line = true;
-
-    for (int row = 0; row < printable_size.rows; ++row) {
-        if (!first_line) { output << "\n"; }
-        else { first_line = false; }
-
-        bool first_cell = true;
-        for (int col = 0; col < printable_size.cols; ++col) {
-            if (!first_cell) { output << "\t"; }
-            else { first_cell = false; }
-
-            if (const auto pos_it = data_.find({row, col}); pos_it != data_.end()) {
-                const auto val = pos_it->second->GetValue();
-                if (std::holds_alternative<double>(val)) {
-                    output << std::get<double>(val);
-                } else if (std::holds_alternative<FormulaError>(val)) {
-                    output << std::get<FormulaError>(val);
-                } else if (std::holds_alternative<std::string>(val)) {
-                    output << std::get<std::string>(val);
-                }
-            }
-        }
-    }
-    output << "\n";
-}
-
-void Sheet::PrintTexts(std::ostream &output) const {
-    const Size printable_size = GetPrintableSize();
-    if (printable_size == Size{0, 0}) { return; }
-
-    bool first_line = true;
-
-    for (int row = 0; row < printable_size.rows; ++row) {
-        if (!first_line) { output << "\n"; }
-        else { first_line = false; }
-
-        bool first_cell = true;
-        for (int col = 0; col < printable_size.cols; ++col) {
-            if (!first_cell) { output << "\t"; }
-            else { first_cell = false; }
-
-            if (const auto pos_it = data_.find({row, col}); pos_it != data_.end()) {
-                output << pos_it->second->GetText();
-            }
-        }
-    }
-    output << "\n";
-
-}
-
-const Cell *Sheet::GetCellPtr(Position pos) const {
-    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
-
-    if (const auto pos_it = data_.find(pos);pos_it == data_.end()) { return nullptr; }
-    else { return pos_it->second.get(); }
-}
-
-
-Cell *Sheet::GetCellPtr(Position pos) {
-    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
-
-    if (const auto pos_it = data_.find(pos);pos_it == data_.end()) { return nullptr; }
-    else { return pos_it->second.get(); }
-}
-
-std::unique_ptr<SheetInterface> CreateSheet() {
-    return std::make_unique<Sheet>();
+#include "common.h"
+#include "sheet.h"
+#include "cell.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <locale>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std::literals;
+
+BufferedWriter::BufferedWriter(std::ostream &output)
+        : output_(output), buffer_(new char[BUFFER_SIZE]),
+          default_number_format_((output.flags() & (std::ios_base::floatfield | std::ios_base::showpos
+                                                    | std::ios_base::showpoint | std::ios_base::uppercase)) == 0
+                                 && output.getloc() == std::locale::classic()) {
+}
+
+void BufferedWriter::Write(std::string_view str) {
+    while (!str.empty()) {
+        if (used_ == BUFFER_SIZE) { Flush(); }
+        const auto count = std::min(str.size(), BUFFER_SIZE - used_);
+        std::memcpy(buffer_.get() + used_, str.data(), count);
+        used_ += count;
+        str.remove_prefix(count);
+    }
+}
+
+void BufferedWriter::Fill(char c, std::size_t count) {
+    while (count > 0) {
+        if (used_ == BUFFER_SIZE) { Flush(); }
+        const auto run = std::min(count, BUFFER_SIZE - used_);
+        std::memset(buffer_.get() + used_, c, run);
+        used_ += run;
+        count -= run;
+    }
+}
+
+void BufferedWriter::WriteNumber(double value) {
+    if (!default_number_format_) {
+        // let the stream apply its own flags
+        std::ostringstream formatted;
+        formatted.copyfmt(output_);
+        formatted << value;
+        Write(formatted.str());
+        return;
+    }
+
+    // the same as operator<< does with the default flags: %g with the stream precision
+    char buf[64];
+    const auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::general,
+                                         static_cast<int>(output_.precision()));
+    Write(std::string_view(buf, ec == std::errc{} ? end - buf : 0));
+}
+
+void BufferedWriter::Flush() {
+    output_.write(buffer_.get(), static_cast<std::streamsize>(used_));
+    used_ = 0;
+}
+
+void LineCounts::Increment(int line) {
+    if (counts_.empty()) {
+        counts_.resize(size_);
+        lines_.resize((size_ + WORD_BITS - 1) / WORD_BITS);
+        words_.resize((lines_.size() + WORD_BITS - 1) / WORD_BITS);
+    }
+
+    if (counts_[line]++ == 0) {
+        const int word = line / WORD_BITS;
+        lines_[word] |= Word{1} << (line % WORD_BITS);
+        words_[word / WORD_BITS] |= Word{1} << (word % WORD_BITS);
+    }
+}
+
+void LineCounts::Decrement(int line) {
+    if (--counts_[line] == 0) {
+        const int word = line / WORD_BITS;
+        lines_[word] &= ~(Word{1} << (line % WORD_BITS));
+        if (lines_[word] == 0) { words_[word / WORD_BITS] &= ~(Word{1} << (word % WORD_BITS)); }
+    }
+}
+
+int LineCounts::GetEnd() const {
+    for (int summary = static_cast<int>(words_.size()) - 1; summary >= 0; --summary) {
+        if (words_[summary] == 0) { continue; }
+        const int word = summary * WORD_BITS + HighestBit(words_[summary]);
+        return word * WORD_BITS + HighestBit(lines_[word]) + 1;
+    }
+    return 0;
+}
+
+
+void Sheet::SetCell(Position pos, std::string text) {
+    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
+
+    auto cell = data_.Find(pos);
+    if (!cell) {
+        cell = data_.Emplace(pos, *this);
+    }
+
+    const bool was_empty = cell->IsEmpty();
+    // the journal logs the text once the edit has succeeded
+    if (!cell->Set(journal_ ? text : std::move(text))) { return; }
+    if (was_empty != cell->IsEmpty()) {
+        if (was_empty) { OnFilled(pos); }
+        else { OnEmptied(pos); }
+    }
+
+    if (journal_) { OnJournaled(journal_->Append(Journal::Operation::Set, pos, text)); }
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    for (const auto &[pos, text]: cells) {
+        if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
+    }
+
+    // keep the last text of every position
+    const auto by_position = [](const auto &lhs, const auto &rhs) {
+        return lhs.first < rhs.first;
+    };
+    if (!std::is_sorted(cells.begin(), cells.end(), by_position)) {
+        std::stable_sort(cells.begin(), cells.end(), by_position);
+    }
+    const auto last = std::unique(cells.rbegin(), cells.rend(), [](const auto &lhs, const auto &rhs) {
+        return lhs.first == rhs.first;
+    });
+    cells.erase(cells.begin(), last.base());
+
+    std::vector<std::pair<Position, std::string>> logged;
+    if (journal_) { logged = cells; }
+
+    std::vector<Position> positions;
+    std::vector<Cell::Change> changes;
+    positions.reserve(cells.size());
+    changes.reserve(cells.size());
+    for (auto &[pos, text]: cells) {
+        positions.push_back(pos);
+        changes.push_back(Cell::Change{nullptr, std::move(text), nullptr});
+    }
+    const auto changed = SetDistinctCells(positions, std::move(changes));
+
+    if (journal_) { JournalChanged(std::move(logged), changed); }
+}
+
+std::vector<bool> Sheet::SetDistinctCells(const std::vector<Position> &positions, std::vector<Cell::Change> changes) {
+    std::vector<bool> was_empty;
+    std::vector<Position> created;
+    was_empty.reserve(positions.size());
+    for (std::size_t i = 0; i < positions.size(); ++i) {
+        const auto pos = positions[i];
+        auto cell = data_.Find(pos);
+        if (!cell) {
+            cell = data_.Emplace(pos, *this);
+            created.push_back(pos);
+        }
+        was_empty.push_back(cell->IsEmpty());
+        changes[i].cell = cell;
+    }
+
+    std::vector<bool> changed;
+    try {
+        changed = Cell::SetMany(std::move(changes));
+    } catch (...) {
+        for (const auto pos: created) {
+            const auto cell = data_.Find(pos);
+            if (!cell->IsReferenced()) { data_.Erase(pos); }
+        }
+        throw;
+    }
+
+    for (std::size_t i = 0; i < positions.size(); ++i) {
+        const auto pos = positions[i];
+        const bool is_empty = data_.Find(pos)->IsEmpty();
+        if (was_empty[i] != is_empty) {
+            if (was_empty[i]) { OnFilled(pos); }
+            else { OnEmptied(pos); }
+        }
+    }
+    return changed;
+}
+
+void Sheet::JournalChanged(std::vector<std::pair<Position, std::string>> edits, const std::vector<bool> &changed) {
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < edits.size(); ++i) {
+        if (!changed[i]) { continue; }
+        if (kept != i) { edits[kept] = std::move(edits[i]); }
+        ++kept;
+    }
+    if (kept == 0) { return; }
+
+    edits.resize(kept);
+    OnJournaled(journal_->Append(Journal::Operation::SetMany, edits));
+}
+
+const CellInterface *Sheet::GetCell(Position pos) const {
+    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
+
+    return data_.Find(pos);
+}
+
+CellInterface *Sheet::GetCell(Position pos) {
+    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
+
+    return data_.Find(pos);
+}
+
+void Sheet::ClearCell(Position pos) {
+    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
+
+    if (const auto cell = data_.Find(pos)) {
+        const bool was_empty = cell->IsEmpty();
+        cell->Clear();
+        if (!was_empty) { OnEmptied(pos); }
+        if (!cell->IsReferenced()) { data_.Erase(pos); }
+
+        // clearing an empty cell changes nothing to replay
+        if (journal_ && !was_empty) { OnJournaled(journal_->Append(Journal::Operation::Clear, pos, {})); }
+    }
+}
+
+Size Sheet::GetPrintableSize() const {
+    return printable_size_;
+}
+
+void Sheet::OnFilled(Position pos) {
+    row_counts_.Increment(pos.row);
+    col_counts_.Increment(pos.col);
+    printable_size_.rows = std::max(printable_size_.rows, pos.row + 1);
+    printable_size_.cols = std::max(printable_size_.cols, pos.col + 1);
+}
+
+void Sheet::OnEmptied(Position pos) {
+    row_counts_.Decrement(pos.row);
+    col_counts_.Decrement(pos.col);
+    printable_size_ = Size{row_counts_.GetEnd(), col_counts_.GetEnd()};
+}
+
+void Sheet::PrintValues(std::ostream &output) const {
+    PrintCells(output, [](const Cell &cell, BufferedWriter &writer) {
+        const auto val = cell.GetValue();
+        if (std::holds_alternative<double>(val)) {
+            writer.WriteNumber(std::get<double>(val));
+        } else if (std::holds_alternative<FormulaError>(val)) {
+            writer.Write(std::get<FormulaError>(val).ToString());
+        } else if (std::holds_alternative<std::string>(val)) {
+            writer.Write(std::get<std::string>(val));
+        }
+    });
+}
+
+void Sheet::PrintTexts(std::ostream &output) const {
+    PrintCells(output, [](const Cell &cell, BufferedWriter &writer) {
+        writer.Write(cell.GetTextRef());
+    });
+}
+
+template <class PrintCell>
+void Sheet::PrintCells(std::ostream &output, PrintCell print_cell) const {
+    const Size size = GetPrintableSize();
+    if (size == Size{0, 0}) { return; }
+
+    BufferedWriter writer(output);
+
+    // the writer stands in row `row` right after the field of column `col`
+    int row = 0, col = 0;
+    const auto finish_row = [&] {
+        writer.Fill('\t', static_cast<std::size_t>(size.cols - 1 - col));
+        writer.Fill('\n', 1);
+        ++row;
+        col = 0;
+    };
+
+    data_.ForEach([&](const Position pos, const Cell &cell) {
+        // referenced cells without text may lie outside of the printable area
+        if (cell.IsEmpty()) { return; }
+
+        while (row < pos.row) { finish_row(); }
+        writer.Fill('\t', static_cast<std::size_t>(pos.col - col));
+        col = pos.col;
+        print_cell(cell, writer);
+    });
+
+    while (row < size.rows) { finish_row(); }
+    writer.Flush();
+}
+
+void Sheet::RecalculateAll(std::size_t thread_count) {
+    // formulas to evaluate; the ones depending on them have no cache either
+    std::vector<Cell *> stale;
+    data_.ForEach([&](Position, const Cell &cell) {
+        if (cell.NeedsEvaluation()) { stale.push_back(const_cast<Cell *>(&cell)); }
+    });
+    if (stale.empty()) { return; }
+
+    // Kahn's algorithm: a formula is ready once all the stale formulas it
+    // refers to are evaluated, and every ready formula of a level only
+    // reads the caches filled by the previous levels
+    std::unordered_map<const Cell *, std::size_t> waiting_for;
+    waiting_for.reserve(stale.size());
+    for (const auto cell: stale) { waiting_for.emplace(cell, 0); }
+
+    std::vector<Cell *> level;
+    for (const auto cell: stale) {
+        auto &count = waiting_for[cell];
+        for (const auto dep: cell->GetDependencies()) {
+            if (dep->NeedsEvaluation()) { ++count; }
+        }
+        if (count == 0) { level.push_back(cell); }
+    }
+
+    auto &pool = GetThreadPool(thread_count);
+
+    // a chunk should be worth waking a thread for
+    constexpr std::size_t GRAIN = 256;
+    std::vector<Cell *> next_level;
+    while (!level.empty()) {
+        pool.ParallelFor(level.size(), GRAIN, [&level](std::size_t begin, std::size_t end) {
+            for (auto i = begin; i < end; ++i) {
+                level[i]->GetValue();
+            }
+        });
+
+        next_level.clear();
+        for (const auto cell: level) {
+            cell->ForEachDependent([&](Cell *dependent) {
+                const auto it = waiting_for.find(dependent);
+                if (it != waiting_for.end() && --it->second == 0) { next_level.push_back(dependent); }
+            });
+        }
+        level.swap(next_level);
+    }
+}
+
+ThreadPool &Sheet::GetThreadPool(std::size_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (!thread_pool_ || thread_pool_->GetThreadCount() != thread_count) {
+        thread_pool_ = std::make_unique<ThreadPool>(thread_count);
+    }
+    return *thread_pool_;
+}
+
+SheetStats Sheet::GetStats() const {
+    SheetStats stats;
+    counters_.Fill(stats);
+
+    data_.ForEach([&](Position, const Cell &cell) {
+        if (cell.IsEmpty()) {
+            ++stats.empty_cells;
+        } else if (cell.IsFormula()) {
+            ++stats.formula_cells;
+            stats.cache_bytes += cell.HasCache() ? sizeof(FormulaInterface::Value) : 0;
+        } else {
+            ++stats.text_cells;
+        }
+    });
+    stats.ast_bytes = formula_interner_.GetMemoryUsage();
+    stats.numeric_column_bytes = numeric_columns_.GetMemoryUsage();
+    return stats;
+}
+
+std::unique_ptr<Sheet> Sheet::Recover(const std::string &snapshot_path, const std::string &journal_path,
+                                      Journal::Options options) {
+    auto sheet = std::filesystem::exists(snapshot_path) ? LoadSnapshot(snapshot_path) : std::make_unique<Sheet>();
+    auto journal = std::make_unique<Journal>(journal_path, options);
+    if (journal->GetBaseLsn() > sheet->lsn_) {
+        throw JournalException("Journal " + journal_path + " starts after the edits of " + snapshot_path);
+    }
+
+    // the edits were logged once they succeeded, so they succeed again
+    journal->Replay(sheet->lsn_, [&sheet](const Journal::Record &record) {
+        try {
+            switch (record.operation) {
+                case Journal::Operation::Set:
+                    sheet->SetCell(record.cells.at(0).first, record.cells.at(0).second);
+                    break;
+                case Journal::Operation::Clear:
+                    sheet->ClearCell(record.cells.at(0).first);
+                    break;
+                case Journal::Operation::SetMany:
+                    sheet->SetCells(record.cells);
+                    break;
+            }
+        } catch (const std::exception &e) {
+            throw JournalException("Cannot replay journal record " + std::to_string(record.lsn) + ": " + e.what());
+        }
+        sheet->lsn_ = record.lsn;
+    });
+
+    // a snapshot saved after the journal was written
+    if (journal->GetLastLsn() < sheet->lsn_) { journal->Reset(sheet->lsn_); }
+
+    sheet->journal_ = std::move(journal);
+    sheet->snapshot_path_ = snapshot_path;
+    return sheet;
+}
+
+void Sheet::Checkpoint() {
+    if (!journal_) { throw JournalException("The sheet has no journal"); }
+
+    // the snapshot is on disk before the journal is emptied
+    SaveSnapshot(snapshot_path_);
+    journal_->Reset(lsn_);
+}
+
+void Sheet::SyncJournal() {
+    if (journal_) { journal_->Sync(); }
+}
+
+void Sheet::OnJournaled(std::uint64_t lsn) {
+    lsn_ = lsn;
+    const auto &options = journal_->GetOptions();
+    if (options.wait_for_commit) { journal_->WaitForCommit(lsn); }
+    if (options.checkpoint_bytes > 0 && journal_->GetSize() >= options.checkpoint_bytes) { Checkpoint(); }
+}
+
+Cell *Sheet::CreateEmptyCell(Position pos) {
+    return data_.Emplace(pos, *this);
+}
+
+const Cell *Sheet::GetCellPtr(Position pos) const {
+    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
+
+    return data_.Find(pos);
+}
+
+
+Cell *Sheet::GetCellPtr(Position pos) {
+    if (!pos.IsValid()) { throw InvalidPositionException("Invalid position"); }
+
+    return data_.Find(pos);
+}
+
+std::unique_ptr<SheetInterface> CreateSheet() {
+    return std::make_unique<Sheet>();
 }
\ No newline at end of file
@@ -1,42 +1,263 @@
-#pragma once
-#include "common.h"
-#include "cell.h"
-
-#include <functional>
-
-struct PositionHash {
-    std::size_t operator()(const Position &pos) const {
-        return std::hash<int>{}(pos.row) + 37 * std::hash<int>{}(pos.col);
-    }
-};
-
-using SheetData = std::unordered_map<Position, std::unique_ptr<Cell>, PositionHash>;
-
-class Sheet : public SheetInterface {
-public:
-
-    ~Sheet() = default;
-
-    void SetCell(Position pos, std::string text) override;
-
-    const CellInterface *GetCell(Position pos) const override;
-
-    CellInterface *GetCell(Position pos) override;
-
-    void ClearCell(Position pos) override;
-
-    Size GetPrintableSize() const override;
-
-    void PrintValues(std::ostream &output) const override;
-
-    void PrintTexts(std::ostream &output) const override;
-
-    // Можете дополнить ваш класс нужными полями и методами
-
-    const Cell *GetCellPtr(Position pos) const;
-
-    Cell *GetCellPtr(Position pos);
-
-private:
-    SheetData data_;
+#pragma once
+#include "common.h"
+#include "cell.h"
+#include "journal.h"
+#include "numeric_columns.h"
+#include "stats.h"
+#include "sheet_data.h"
+#include "thread_pool.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Formats the printed sheet into a large buffer and passes it to the stream
+// in chunks instead of going through operator<< for every field.
+class BufferedWriter {
+public:
+    static constexpr std::size_t BUFFER_SIZE = 64 * 1024;
+
+    explicit BufferedWriter(std::ostream &output);
+
+    void Write(std::string_view str);
+
+    // writes a run of count copies of c
+    void Fill(char c, std::size_t count);
+
+    // formats the number exactly as output << value would
+    void WriteNumber(double value);
+
+    void Flush();
+
+private:
+    std::ostream &output_;
+    std::unique_ptr<char[]> buffer_;
+    std::size_t used_ = 0;
+    bool default_number_format_;
+};
+
+// The number of non-empty cells in each of the rows (or columns) of the
+// sheet. A bitmap marks the lines with a non-zero count and a summary bitmap
+// the words of it that are not zero, so the last non-empty line is found in
+// a few word reads. Allocated with the first cell.
+class LineCounts {
+public:
+    explicit LineCounts(int size) : size_(size) {
+    }
+
+    void Increment(int line);
+
+    void Decrement(int line);
+
+    // one past the last line with a non-zero count, 0 if there is none
+    int GetEnd() const;
+
+private:
+    using Word = std::uint64_t;
+    static constexpr int WORD_BITS = 64;
+
+    // the index of the highest set bit of a non-zero word
+    static int HighestBit(Word bits) {
+#ifdef __GNUC__
+        return WORD_BITS - 1 - __builtin_clzll(bits);
+#else
+        int index = 0;
+        for (; bits >>= 1;) { ++index; }
+        return index;
+#endif
+    }
+
+    int size_;
+    std::vector<int> counts_;
+    // a bit per line and a bit per word of those
+    std::vector<Word> lines_;
+    std::vector<Word> words_;
+};
+
+// A snapshot file that cannot be written, read or makes no sense.
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class Sheet : public SheetInterface {
+public:
+
+    ~Sheet() = default;
+
+    void SetCell(Position pos, std::string text) override;
+
+    // Sets many cells as a single edit: for the same position the last
+    // text wins, and if any of them throws, the sheet is left unchanged.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    const CellInterface *GetCell(Position pos) const override;
+
+    CellInterface *GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream &output) const override;
+
+    void PrintTexts(std::ostream &output) const override;
+
+    // Можете дополнить ваш класс нужными полями и методами
+
+    const Cell *GetCellPtr(Position pos) const;
+
+    Cell *GetCellPtr(Position pos);
+
+    // Stores an empty cell at pos, which has to be free, for a formula that
+    // refers to it. Unlike SetCell this is no edit of its own and is not
+    // journaled.
+    Cell *CreateEmptyCell(Position pos);
+
+    SizeClassPool &GetPool() {
+        return pool_;
+    }
+
+    FormulaInterner &GetFormulaInterner() {
+        return formula_interner_;
+    }
+
+    // the ranges of all the formulas, to find the ones covering a cell
+    RangeIndex &GetRangeIndex() {
+        return range_index_;
+    }
+
+    const RangeIndex &GetRangeIndex() const {
+        return range_index_;
+    }
+
+    // Counters of the engine and the make-up of the sheet. Walks all the
+    // cells, the counters themselves are bumped as the engine runs.
+    SheetStats GetStats() const;
+
+    EngineCounters &GetCounters() {
+        return counters_;
+    }
+
+    // the numbers of the cells by column, kept in sync by the cells
+    NumericColumns &GetNumericColumns() {
+        return numeric_columns_;
+    }
+
+    const NumericColumns &GetNumericColumns() const {
+        return numeric_columns_;
+    }
+
+    // calls func(cell) for the stored cells of the range, row by row
+    template <class Func>
+    void ForEachCellInRange(const CellRange &range, Func func) const {
+        data_.ForEachInRange(range, [&func](Position, Cell &cell) { func(cell); });
+    }
+
+    // Writes the sheet into a binary snapshot file: the texts go into a
+    // string pool, every formula shape is stored once as its tree, the
+    // formulas refer to their cells by index and, with with_values, the
+    // cached values are stored too. The file is replaced atomically.
+    void SaveSnapshot(const std::string &path, bool with_values = true) const;
+
+    // Maps a snapshot file and rebuilds the sheet from it without parsing a
+    // formula. Throws SnapshotException if the file is not a valid snapshot.
+    static std::unique_ptr<Sheet> LoadSnapshot(const std::string &path);
+
+    // Recovers a sheet kept durable by a journal: loads the snapshot at
+    // snapshot_path if there is one, replays the journaled edits it does not
+    // include yet and from then on logs every SetCell, SetCells and
+    // ClearCell into the journal. Checkpoint writes the snapshot.
+    static std::unique_ptr<Sheet> Recover(const std::string &snapshot_path, const std::string &journal_path,
+                                          Journal::Options options = {});
+
+    // Saves the snapshot with all the journaled edits and empties the
+    // journal, so that recovery only replays what comes after. Runs on its
+    // own once the journal outgrows options.checkpoint_bytes.
+    void Checkpoint();
+
+    // blocks until the journaled edits are on disk
+    void SyncJournal();
+
+    // Reads a grid of texts, one row per line (ended by LF or CRLF) with the
+    // fields separated by delimiter, into the cells from A1 on as a single
+    // edit like SetCells. Empty fields leave their cells as they are. The
+    // data is split into chunks of lines that are tokenized and parsed on
+    // thread_count threads (0 means one per hardware thread); only wiring the
+    // parsed cells into the graph runs on one thread. Into an empty sheet
+    // this is the inverse of PrintTexts, as long as no text holds a tab or a
+    // line break.
+    void ImportTexts(std::string_view data, char delimiter = '\t', std::size_t thread_count = 0);
+
+    // ImportTexts of a mapped file; throws std::runtime_error if it cannot
+    // be read
+    void ImportTextsFile(const std::string &path, char delimiter = '\t', std::size_t thread_count = 0);
+
+    // Evaluates every formula without a cached value, level by level of the
+    // dependency graph, with the formulas of one level spread over
+    // thread_count threads (0 means one per hardware thread).
+    void RecalculateAll(std::size_t thread_count = 0);
+
+    // Fresh positions in the topological order of the cells, above or below
+    // all the taken ones. Either is valid for a cell without edges.
+    std::int64_t TakeOrderAbove() {
+        return ++top_order_;
+    }
+
+    std::int64_t TakeOrderBelow() {
+        return --bottom_order_;
+    }
+
+private:
+    // prints every cell inside the printable area, visiting only the stored ones
+    template <class PrintCell>
+    void PrintCells(std::ostream &output, PrintCell print_cell) const;
+
+    // keep the per-row and per-column counts of non-empty cells
+    void OnFilled(Position pos);
+
+    void OnEmptied(Position pos);
+
+    // SetCells for sorted distinct valid positions, whose formulas may come
+    // parsed already; returns for every position whether its text changed
+    std::vector<bool> SetDistinctCells(const std::vector<Position> &positions, std::vector<Cell::Change> changes);
+
+    // the edits of SetDistinctCells that changed a cell into the journal
+    void JournalChanged(std::vector<std::pair<Position, std::string>> edits, const std::vector<bool> &changed);
+
+    // the pool for thread_count threads (0 means one per hardware thread)
+    ThreadPool &GetThreadPool(std::size_t thread_count);
+
+    // waits for the commit or checkpoints as the journal options ask
+    void OnJournaled(std::uint64_t lsn);
+
+    // declared first so that it outlives every cell allocated from it
+    SizeClassPool pool_;
+    EngineCounters counters_;
+    // outlives the cells too, formulas leave it when destroyed
+    RangeIndex range_index_;
+    NumericColumns numeric_columns_;
+    SheetData data_{pool_};
+    FormulaInterner formula_interner_{&counters_};
+
+    // the printable area is the box up to the last non-zero counts
+    LineCounts row_counts_{Position::MAX_ROWS};
+    LineCounts col_counts_{Position::MAX_COLS};
+    Size printable_size_;
+
+    std::int64_t top_order_ = 0;
+    std::int64_t bottom_order_ = 0;
+
+    // created by the first RecalculateAll and kept for the next ones
+    std::unique_ptr<ThreadPool> thread_pool_;
+
+    // set by Recover; lsn_ is the last journaled edit the sheet includes
+    std::unique_ptr<Journal> journal_;
+    std::string snapshot_path_;
+    std::uint64_t lsn_ = 0;
 };
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "sheet_data.h"
+
+#include <algorithm>
+#include <cassert>
+
+SheetData::~SheetData() {
+    for (auto &tile: tiles_) {
+        if (!tile) { continue; }
+        for (auto cell: tile->cells) {
+            if (cell) { DestroyCell(cell); }
+        }
+    }
+}
+
+Cell *SheetData::Find(Position pos) const {
+    if (size_ == 0) { return nullptr; }
+
+    const auto &tile = tiles_[TileIndex(pos)];
+    return tile ? tile->cells[SlotIndex(pos)] : nullptr;
+}
+
+Cell *SheetData::Emplace(Position pos, Sheet &sheet) {
+    if (tiles_.empty()) {
+        tiles_.resize(static_cast<std::size_t>(TILE_ROWS) * TILE_COLS);
+        tile_cols_.resize(TILE_ROWS);
+    }
+
+    auto &tile = tiles_[TileIndex(pos)];
+    if (!tile) {
+        tile = std::make_unique<Tile>();
+
+        auto &cols = tile_cols_[pos.row / TILE_SIZE];
+        const int tile_col = pos.col / TILE_SIZE;
+        cols.insert(std::lower_bound(cols.begin(), cols.end(), tile_col), tile_col);
+    }
+
+    auto &slot = tile->cells[SlotIndex(pos)];
+    assert(!slot);
+
+    void *memory = pool_.Allocate(sizeof(Cell));
+    try {
+        slot = new(memory) Cell(sheet, pos);
+    } catch (...) {
+        pool_.Deallocate(memory, sizeof(Cell));
+        throw;
+    }
+    ++tile->count;
+    ++size_;
+    return slot;
+}
+
+void SheetData::Erase(Position pos) {
+    if (size_ == 0) { return; }
+
+    auto &tile = tiles_[TileIndex(pos)];
+    if (!tile) { return; }
+
+    auto &slot = tile->cells[SlotIndex(pos)];
+    if (!slot) { return; }
+
+    DestroyCell(slot);
+    slot = nullptr;
+    --size_;
+    if (--tile->count == 0) {
+        tile.reset();
+
+        auto &cols = tile_cols_[pos.row / TILE_SIZE];
+        cols.erase(std::lower_bound(cols.begin(), cols.end(), pos.col / TILE_SIZE));
+    }
+}
+
+void SheetData::DestroyCell(Cell *cell) {
+    cell->~Cell();
+    pool_.Deallocate(cell, sizeof(Cell));
+}
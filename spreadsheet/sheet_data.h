@@ -0,0 +1,137 @@
+#pragma once
+
+#include "common.h"
+#include "cell.h"
+#include "pool_allocator.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
+
+// Sparse cell storage split into square tiles that are allocated on first
+// use. A lookup is index arithmetic into the tile directory and the tile, and
+// a row-major walk reads every tile row as a contiguous run of slots.
+// The cells themselves are allocated from the sheet's pool.
+class SheetData {
+public:
+    static constexpr int TILE_SIZE = 64;
+
+    explicit SheetData(SizeClassPool &pool) : pool_(pool) {
+    }
+
+    SheetData(const SheetData &) = delete;
+
+    SheetData &operator=(const SheetData &) = delete;
+
+    ~SheetData();
+
+    Cell *Find(Position pos) const;
+
+    // Creates an empty cell at a free position and returns it.
+    Cell *Emplace(Position pos, Sheet &sheet);
+
+    void Erase(Position pos);
+
+    std::size_t Size() const {
+        return size_;
+    }
+
+    // Calls func(pos, cell) for every stored cell in row-major order.
+    template <class Func>
+    void ForEach(Func func) const;
+
+    // Calls func(pos, cell) for every stored cell of the range in row-major
+    // order, skipping the tiles that were never allocated.
+    template <class Func>
+    void ForEachInRange(const CellRange &range, Func func) const;
+
+private:
+    static constexpr int TILE_ROWS = (Position::MAX_ROWS + TILE_SIZE - 1) / TILE_SIZE;
+    static constexpr int TILE_COLS = (Position::MAX_COLS + TILE_SIZE - 1) / TILE_SIZE;
+
+    struct Tile {
+        std::array<Cell *, TILE_SIZE * TILE_SIZE> cells{};
+        int count = 0;
+    };
+
+    static std::size_t TileIndex(Position pos) {
+        return static_cast<std::size_t>(pos.row / TILE_SIZE) * TILE_COLS + pos.col / TILE_SIZE;
+    }
+
+    static std::size_t SlotIndex(Position pos) {
+        return static_cast<std::size_t>(pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+    }
+
+    void DestroyCell(Cell *cell);
+
+    SizeClassPool &pool_;
+    // both are allocated with the first cell
+    std::vector<std::unique_ptr<Tile>> tiles_;
+    // sorted columns of the allocated tiles in every row of tiles
+    std::vector<std::vector<int>> tile_cols_;
+    std::size_t size_ = 0;
+};
+
+template <class Func>
+void SheetData::ForEach(Func func) const {
+    if (size_ == 0) {
+        return;
+    }
+
+    for (int tile_row = 0; tile_row < TILE_ROWS; ++tile_row) {
+        const auto &cols = tile_cols_[tile_row];
+        if (cols.empty()) {
+            continue;
+        }
+
+        for (int row_in_tile = 0; row_in_tile < TILE_SIZE; ++row_in_tile) {
+            const int row = tile_row * TILE_SIZE + row_in_tile;
+            for (const int tile_col: cols) {
+                const auto &tile = *tiles_[static_cast<std::size_t>(tile_row) * TILE_COLS + tile_col];
+                const auto *slots = &tile.cells[static_cast<std::size_t>(row_in_tile) * TILE_SIZE];
+                for (int col_in_tile = 0; col_in_tile < TILE_SIZE; ++col_in_tile) {
+                    if (slots[col_in_tile]) {
+                        func(Position{row, tile_col * TILE_SIZE + col_in_tile}, *slots[col_in_tile]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <class Func>
+void SheetData::ForEachInRange(const CellRange &range, Func func) const {
+    if (size_ == 0) {
+        return;
+    }
+
+    const int first_tile_col = range.first.col / TILE_SIZE;
+    const int last_tile_col = range.last.col / TILE_SIZE;
+    for (int tile_row = range.first.row / TILE_SIZE; tile_row <= range.last.row / TILE_SIZE; ++tile_row) {
+        const auto &cols = tile_cols_[tile_row];
+        const auto cols_begin = std::lower_bound(cols.begin(), cols.end(), first_tile_col);
+        const auto cols_end = std::upper_bound(cols_begin, cols.end(), last_tile_col);
+        if (cols_begin == cols_end) {
+            continue;
+        }
+
+        const int first_row = std::max(range.first.row, tile_row * TILE_SIZE);
+        const int last_row = std::min(range.last.row, tile_row * TILE_SIZE + TILE_SIZE - 1);
+        for (int row = first_row; row <= last_row; ++row) {
+            for (auto it = cols_begin; it != cols_end; ++it) {
+                const int tile_col = *it;
+                const auto &tile = *tiles_[static_cast<std::size_t>(tile_row) * TILE_COLS + tile_col];
+                const auto *slots = &tile.cells[static_cast<std::size_t>(row % TILE_SIZE) * TILE_SIZE];
+
+                const int first_col = std::max(range.first.col, tile_col * TILE_SIZE);
+                const int last_col = std::min(range.last.col, tile_col * TILE_SIZE + TILE_SIZE - 1);
+                for (int col = first_col; col <= last_col; ++col) {
+                    if (slots[col % TILE_SIZE]) {
+                        func(Position{row, col}, *slots[col % TILE_SIZE]);
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,425 @@
+#include "sheet.h"
+
+#include "FormulaAST.h"
+#include "byte_io.h"
+#include "durable_file.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <optional>
+#include <unordered_map>
+
+// Layout of a snapshot file. Numbers are in the byte order of the machine
+// that wrote it, which BYTE_ORDER_MARK checks on load.
+//
+//   header   u32 magic, byte order mark, version, flags and the number of
+//            strings, bodies and cells, then since version 2 the u64 LSN of
+//            the last journaled edit the snapshot includes
+//   strings  u32 size and the bytes of each: the texts of the text cells and
+//            the shape keys of the bodies, every distinct one once
+//   bodies   u32 string index of the shape key or NO_INDEX, then the body as
+//            SerializeFormulaBody writes it, prefixed with its u32 size
+//   cells    in row-major order: i32 row, i32 col, i64 order, u8 kind, then
+//            a text: u32 string index, u8 has number, f64 number
+//            a formula: u32 body index, i32 offset row and column, with
+//              WITH_VALUES u8 value kind and an f64 number or u8 error
+//              category, then u32 number of the cells it refers to on their
+//              own and the u32 index of each, in the order of its references
+namespace {
+    constexpr std::uint32_t MAGIC = 0x504e5353;  // "SSNP"
+    constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+    constexpr std::uint32_t VERSION = 2;
+    // the oldest version that can still be loaded, it has no LSN
+    constexpr std::uint32_t FIRST_VERSION = 1;
+    constexpr std::uint32_t WITH_VALUES = 1;
+    constexpr std::uint32_t NO_INDEX = std::numeric_limits<std::uint32_t>::max();
+
+    // the smallest cell record, to bound the counts read from a file
+    constexpr std::size_t MIN_CELL_SIZE = 2 * sizeof(std::int32_t) + sizeof(std::int64_t) + 1;
+
+    enum class CellKind : std::uint8_t {
+        Empty,
+        Text,
+        Formula,
+    };
+
+    enum class ValueKind : std::uint8_t {
+        None,
+        Number,
+        Error,
+    };
+
+    // The highest order among the stored cells of a range: a max segment
+    // tree over the rows of the cells of every column.
+    class RangeOrders {
+    public:
+        explicit RangeOrders(std::vector<std::pair<Position, std::int64_t>> cells) {
+            std::sort(cells.begin(), cells.end(), [](const auto &lhs, const auto &rhs) {
+                return lhs.first.col < rhs.first.col
+                       || (lhs.first.col == rhs.first.col && lhs.first.row < rhs.first.row);
+            });
+            for (auto begin = cells.begin(); begin != cells.end();) {
+                const int col = begin->first.col;
+                const auto end = std::find_if(begin, cells.end(), [col](const auto &cell) {
+                    return cell.first.col != col;
+                });
+                const auto size = static_cast<std::size_t>(end - begin);
+                auto &[rows, tree] = columns_[col];
+                rows.reserve(size);
+                tree.resize(2 * size);
+                for (std::size_t i = 0; i < size; ++i) {
+                    rows.push_back(begin[i].first.row);
+                    tree[size + i] = begin[i].second;
+                }
+                for (auto i = size - 1; i > 0; --i) {
+                    tree[i] = std::max(tree[2 * i], tree[2 * i + 1]);
+                }
+                begin = end;
+            }
+        }
+
+        // LOWEST for a range without stored cells
+        std::int64_t GetMax(const CellRange &range) const {
+            auto result = LOWEST;
+            for (auto it = columns_.lower_bound(range.first.col);
+                 it != columns_.end() && it->first <= range.last.col; ++it) {
+                const auto &[rows, tree] = it->second;
+                auto lo = static_cast<std::size_t>(std::lower_bound(rows.begin(), rows.end(), range.first.row)
+                                                   - rows.begin()) + rows.size();
+                auto hi = static_cast<std::size_t>(std::upper_bound(rows.begin(), rows.end(), range.last.row)
+                                                   - rows.begin()) + rows.size();
+                for (; lo < hi; lo /= 2, hi /= 2) {
+                    if (lo & 1) { result = std::max(result, tree[lo++]); }
+                    if (hi & 1) { result = std::max(result, tree[--hi]); }
+                }
+            }
+            return result;
+        }
+
+        static constexpr std::int64_t LOWEST = std::numeric_limits<std::int64_t>::min();
+
+    private:
+        struct Column {
+            std::vector<int> rows;
+            std::vector<std::int64_t> tree;
+        };
+
+        std::map<int, Column> columns_;
+    };
+
+    // Numbers the distinct strings in the order they are first added.
+    class StringPool {
+    public:
+        std::uint32_t Add(const std::string &str) {
+            const auto [it, inserted] = index_.emplace(str, count_);
+            if (inserted) {
+                AppendString(data_, str);
+                ++count_;
+            }
+            return it->second;
+        }
+
+        std::uint32_t GetCount() const {
+            return count_;
+        }
+
+        const std::string &GetData() const {
+            return data_;
+        }
+
+    private:
+        std::unordered_map<std::string, std::uint32_t> index_;
+        std::string data_;
+        std::uint32_t count_ = 0;
+    };
+}  // namespace
+
+void Sheet::SaveSnapshot(const std::string &path, bool with_values) const {
+    std::unordered_map<const FormulaBody *, std::string_view> keys;
+    formula_interner_.ForEachShape([&keys](const std::string &key, const auto &body) {
+        keys.emplace(body.get(), key);
+    });
+
+    std::vector<const Cell *> cells;
+    std::unordered_map<const Cell *, std::uint32_t> cell_index;
+    cells.reserve(data_.Size());
+    data_.ForEach([&](Position, const Cell &cell) {
+        cell_index.emplace(&cell, static_cast<std::uint32_t>(cells.size()));
+        cells.push_back(&cell);
+    });
+
+    StringPool strings;
+    std::unordered_map<const FormulaBody *, std::uint32_t> body_index;
+    std::string bodies;
+    std::string records;
+    std::string serialized;
+    for (const auto cell: cells) {
+        AppendBytes(records, static_cast<std::int32_t>(cell->position_.row));
+        AppendBytes(records, static_cast<std::int32_t>(cell->position_.col));
+        AppendBytes(records, cell->order_);
+
+        if (const auto formula = cell->GetFormula()) {
+            const auto [body, offset] = GetFormulaBody(*formula);
+            if (!body) { throw SnapshotException("Formula without a shared body at " + cell->position_.ToString()); }
+
+            const auto [it, inserted] = body_index.emplace(body.get(), static_cast<std::uint32_t>(body_index.size()));
+            if (inserted) {
+                const auto key = keys.find(body.get());
+                AppendBytes(bodies, key == keys.end() ? NO_INDEX : strings.Add(std::string(key->second)));
+                serialized.clear();
+                SerializeFormulaBody(*body, serialized);
+                AppendString(bodies, serialized);
+            }
+
+            AppendBytes(records, CellKind::Formula);
+            AppendBytes(records, it->second);
+            AppendBytes(records, static_cast<std::int32_t>(offset.row));
+            AppendBytes(records, static_cast<std::int32_t>(offset.col));
+            if (with_values) {
+                const auto cache = cell->GetCachedValue();
+                if (!cache) {
+                    AppendBytes(records, ValueKind::None);
+                } else if (const auto number = std::get_if<double>(&*cache)) {
+                    AppendBytes(records, ValueKind::Number);
+                    AppendBytes(records, *number);
+                } else {
+                    AppendBytes(records, ValueKind::Error);
+                    AppendBytes(records, static_cast<std::uint8_t>(std::get<FormulaError>(*cache).GetCategory()));
+                }
+            }
+
+            const auto &dependencies = *cell->GetDependencyList();
+            AppendBytes(records, static_cast<std::uint32_t>(dependencies.size()));
+            for (const auto dependency: dependencies) {
+                AppendBytes(records, cell_index.at(dependency));
+            }
+        } else if (cell->IsEmpty()) {
+            AppendBytes(records, CellKind::Empty);
+        } else {
+            const auto value = cell->GetNumericValue();
+            const auto number = std::get_if<double>(&value);
+            AppendBytes(records, CellKind::Text);
+            AppendBytes(records, strings.Add(cell->GetTextRef()));
+            AppendBytes(records, static_cast<std::uint8_t>(number != nullptr));
+            AppendBytes(records, number ? *number : 0.0);
+        }
+    }
+
+    std::string header;
+    for (const auto field: {MAGIC, BYTE_ORDER_MARK, VERSION, with_values ? WITH_VALUES : 0u, strings.GetCount(),
+                            static_cast<std::uint32_t>(body_index.size()), static_cast<std::uint32_t>(cells.size())}) {
+        AppendBytes(header, field);
+    }
+    AppendBytes(header, lsn_);
+
+    // a failed save or a crash keeps the old file
+    try {
+        ReplaceFileDurably(path, {header, strings.GetData(), bodies, records});
+    } catch (const std::runtime_error &e) {
+        throw SnapshotException(e.what());
+    }
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::string &path) {
+    std::unique_ptr<MappedFile> file;
+    try {
+        file = std::make_unique<MappedFile>(path);
+    } catch (const std::runtime_error &e) {
+        throw SnapshotException(e.what());
+    }
+
+    ByteReader reader(file->GetData());
+    const auto corrupt = [&path] {
+        return SnapshotException("Corrupt snapshot " + path);
+    };
+
+    std::uint32_t magic = 0;
+    std::uint32_t byte_order = 0;
+    std::uint32_t version = 0;
+    std::uint32_t flags = 0;
+    std::uint32_t string_count = 0;
+    std::uint32_t body_count = 0;
+    std::uint32_t cell_count = 0;
+    if (!reader.Read(magic) || magic != MAGIC) { throw SnapshotException("Not a snapshot " + path); }
+    if (!reader.Read(byte_order) || byte_order != BYTE_ORDER_MARK) {
+        throw SnapshotException("Snapshot of another byte order " + path);
+    }
+    if (!reader.Read(version) || version < FIRST_VERSION || version > VERSION) {
+        throw SnapshotException("Unsupported snapshot version " + std::to_string(version) + " " + path);
+    }
+    std::uint64_t lsn = 0;
+    if (!reader.Read(flags) || !reader.Read(string_count) || !reader.Read(body_count) || !reader.Read(cell_count)
+        || (version >= 2 && !reader.Read(lsn))) {
+        throw corrupt();
+    }
+    const bool with_values = flags & WITH_VALUES;
+
+    // the views point into the mapping, which outlives the load
+    std::vector<std::string_view> strings;
+    strings.reserve(std::min<std::size_t>(string_count, reader.GetRemaining() / sizeof(std::uint32_t)));
+    for (std::uint32_t i = 0; i < string_count; ++i) {
+        if (!reader.ReadString(strings.emplace_back())) { throw corrupt(); }
+    }
+
+    auto sheet = std::make_unique<Sheet>();
+
+    std::vector<std::shared_ptr<const FormulaBody>> bodies;
+    bodies.reserve(std::min<std::size_t>(body_count, reader.GetRemaining() / sizeof(std::uint32_t)));
+    for (std::uint32_t i = 0; i < body_count; ++i) {
+        std::uint32_t key = 0;
+        std::string_view data;
+        if (!reader.Read(key) || (key != NO_INDEX && key >= strings.size()) || !reader.ReadString(data)) {
+            throw corrupt();
+        }
+        try {
+            bodies.push_back(DeserializeFormulaBody(data));
+        } catch (const ParsingError &) {
+            throw corrupt();
+        }
+        if (key != NO_INDEX) {
+            bodies.back() = sheet->formula_interner_.Adopt(std::string(strings[key]), bodies.back());
+        }
+    }
+
+    // all the cells are created first, as a formula may refer to a cell
+    // that comes after it
+    struct Record {
+        Cell *cell;
+        CellKind kind;
+        std::uint32_t index;
+        Position offset;
+        std::optional<double> number;
+        std::optional<FormulaInterface::Value> cache;
+        std::string_view dependencies;
+    };
+    std::vector<Record> records;
+    records.reserve(std::min<std::size_t>(cell_count, reader.GetRemaining() / MIN_CELL_SIZE));
+    std::int64_t top_order = 0;
+    std::int64_t bottom_order = 0;
+    for (std::uint32_t i = 0; i < cell_count; ++i) {
+        std::int32_t row = 0;
+        std::int32_t col = 0;
+        std::int64_t order = 0;
+        Record record{};
+        if (!reader.Read(row) || !reader.Read(col) || !reader.Read(order) || !reader.Read(record.kind)) {
+            throw corrupt();
+        }
+        const Position pos{row, col};
+        if (!pos.IsValid() || sheet->data_.Find(pos)) { throw corrupt(); }
+
+        switch (record.kind) {
+            case CellKind::Empty:
+                break;
+            case CellKind::Text: {
+                std::uint8_t has_number = 0;
+                double number = 0;
+                if (!reader.Read(record.index) || !reader.Read(has_number) || !reader.Read(number)) {
+                    throw corrupt();
+                }
+                if (has_number) { record.number = number; }
+                break;
+            }
+            case CellKind::Formula: {
+                std::int32_t offset_row = 0;
+                std::int32_t offset_col = 0;
+                if (!reader.Read(record.index) || !reader.Read(offset_row) || !reader.Read(offset_col)) {
+                    throw corrupt();
+                }
+                record.offset = Position{offset_row, offset_col};
+                ValueKind value_kind = ValueKind::None;
+                if (with_values && !reader.Read(value_kind)) { throw corrupt(); }
+                if (value_kind == ValueKind::Number) {
+                    double number = 0;
+                    if (!reader.Read(number)) { throw corrupt(); }
+                    record.cache = number;
+                } else if (value_kind == ValueKind::Error) {
+                    std::uint8_t category = 0;
+                    if (!reader.Read(category)
+                        || category > static_cast<std::uint8_t>(FormulaError::Category::Div0)) {
+                        throw corrupt();
+                    }
+                    record.cache = FormulaError(static_cast<FormulaError::Category>(category));
+                } else if (value_kind != ValueKind::None) {
+                    throw corrupt();
+                }
+                std::uint32_t dependency_count = 0;
+                if (!reader.Read(dependency_count)
+                    || !reader.ReadBytes(std::size_t{dependency_count} * sizeof(std::uint32_t), record.dependencies)) {
+                    throw corrupt();
+                }
+                break;
+            }
+            default:
+                throw corrupt();
+        }
+
+        record.cell = sheet->data_.Emplace(pos, *sheet);
+        record.cell->order_ = order;
+        top_order = std::max(top_order, order);
+        bottom_order = std::min(bottom_order, order);
+        records.push_back(record);
+    }
+    if (!reader.AtEnd()) { throw corrupt(); }
+
+    // The formulas get the cells they refer to by index. Those are checked
+    // against the references of the formula and have to come before it in
+    // the order, so the graph is the one that was saved.
+    std::vector<Cell *> dependencies;
+    // built for the first range
+    std::optional<RangeOrders> range_orders;
+    for (const auto &record: records) {
+        const auto cell = record.cell;
+        if (record.kind == CellKind::Text) {
+            if (record.index >= strings.size()) { throw corrupt(); }
+            const auto text = strings[record.index];
+            if (text.empty() || (text.size() > 1 && text[0] == FORMULA_SIGN)) { throw corrupt(); }
+            cell->RestoreText(std::string(text), record.number);
+        } else if (record.kind == CellKind::Formula) {
+            if (record.index >= bodies.size()) { throw corrupt(); }
+            auto formula = MakeFormula(bodies[record.index], record.offset);
+            const auto references = formula->GetReferences();
+            if (record.dependencies.size() != references.cells.size() * sizeof(std::uint32_t)) { throw corrupt(); }
+
+            dependencies.clear();
+            for (std::size_t i = 0; i < references.cells.size(); ++i) {
+                std::uint32_t index = 0;
+                std::memcpy(&index, record.dependencies.data() + i * sizeof(index), sizeof(index));
+                if (index >= records.size()) { throw corrupt(); }
+                const auto dependency = records[index].cell;
+                if (!(dependency->position_ == references.cells[i]) || dependency->order_ >= cell->order_) {
+                    throw corrupt();
+                }
+                dependencies.push_back(dependency);
+            }
+            // the stored cells of a range come before the formula too
+            for (const auto &range: references.ranges) {
+                if (!range.first.IsValid() || !range.last.IsValid() || range.Contains(cell->position_)) {
+                    throw corrupt();
+                }
+                if (!range_orders) {
+                    std::vector<std::pair<Position, std::int64_t>> orders;
+                    orders.reserve(records.size());
+                    for (const auto &stored: records) {
+                        orders.emplace_back(stored.cell->position_, stored.cell->order_);
+                    }
+                    range_orders.emplace(std::move(orders));
+                }
+                if (range_orders->GetMax(range) >= cell->order_) { throw corrupt(); }
+            }
+            cell->RestoreFormula(std::move(formula), dependencies, record.cache);
+        }
+    }
+
+    for (const auto &record: records) {
+        record.cell->RestoreEdges();
+        if (!record.cell->IsEmpty()) { sheet->OnFilled(record.cell->position_); }
+    }
+    sheet->top_order_ = top_order;
+    sheet->bottom_order_ = bottom_order;
+    sheet->lsn_ = lsn;
+    return sheet;
+}
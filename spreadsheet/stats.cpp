@@ -0,0 +1,39 @@
+#include "stats.h"
+
+#ifdef SPREADSHEET_WITH_STATS
+std::size_t EngineCounters::ThreadShard() {
+    static std::atomic<std::size_t> next_shard{0};
+    thread_local const std::size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % SHARD_COUNT;
+    return shard;
+}
+
+void EngineCounters::Max(Counter counter, std::uint64_t value) {
+    auto &max = shards_[0].values[static_cast<std::size_t>(counter)];
+    auto current = max.load(std::memory_order_relaxed);
+    while (current < value && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+std::uint64_t EngineCounters::Get(Counter counter) const {
+    if (counter == Counter::MaxInvalidatedCells) {
+        return shards_[0].values[static_cast<std::size_t>(counter)].load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t sum = 0;
+    for (const auto &shard: shards_) {
+        sum += shard.values[static_cast<std::size_t>(counter)].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+#endif
+
+void EngineCounters::Fill(SheetStats &stats) const {
+    stats.cache_hits = Get(Counter::CacheHits);
+    stats.cache_misses = Get(Counter::CacheMisses);
+    stats.edits = Get(Counter::Edits);
+    stats.invalidated_cells = Get(Counter::InvalidatedCells);
+    stats.max_invalidated_cells = Get(Counter::MaxInvalidatedCells);
+    stats.cycle_check_visits = Get(Counter::CycleCheckVisits);
+    stats.formulas_parsed = Get(Counter::FormulasParsed);
+    stats.parse_nanoseconds = Get(Counter::ParseNanoseconds);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// What Sheet::GetStats reports. The counters count events since the sheet
+// was created and stay zero unless the engine is built with
+// SPREADSHEET_WITH_STATS; the rest describes the sheet as it is.
+struct SheetStats {
+    // lookups of formula values; every miss evaluates the formula
+    std::uint64_t cache_hits = 0;
+    std::uint64_t cache_misses = 0;
+    // edits that changed a cell, and the caches of other cells they cleared
+    std::uint64_t edits = 0;
+    std::uint64_t invalidated_cells = 0;
+    std::uint64_t max_invalidated_cells = 0;
+    // cells visited while keeping the order of the cells acyclic
+    std::uint64_t cycle_check_visits = 0;
+    // expressions actually parsed; formulas of a known shape are not, nor
+    // the ones found in the FormulaCache
+    std::uint64_t formulas_parsed = 0;
+    std::uint64_t parse_nanoseconds = 0;
+
+    std::size_t empty_cells = 0;
+    std::size_t text_cells = 0;
+    std::size_t formula_cells = 0;
+    // the cached values of the formulas and their parsed bodies
+    std::size_t cache_bytes = 0;
+    std::size_t ast_bytes = 0;
+    std::size_t numeric_column_bytes = 0;
+};
+
+// Event counters of a sheet. They are bumped from the threads of
+// RecalculateAll too, so every thread adds to a shard of its own with
+// relaxed atomics and a read sums the shards. Without
+// SPREADSHEET_WITH_STATS all of it compiles to nothing.
+class EngineCounters {
+public:
+    enum class Counter : std::size_t {
+        CacheHits,
+        CacheMisses,
+        Edits,
+        InvalidatedCells,
+        MaxInvalidatedCells,
+        CycleCheckVisits,
+        FormulasParsed,
+        ParseNanoseconds,
+    };
+
+    static constexpr std::size_t COUNTER_COUNT = static_cast<std::size_t>(Counter::ParseNanoseconds) + 1;
+
+#ifdef SPREADSHEET_WITH_STATS
+    void Add(Counter counter, std::uint64_t value = 1) {
+        shards_[ThreadShard()].values[static_cast<std::size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // keeps the largest value in shard 0, Get takes it from there
+    void Max(Counter counter, std::uint64_t value);
+
+    std::uint64_t Get(Counter counter) const;
+#else
+    void Add(Counter, std::uint64_t = 1) {
+    }
+
+    void Max(Counter, std::uint64_t) {
+    }
+
+    std::uint64_t Get(Counter) const {
+        return 0;
+    }
+#endif
+
+    // the counters of a SheetStats
+    void Fill(SheetStats &stats) const;
+
+private:
+#ifdef SPREADSHEET_WITH_STATS
+    static constexpr std::size_t SHARD_COUNT = 16;
+
+    struct alignas(64) Shard {
+        std::array<std::atomic<std::uint64_t>, COUNTER_COUNT> values{};
+    };
+
+    static std::size_t ThreadShard();
+
+    std::array<Shard, SHARD_COUNT> shards_{};
+#endif
+};
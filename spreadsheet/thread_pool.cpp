@@ -0,0 +1,96 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(std::size_t thread_count) {
+    const auto worker_count = std::max<std::size_t>(thread_count, 1) - 1;
+    workers_.reserve(worker_count);
+    for (std::size_t i = 0; i < worker_count; ++i) {
+        workers_.emplace_back([this] { WorkerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    job_ready_.notify_all();
+    for (auto &worker: workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::ParallelFor(std::size_t count, std::size_t grain,
+                             const std::function<void(std::size_t, std::size_t)> &body) {
+    if (count == 0) {
+        return;
+    }
+    grain = std::max<std::size_t>(grain, 1);
+    if (workers_.empty() || count <= grain) {
+        body(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard lock(mutex_);
+        body_ = &body;
+        count_ = count;
+        grain_ = grain;
+        next_.store(0, std::memory_order_relaxed);
+        error_ = nullptr;
+        busy_workers_ = workers_.size();
+        ++generation_;
+    }
+    job_ready_.notify_all();
+
+    RunChunks();
+
+    std::unique_lock lock(mutex_);
+    job_done_.wait(lock, [this] { return busy_workers_ == 0; });
+    body_ = nullptr;
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+void ThreadPool::WorkerLoop() {
+    std::uint64_t seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            job_ready_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+            if (stop_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+
+        RunChunks();
+
+        std::lock_guard lock(mutex_);
+        if (--busy_workers_ == 0) {
+            job_done_.notify_one();
+        }
+    }
+}
+
+void ThreadPool::RunChunks() {
+    while (true) {
+        const auto begin = next_.fetch_add(grain_, std::memory_order_relaxed);
+        if (begin >= count_) {
+            return;
+        }
+
+        try {
+            (*body_)(begin, std::min(begin + grain_, count_));
+        } catch (...) {
+            std::lock_guard lock(mutex_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+            // skip the chunks nobody has taken yet
+            next_.store(count_, std::memory_order_relaxed);
+        }
+    }
+}
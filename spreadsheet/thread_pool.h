@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data-parallel loops. The calling thread
+// takes part in every loop, so a pool of one thread runs everything inline.
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t thread_count);
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool();
+
+    std::size_t GetThreadCount() const {
+        return workers_.size() + 1;
+    }
+
+    // Calls body(begin, end) over chunks of at most grain indices covering
+    // [0, count) and returns when all of them are done. The first exception
+    // thrown by the body is rethrown here.
+    void ParallelFor(std::size_t count, std::size_t grain,
+                     const std::function<void(std::size_t, std::size_t)> &body);
+
+private:
+    void WorkerLoop();
+
+    void RunChunks();
+
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable job_ready_;
+    std::condition_variable job_done_;
+    std::uint64_t generation_ = 0;
+    std::size_t busy_workers_ = 0;
+    bool stop_ = false;
+
+    // the loop being run, written under the mutex before a generation starts
+    const std::function<void(std::size_t, std::size_t)> *body_ = nullptr;
+    std::size_t count_ = 0;
+    std::size_t grain_ = 1;
+    std::atomic<std::size_t> next_{0};
+    std::exception_ptr error_;
+};